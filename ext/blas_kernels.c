@@ -0,0 +1,280 @@
+#include <string.h>
+#include "blas_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BLAS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define BLAS_NEON
+#include <arm_neon.h>
+#endif
+
+/* the portable fallback: the loops of the reference implementation */
+
+static double dot_scalar(long n, const double *x, const double *y)
+{
+  long i, m = n-4;
+  double sum = 0.0;
+  for (i = 0; i < m; i += 5)
+    sum += x[i] * y[i] + x[i+1] * y[i+1] + x[i+2] * y[i+2] +
+           x[i+3] * y[i+3] + x[i+4] * y[i+4];
+  for ( ; i < n; i++)
+    sum += x[i] * y[i];
+  return sum;
+}
+
+static void axpy_scalar(long n, double a, const double *x, double *y)
+{
+  long i, m = n-3;
+  for (i = 0; i < m; i += 4)
+  {
+    y[i] += a * x[i];
+    y[i+1] += a * x[i+1];
+    y[i+2] += a * x[i+2];
+    y[i+3] += a * x[i+3];
+  }
+  for ( ; i < n; ++i)
+    y[i] += a * x[i];
+}
+
+static void scal_scalar(long n, double a, double *x)
+{
+  long i, m = n-4;
+  for (i = 0; i < m; i += 5)
+  {
+    x[i] = a * x[i];
+    x[i+1] = a * x[i+1];
+    x[i+2] = a * x[i+2];
+    x[i+3] = a * x[i+3];
+    x[i+4] = a * x[i+4];
+  }
+  for ( ; i < n; ++i)
+    x[i] = a * x[i];
+}
+
+static const struct blas_kernels scalar_kernels = { "scalar", dot_scalar, axpy_scalar, scal_scalar };
+
+#ifdef BLAS_X86
+
+/* 4 doubles per register, with 4 independent accumulators to hide the latency of the
+   fused multiply adds */
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(long n, const double *x, const double *y)
+{
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+  __m128d h;
+  double sum;
+  long i = 0;
+  for ( ; i + 16 <= n; i += 16)
+  {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4), s1);
+    s2 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+8), _mm256_loadu_pd(y+i+8), s2);
+    s3 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+12), _mm256_loadu_pd(y+i+12), s3);
+  }
+  for ( ; i + 4 <= n; i += 4)
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i), s0);
+  s0 = _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3));
+  h = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+  h = _mm_add_sd(h, _mm_unpackhi_pd(h, h));
+  sum = _mm_cvtsd_f64(h);
+  for ( ; i < n; i++)
+    sum += x[i] * y[i];
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(long n, double a, const double *x, double *y)
+{
+  __m256d va = _mm256_set1_pd(a);
+  long i = 0;
+  for ( ; i + 8 <= n; i += 8)
+  {
+    _mm256_storeu_pd(y+i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+    _mm256_storeu_pd(y+i+4, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4)));
+  }
+  for ( ; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(y+i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+  for ( ; i < n; i++)
+    y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void scal_avx2(long n, double a, double *x)
+{
+  __m256d va = _mm256_set1_pd(a);
+  long i = 0;
+  for ( ; i + 8 <= n; i += 8)
+  {
+    _mm256_storeu_pd(x+i, _mm256_mul_pd(va, _mm256_loadu_pd(x+i)));
+    _mm256_storeu_pd(x+i+4, _mm256_mul_pd(va, _mm256_loadu_pd(x+i+4)));
+  }
+  for ( ; i < n; i++)
+    x[i] = a * x[i];
+}
+
+static const struct blas_kernels avx2_kernels = { "avx2", dot_avx2, axpy_avx2, scal_avx2 };
+
+/* 8 doubles per register, the remainder is handled with masked loads and stores */
+
+__attribute__((target("avx512f")))
+static double dot_avx512(long n, const double *x, const double *y)
+{
+  __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+  __m512d s2 = _mm512_setzero_pd(), s3 = _mm512_setzero_pd();
+  long i = 0;
+  for ( ; i + 32 <= n; i += 32)
+  {
+    s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i), s0);
+    s1 = _mm512_fmadd_pd(_mm512_loadu_pd(x+i+8), _mm512_loadu_pd(y+i+8), s1);
+    s2 = _mm512_fmadd_pd(_mm512_loadu_pd(x+i+16), _mm512_loadu_pd(y+i+16), s2);
+    s3 = _mm512_fmadd_pd(_mm512_loadu_pd(x+i+24), _mm512_loadu_pd(y+i+24), s3);
+  }
+  for ( ; i + 8 <= n; i += 8)
+    s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i), s0);
+  if (i < n)
+  {
+    __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+    s1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, x+i), _mm512_maskz_loadu_pd(m, y+i), s1);
+  }
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(s0, s1), _mm512_add_pd(s2, s3)));
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(long n, double a, const double *x, double *y)
+{
+  __m512d va = _mm512_set1_pd(a);
+  long i = 0;
+  for ( ; i + 16 <= n; i += 16)
+  {
+    _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i)));
+    _mm512_storeu_pd(y+i+8, _mm512_fmadd_pd(va, _mm512_loadu_pd(x+i+8), _mm512_loadu_pd(y+i+8)));
+  }
+  for ( ; i + 8 <= n; i += 8)
+    _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i)));
+  if (i < n)
+  {
+    __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(y+i, m, _mm512_fmadd_pd(va, _mm512_maskz_loadu_pd(m, x+i), _mm512_maskz_loadu_pd(m, y+i)));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void scal_avx512(long n, double a, double *x)
+{
+  __m512d va = _mm512_set1_pd(a);
+  long i = 0;
+  for ( ; i + 8 <= n; i += 8)
+    _mm512_storeu_pd(x+i, _mm512_mul_pd(va, _mm512_loadu_pd(x+i)));
+  if (i < n)
+  {
+    __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(x+i, m, _mm512_mul_pd(va, _mm512_maskz_loadu_pd(m, x+i)));
+  }
+}
+
+static const struct blas_kernels avx512_kernels = { "avx512", dot_avx512, axpy_avx512, scal_avx512 };
+
+#endif
+
+#ifdef BLAS_NEON
+
+/* every aarch64 CPU has NEON, 2 doubles per register */
+
+static double dot_neon(long n, const double *x, const double *y)
+{
+  float64x2_t s0 = vdupq_n_f64(0.0), s1 = vdupq_n_f64(0.0);
+  float64x2_t s2 = vdupq_n_f64(0.0), s3 = vdupq_n_f64(0.0);
+  double sum;
+  long i = 0;
+  for ( ; i + 8 <= n; i += 8)
+  {
+    s0 = vfmaq_f64(s0, vld1q_f64(x+i), vld1q_f64(y+i));
+    s1 = vfmaq_f64(s1, vld1q_f64(x+i+2), vld1q_f64(y+i+2));
+    s2 = vfmaq_f64(s2, vld1q_f64(x+i+4), vld1q_f64(y+i+4));
+    s3 = vfmaq_f64(s3, vld1q_f64(x+i+6), vld1q_f64(y+i+6));
+  }
+  for ( ; i + 2 <= n; i += 2)
+    s0 = vfmaq_f64(s0, vld1q_f64(x+i), vld1q_f64(y+i));
+  sum = vaddvq_f64(vaddq_f64(vaddq_f64(s0, s1), vaddq_f64(s2, s3)));
+  for ( ; i < n; i++)
+    sum += x[i] * y[i];
+  return sum;
+}
+
+static void axpy_neon(long n, double a, const double *x, double *y)
+{
+  float64x2_t va = vdupq_n_f64(a);
+  long i = 0;
+  for ( ; i + 4 <= n; i += 4)
+  {
+    vst1q_f64(y+i, vfmaq_f64(vld1q_f64(y+i), va, vld1q_f64(x+i)));
+    vst1q_f64(y+i+2, vfmaq_f64(vld1q_f64(y+i+2), va, vld1q_f64(x+i+2)));
+  }
+  for ( ; i < n; i++)
+    y[i] += a * x[i];
+}
+
+static void scal_neon(long n, double a, double *x)
+{
+  long i = 0;
+  for ( ; i + 4 <= n; i += 4)
+  {
+    vst1q_f64(x+i, vmulq_n_f64(vld1q_f64(x+i), a));
+    vst1q_f64(x+i+2, vmulq_n_f64(vld1q_f64(x+i+2), a));
+  }
+  for ( ; i < n; i++)
+    x[i] = a * x[i];
+}
+
+static const struct blas_kernels neon_kernels = { "neon", dot_neon, axpy_neon, scal_neon };
+
+#endif
+
+const struct blas_kernels *blas_current_kernels = &scalar_kernels;
+
+int blas_supported_kernels(const struct blas_kernels **kernels, int max)
+{
+  int count = 0;
+  if (count < max)
+    kernels[count++] = &scalar_kernels;
+#ifdef BLAS_X86
+  /* checks CPUID, and that the OS saves the wider registers */
+  __builtin_cpu_init();
+  if (count < max && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels[count++] = &avx2_kernels;
+  if (count < max && __builtin_cpu_supports("avx512f"))
+    kernels[count++] = &avx512_kernels;
+#endif
+#ifdef BLAS_NEON
+  if (count < max)
+    kernels[count++] = &neon_kernels;
+#endif
+  return count;
+}
+
+void blas_init_kernels(void)
+{
+  const struct blas_kernels *kernels[4];
+  int count = blas_supported_kernels(kernels, 4);
+  __atomic_store_n(&blas_current_kernels, kernels[count-1], __ATOMIC_RELEASE);
+}
+
+int blas_use_kernels(const char *name)
+{
+  const struct blas_kernels *kernels[4];
+  int i, count = blas_supported_kernels(kernels, 4);
+  for (i = 0; i < count; i++)
+  {
+    if (strcmp(kernels[i]->name, name) == 0)
+    {
+      __atomic_store_n(&blas_current_kernels, kernels[i], __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,45 @@
+/* blas_kernels.h  --  rubylinear addition: vectorized versions of the unit stride loops
+   of ddot_, daxpy_, dnrm2_ and dscal_, chosen when the extension is loaded according to
+   what the CPU supports. The scalar kernels are the original unrolled loops. */
+
+#ifndef BLAS_KERNELS_INCLUDE
+#define BLAS_KERNELS_INCLUDE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct blas_kernels
+{
+  const char *name;
+  double (*dot)(long n, const double *x, const double *y);
+  void (*axpy)(long n, double a, const double *x, double *y); /* y += a*x */
+  void (*scal)(long n, double a, double *x);
+};
+
+extern const struct blas_kernels *blas_current_kernels;
+
+/* the kernels in use, to be read once per call: Blas.use may switch them meanwhile from
+   another thread */
+static inline const struct blas_kernels *blas_kernels_in_use(void)
+{
+  return __atomic_load_n(&blas_current_kernels, __ATOMIC_ACQUIRE);
+}
+
+/* uses the fastest kernels supported by the CPU */
+void blas_init_kernels(void);
+
+/* stores up to max of the kernels supported by the CPU in kernels, the scalar ones first
+   and the fastest last. Returns their count */
+int blas_supported_kernels(const struct blas_kernels **kernels, int max);
+
+/* uses the kernels called name. Returns -1 if the CPU does not support them. The choice is
+   process wide, for every thread and Ractor: the pointer is swapped atomically, so a kernel
+   call already running finishes with the table it started with */
+int blas_use_kernels(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
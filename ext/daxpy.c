@@ -1,9 +1,10 @@
 #include "blas.h"
+#include "blas_kernels.h"
 
 int daxpy_(int *n, double *sa, double *sx, int *incx, double *sy,
            int *incy)
 {
-  long int i, m, ix, iy, nn, iincx, iincy;
+  long int i, ix, iy, nn, iincx, iincy;
   register double ssa;
 
   /* constant times a vector plus a vector.   
@@ -21,16 +22,7 @@ int daxpy_(int *n, double *sa, double *sx, int *incx, double *sy,
   {
     if (iincx == 1 && iincy == 1) /* code for both increments equal to 1 */
     {
-      m = nn-3;
-      for (i = 0; i < m; i += 4)
-      {
-        sy[i] += ssa * sx[i];
-        sy[i+1] += ssa * sx[i+1];
-        sy[i+2] += ssa * sx[i+2];
-        sy[i+3] += ssa * sx[i+3];
-      }
-      for ( ; i < nn; ++i) /* clean-up loop */
-        sy[i] += ssa * sx[i];
+      blas_kernels_in_use()->axpy(nn, ssa, sx, sy);
     }
     else /* code for unequal increments or equal increments not equal to 1 */
     {
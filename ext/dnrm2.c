@@ -1,5 +1,7 @@
 #include <math.h>  /* Needed for fabs() and sqrt() */
+#include <float.h>
 #include "blas.h"
+#include "blas_kernels.h"
 
 double dnrm2_(int *n, double *x, int *incx)
 {
@@ -25,6 +27,13 @@ double dnrm2_(int *n, double *x, int *incx)
     {
       norm = fabs(x[0]);
     }  
+    else if (iincx == 1 &&
+             (ssq = blas_kernels_in_use()->dot(nn, x, x)) >= DBL_MIN / DBL_EPSILON && ssq <= DBL_MAX)
+    {
+      /* rubylinear addition: the plain sum of squares, unless it overflowed or lost
+         precision to underflow (or is NaN), in which case the scaled loop below is used */
+      norm = sqrt(ssq);
+    }
     else
     {
       scale = 0.0;
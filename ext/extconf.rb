@@ -1,4 +1,8 @@
 require 'mkmf'
 CONFIG["LDSHARED"] = "g++ -shared"
 $CFLAGS = "#{ENV['CFLAGS']} -Wall -O3"
+have_library('pthread')
+have_header('ruby/thread.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_header('zlib.h') if have_library('z')
 create_makefile('rubylinear_native')
@@ -3,8 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <algorithm>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 #include "linear.h"
 #include "tron.h"
+#include "math_kernels.h"
 typedef signed char schar;
 template <class T> static inline void swap(T& x, T& y) { T t=x; x=y; y=t; }
 #ifndef min
@@ -21,1437 +28,3054 @@ template <class S, class T> static inline void clone(T*& dst, S* src, int n)
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
 #define INF HUGE_VAL
 
-static void print_string_stdout(const char *s)
-{
-	fputs(s,stdout);
-	fflush(stdout);
-}
-
-static void (*liblinear_print_string) (const char *) = &print_string_stdout;
-
-#if 1
-int info_on = 0;
-static void info(const char *fmt,...)
+// rubylinear addition: a training logs to its own context (see training_context
+// in linear.h) rather than to a process wide sink; without one it is silent
+static void info(const training_context *context, const char *fmt,...)
 {
+	if(context == NULL || context->print_string == NULL)
+		return;
 	char buf[BUFSIZ];
 	va_list ap;
-  if (info_on==1) {
 	va_start(ap,fmt);
-	vsprintf(buf,fmt,ap);
+	vsnprintf(buf,sizeof(buf),fmt,ap);
 	va_end(ap);
-	(*liblinear_print_string)(buf);
-  }
+	(*context->print_string)(buf, context->print_arg);
 }
-#else
-static void info(const char *fmt,...) {}
-#endif
 
-class l2r_lr_fun : public function
+// rubylinear addition: how the solvers read the instances of a problem.
+//
+// The instances are stored in one of several layouts (problem->storage,
+// see linear.h). Each layout has a Rows type whose rows are read as
+//
+//	for(typename Rows::row xi = x[i]; xi.more(); xi.next())
+//		w[xi.index()-1] += d*xi.value();
+//
+// and the code reading the instances is templated on Rows, so that every
+// layout gets its own compiled loops. DISPATCH_ROWS runs a statement with
+// Rows naming the type for a given problem. Values are always read, and so
+// accumulated, as doubles.
+
+template <class Node>
+class node_rows
 {
 public:
-	l2r_lr_fun(const problem *prob, double Cp, double Cn);
-	~l2r_lr_fun();
+	class row
+	{
+	public:
+		row(const Node *x) : x(x) {}
+		bool more() const { return x->index != -1; }
+		int index() const { return x->index; }
+		double value() const { return x->value; }
+		void next() { x++; }
+	private:
+		const Node *x;
+	};
 
-	double fun(double *w);
-	void grad(double *w, double *g);
-	void Hv(double *s, double *Hs);
+	node_rows(const problem *prob);
+	row operator[](int i) const { return row(x[i]); }
+private:
+	const Node * const *x;
+};
 
-	int get_nr_variable(void);
+template <> inline node_rows<feature_node>::node_rows(const problem *prob) : x(prob->x) {}
+template <> inline node_rows<feature_node_float>::node_rows(const problem *prob) : x(prob->x_float) {}
 
-private:
-	void Xv(double *v, double *Xv);
-	void XTv(double *v, double *XTv);
+typedef node_rows<feature_node> double_rows;
+typedef node_rows<feature_node_float> float_rows;
 
-	double *C;
-	double *z;
-	double *D;
-	const problem *prob;
+// the rows of STORAGE_BINARY, whose values are all 1
+class binary_rows
+{
+public:
+	class row
+	{
+	public:
+		row(const int *x) : x(x) {}
+		bool more() const { return *x != -1; }
+		int index() const { return *x; }
+		double value() const { return 1; }
+		void next() { x++; }
+	private:
+		const int *x;
+	};
+
+	binary_rows(const problem *prob) : x(prob->x_binary) {}
+	row operator[](int i) const { return row(x[i]); }
+private:
+	const int * const *x;
 };
 
-l2r_lr_fun::l2r_lr_fun(const problem *prob, double Cp, double Cn)
+// the rows of STORAGE_CSR, whose length is known up front
+class csr_rows
 {
-	int i;
-	int l=prob->l;
-	int *y=prob->y;
-
-	this->prob = prob;
+public:
+	class row
+	{
+	public:
+		row(const int *index, const double *value, long nnz) : index_(index), value_(value), end(index+nnz) {}
+		bool more() const { return index_ != end; }
+		int index() const { return *index_; }
+		double value() const { return *value_; }
+		void next() { index_++; value_++; }
+		long size() const { return end-index_; }
+		const int *indices() const { return index_; }
+		const double *values() const { return value_; }
+	private:
+		const int *index_;
+		const double *value_;
+		const int *end;
+	};
 
-	z = new double[l];
-	D = new double[l];
-	C = new double[l];
+	csr_rows(const problem *prob) : start(prob->row_start), end(prob->row_end), index(prob->csr_index), value(prob->csr_value) {}
+	row operator[](int i) const { return row(index+start[i], value+start[i], end[i]-start[i]); }
+private:
+	const long *start, *end;
+	const int *index;
+	const double *value;
+};
 
-	for (i=0; i<l; i++)
+// the rows of STORAGE_COMPRESSED, whose indices are decoded on the fly
+class compressed_rows
+{
+public:
+	class row
 	{
-		if (y[i] == 1)
-			C[i] = Cp;
-		else
-			C[i] = Cn;
-	}
-}
+	public:
+		row(const unsigned char *packed, const float *value, long nnz) : packed(packed), value_(value), left(nnz), index_(0)
+		{
+			if(left > 0)
+				decode();
+		}
+		bool more() const { return left > 0; }
+		int index() const { return index_; }
+		double value() const { return *value_; }
+		void next()
+		{
+			value_++;
+			if(--left > 0)
+				decode();
+		}
+	private:
+		void decode()
+		{
+			unsigned char byte = *packed++;
+			unsigned int delta = byte & 0x7f;
+			for(int shift = 7; byte & 0x80; shift += 7)
+			{
+				byte = *packed++;
+				delta |= (unsigned int)(byte & 0x7f) << shift;
+			}
+			index_ += delta;
+		}
+		const unsigned char *packed;
+		const float *value_;
+		long left;
+		int index_;
+	};
+
+	compressed_rows(const problem *prob) : start(prob->row_start), end(prob->row_end), index_start(prob->index_start),
+		packed_index(prob->packed_index), packed_value(prob->packed_value) {}
+	row operator[](int i) const { return row(packed_index+index_start[i], packed_value+start[i], end[i]-start[i]); }
+private:
+	const long *start, *end, *index_start;
+	const unsigned char *packed_index;
+	const float *packed_value;
+};
 
-l2r_lr_fun::~l2r_lr_fun()
+#define DISPATCH_ROWS(prob, ...) \
+	do { \
+		switch((prob)->storage) \
+		{ \
+			case STORAGE_FLOAT: { typedef float_rows Rows; __VA_ARGS__; break; } \
+			case STORAGE_BINARY: { typedef binary_rows Rows; __VA_ARGS__; break; } \
+			case STORAGE_CSR: { typedef csr_rows Rows; __VA_ARGS__; break; } \
+			case STORAGE_COMPRESSED: { typedef compressed_rows Rows; __VA_ARGS__; break; } \
+			default: { typedef double_rows Rows; __VA_ARGS__; break; } \
+		} \
+	} while(0)
+
+template <class Row> static inline double row_dot(const double *w, Row xi)
 {
-	delete[] z;
-	delete[] D;
-	delete[] C;
+	double s = 0;
+	for(; xi.more(); xi.next())
+		s += w[xi.index()-1]*xi.value();
+	return s;
 }
 
-
-double l2r_lr_fun::fun(double *w)
+// w += a*xi
+template <class Row> static inline void row_axpy(double a, Row xi, double *w)
 {
-	int i;
-	double f=0;
-	int *y=prob->y;
-	int l=prob->l;
-	int w_size=get_nr_variable();
+	for(; xi.more(); xi.next())
+		w[xi.index()-1] += a*xi.value();
+}
 
-	Xv(w, z);
-	for(i=0;i<l;i++)
+// w += a*xi^2, elementwise
+template <class Row> static inline void row_axpy_sq(double a, Row xi, double *w)
+{
+	for(; xi.more(); xi.next())
 	{
-		double yz = y[i]*z[i];
-		if (yz >= 0)
-			f += C[i]*log(1 + exp(-yz));
-		else
-			f += C[i]*(-yz+log(1 + exp(yz)));
+		double v = xi.value();
+		w[xi.index()-1] += a*v*v;
 	}
-	f = 2*f;
-	for(i=0;i<w_size;i++)
-		f += w[i]*w[i];
-	f /= 2.0;
-
-	return(f);
 }
 
-void l2r_lr_fun::grad(double *w, double *g)
+template <class Row> static inline double row_sqnorm(Row xi)
 {
-	int i;
-	int *y=prob->y;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-
-	for(i=0;i<l;i++)
+	double s = 0;
+	for(; xi.more(); xi.next())
 	{
-		z[i] = 1/(1 + exp(-y[i]*z[i]));
-		D[i] = z[i]*(1-z[i]);
-		z[i] = C[i]*(z[i]-1)*y[i];
+		double v = xi.value();
+		s += v*v;
 	}
-	XTv(z, g);
-
-	for(i=0;i<w_size;i++)
-		g[i] = w[i] + g[i];
+	return s;
 }
 
-int l2r_lr_fun::get_nr_variable(void)
+// binary rows only add up the weights
+static inline double row_dot(const double *w, binary_rows::row xi)
 {
-	return prob->n;
+	double s = 0;
+	for(; xi.more(); xi.next())
+		s += w[xi.index()-1];
+	return s;
 }
 
-void l2r_lr_fun::Hv(double *s, double *Hs)
+static inline void row_axpy(double a, binary_rows::row xi, double *w)
 {
-	int i;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-	double *wa = new double[l];
-
-	Xv(s, wa);
-	for(i=0;i<l;i++)
-		wa[i] = C[i]*D[i]*wa[i];
-
-	XTv(wa, Hs);
-	for(i=0;i<w_size;i++)
-		Hs[i] = s[i] + Hs[i];
-	delete[] wa;
+	for(; xi.more(); xi.next())
+		w[xi.index()-1] += a;
 }
 
-void l2r_lr_fun::Xv(double *v, double *Xv)
+static inline double row_sqnorm(binary_rows::row xi)
 {
-	int i;
-	int l=prob->l;
-	feature_node **x=prob->x;
+	int nnz = 0;
+	for(; xi.more(); xi.next())
+		nnz++;
+	return nnz;
+}
 
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+// csr rows are plain counted loops over the index and value arrays
+static inline double row_dot(const double *w, csr_rows::row xi)
+{
+	const int *index = xi.indices();
+	const double *value = xi.values();
+	long nnz = xi.size();
+	double s = 0;
+	for(long k=0;k<nnz;k++)
+		s += w[index[k]-1]*value[k];
+	return s;
 }
 
-void l2r_lr_fun::XTv(double *v, double *XTv)
+static inline void row_axpy(double a, csr_rows::row xi, double *w)
 {
-	int i;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-	feature_node **x=prob->x;
+	const int *index = xi.indices();
+	const double *value = xi.values();
+	long nnz = xi.size();
+	for(long k=0;k<nnz;k++)
+		w[index[k]-1] += a*value[k];
+}
 
-	for(i=0;i<w_size;i++)
-		XTv[i]=0;
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		while(s->index!=-1)
-		{
-			XTv[s->index-1]+=v[i]*s->value;
-			s++;
-		}
-	}
+static inline double row_sqnorm(csr_rows::row xi)
+{
+	const double *value = xi.values();
+	long nnz = xi.size();
+	double s = 0;
+	for(long k=0;k<nnz;k++)
+		s += value[k]*value[k];
+	return s;
 }
 
-class l2r_l2_svc_fun : public function
+template <class Rows> static long count_nnz(const problem *prob)
 {
-public:
-	l2r_l2_svc_fun(const problem *prob, double Cp, double Cn);
-	~l2r_l2_svc_fun();
+	long nnz = 0;
+	Rows x(prob);
+	for(int i=0;i<prob->l;i++)
+		for(typename Rows::row xi = x[i]; xi.more(); xi.next())
+			nnz++;
+	return nnz;
+}
 
-	double fun(double *w);
-	void grad(double *w, double *g);
-	void Hv(double *s, double *Hs);
+// rubylinear addition: early stopping on a validation problem.
+//
+// The solvers call stop(w) at the end of each outer iteration. Every
+// interval calls w is scored on the validation data (the accuracy of the
+// binary subproblem, or of the multi-class model for MCSVM_CS) and stop()
+// returns true once the score has not improved for patience scores in a
+// row, after restoring the best w seen so far. The decision values are
+// computed on several threads when the validation data is large.
 
-	int get_nr_variable(void);
+#define VALIDATION_MIN_NNZ_PER_THREAD 65536
+#define VALIDATION_MAX_THREADS 8
+
+class early_stopping
+{
+public:
+	// w_size and bias describe the training problem; nr_w is 1 for a binary
+	// subproblem whose positive instances have label[0], and nr_class for
+	// MCSVM_CS, where w is laid out like model->w and label is model->label
+	early_stopping(const parameter *param, int w_size, double bias, int nr_w, const int *label);
+	~early_stopping();
+	bool stop(double *w);
+	int score_range(const double *w, int begin, int end);
 
 private:
-	void Xv(double *v, double *Xv);
-	void subXv(double *v, double *Xv);
-	void subXTv(double *v, double *XTv);
+	double score(const double *w);
+	template <class Rows> int score_rows(const double *w, int begin, int end);
 
-	double *C;
-	double *z;
-	double *D;
-	int *I;
-	int sizeI;
-	const problem *prob;
+	const problem *validation;
+	int patience;
+	int interval;
+	int w_size;
+	int nr_feature;
+	double bias;
+	int nr_w;
+	const int *label;
+	int nr_thread;
+	const training_context *context;
+
+	int nr_call;
+	int nr_bad;
+	double best_score;
+	double *best_w;
 };
 
-l2r_l2_svc_fun::l2r_l2_svc_fun(const problem *prob, double Cp, double Cn)
+early_stopping::early_stopping(const parameter *param, int w_size, double bias, int nr_w, const int *label)
 {
-	int i;
-	int l=prob->l;
-	int *y=prob->y;
+	this->validation = param->validation;
+	this->patience = param->patience;
+	this->interval = param->validation_interval;
+	this->w_size = w_size;
+	this->bias = bias;
+	this->nr_feature = bias >= 0 ? w_size-1 : w_size;
+	this->nr_w = nr_w;
+	this->label = label;
+	this->context = param->context;
+
+	long nnz = 0;
+	DISPATCH_ROWS(validation, nnz = count_nnz<Rows>(validation));
+	nr_thread = (int)min((long)VALIDATION_MAX_THREADS, nnz*nr_w/VALIDATION_MIN_NNZ_PER_THREAD);
+	nr_thread = max(1, min(nr_thread, validation->l));
+
+	nr_call = 0;
+	nr_bad = 0;
+	best_score = -INF;
+	best_w = new double[w_size*nr_w];
+}
 
-	this->prob = prob;
+early_stopping::~early_stopping()
+{
+	delete[] best_w;
+}
 
-	z = new double[l];
-	D = new double[l];
-	C = new double[l];
-	I = new int[l];
+// number of correctly classified instances in [begin, end)
+int early_stopping::score_range(const double *w, int begin, int end)
+{
+	int correct = 0;
+	DISPATCH_ROWS(validation, correct = score_rows<Rows>(w, begin, end));
+	return correct;
+}
 
-	for (i=0; i<l; i++)
+template <class Rows>
+int early_stopping::score_rows(const double *w, int begin, int end)
+{
+	int correct = 0;
+	Rows x(validation);
+	double *dec = new double[nr_w];
+	for(int i=begin;i<end;i++)
 	{
-		if (y[i] == 1)
-			C[i] = Cp;
+		int m;
+		for(m=0;m<nr_w;m++)
+			dec[m] = 0;
+		// the validation data may have its own bias feature (of index n
+		// when bias > 0) or more features than the training data
+		for(typename Rows::row xi = x[i]; xi.more(); xi.next())
+		{
+			int index = xi.index();
+			if(validation->bias > 0 && index == validation->n)
+				break;
+			if(index <= nr_feature)
+				for(m=0;m<nr_w;m++)
+					dec[m] += w[(index-1)*nr_w+m]*xi.value();
+		}
+		if(bias >= 0)
+			for(m=0;m<nr_w;m++)
+				dec[m] += w[(w_size-1)*nr_w+m]*bias;
+
+		if(nr_w == 1)
+		{
+			if((dec[0] > 0) == (validation->y[i] == label[0]))
+				correct++;
+		}
 		else
-			C[i] = Cn;
+		{
+			int dec_max_idx = 0;
+			for(m=1;m<nr_w;m++)
+				if(dec[m] > dec[dec_max_idx])
+					dec_max_idx = m;
+			if(validation->y[i] == label[dec_max_idx])
+				correct++;
+		}
 	}
+	delete[] dec;
+	return correct;
 }
 
-l2r_l2_svc_fun::~l2r_l2_svc_fun()
+struct validation_task
 {
-	delete[] z;
-	delete[] D;
-	delete[] C;
-	delete[] I;
+	early_stopping *stopper;
+	const double *w;
+	int begin, end;
+	int correct;
+};
+
+static void *validation_worker(void *arg)
+{
+	validation_task *task = (validation_task *)arg;
+	task->correct = task->stopper->score_range(task->w, task->begin, task->end);
+	return NULL;
 }
 
-double l2r_l2_svc_fun::fun(double *w)
+double early_stopping::score(const double *w)
 {
 	int i;
-	double f=0;
-	int *y=prob->y;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-
-	Xv(w, z);
-	for(i=0;i<l;i++)
+	int l = validation->l;
+	validation_task *tasks = new validation_task[nr_thread];
+	pthread_t *threads = new pthread_t[nr_thread];
+	bool *started = new bool[nr_thread];
+	for(i=0;i<nr_thread;i++)
 	{
-		z[i] = y[i]*z[i];
-		double d = 1-z[i];
-		if (d > 0)
-			f += C[i]*d*d;
+		tasks[i].stopper = this;
+		tasks[i].w = w;
+		tasks[i].begin = (int)((long)i*l/nr_thread);
+		tasks[i].end = (int)((long)(i+1)*l/nr_thread);
+		started[i] = i > 0 && pthread_create(&threads[i], NULL, validation_worker, &tasks[i]) == 0;
 	}
-	f = 2*f;
-	for(i=0;i<w_size;i++)
-		f += w[i]*w[i];
-	f /= 2.0;
-
-	return(f);
+	int correct = 0;
+	for(i=0;i<nr_thread;i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			validation_worker(&tasks[i]);
+		correct += tasks[i].correct;
+	}
+	delete[] tasks;
+	delete[] threads;
+	delete[] started;
+	return l > 0 ? (double)correct/l : 0;
 }
 
-void l2r_l2_svc_fun::grad(double *w, double *g)
+bool early_stopping::stop(double *w)
 {
-	int i;
-	int *y=prob->y;
-	int l=prob->l;
-	int w_size=get_nr_variable();
+	if(++nr_call % interval != 0)
+		return false;
 
-	sizeI = 0;
-	for (i=0;i<l;i++)
-		if (z[i] < 1)
-		{
-			z[sizeI] = C[i]*y[i]*(z[i]-1);
-			I[sizeI] = i;
-			sizeI++;
-		}
-	subXTv(z, g);
+	double current = score(w);
+	info(context, "validation accuracy %g\n", current);
+	if(current > best_score)
+	{
+		best_score = current;
+		memcpy(best_w, w, sizeof(double)*w_size*nr_w);
+		nr_bad = 0;
+		return false;
+	}
+	if(++nr_bad < patience)
+		return false;
 
-	for(i=0;i<w_size;i++)
-		g[i] = w[i] + 2*g[i];
+	info(context, "\nstopping early, best validation accuracy %g\n", best_score);
+	memcpy(w, best_w, sizeof(double)*w_size*nr_w);
+	return true;
 }
 
-int l2r_l2_svc_fun::get_nr_variable(void)
+static double wall_time()
 {
-	return prob->n;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
 }
 
-void l2r_l2_svc_fun::Hv(double *s, double *Hs)
+// rubylinear addition: the random numbers of one training, in place of the
+// global rand() that every thread of the process shares (and locks).
+// xoshiro256** (Blackman and Vigna), seeded through splitmix64 so that
+// nearby seeds give unrelated sequences.
+class random_generator
 {
-	int i;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-	double *wa = new double[l];
+public:
+	random_generator(unsigned long long seed);
+	// uniform in [0, n), for 0 < n < 2^32
+	inline int uniform(int n);
 
-	subXv(s, wa);
-	for(i=0;i<sizeI;i++)
-		wa[i] = C[I[i]]*wa[i];
+private:
+	inline unsigned long long next();
+	unsigned long long s[4];
+};
 
-	subXTv(wa, Hs);
-	for(i=0;i<w_size;i++)
-		Hs[i] = s[i] + 2*Hs[i];
-	delete[] wa;
+random_generator::random_generator(unsigned long long seed)
+{
+	for(int i=0;i<4;i++)
+	{
+		unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		s[i] = z ^ (z >> 31);
+	}
 }
 
-void l2r_l2_svc_fun::Xv(double *v, double *Xv)
+inline unsigned long long random_generator::next()
 {
-	int i;
-	int l=prob->l;
-	feature_node **x=prob->x;
+	unsigned long long result = s[1]*5;
+	result = ((result << 7) | (result >> 57))*9;
+	unsigned long long t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+	return result;
+}
 
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+inline int random_generator::uniform(int n)
+{
+	// the high 32 bits scaled to [0, n) (Lemire), without the modulo's division
+	return (int)(((next() >> 32)*(unsigned long long)n) >> 32);
 }
 
-void l2r_l2_svc_fun::subXv(double *v, double *Xv)
+// rubylinear addition: the limits of one call to a solver. The solvers take
+// their iteration limits from the monitor and call stop(w) at the end of
+// each outer iteration, which checks the time budget and the validation
+// problem. reason records why the solver stopped; w is always left at the
+// best solution found so far. stop(w) also ends the solver once the
+// training is cancelled through its context.
+//
+// The monitor is all the solvers know of the training besides the problem
+// and its parameters: they log with info(), shuffle with random (seeded with
+// param->seed, so every call shuffles the same way whatever else runs in the
+// process) and run on nr_thread threads.
+class solver_monitor
 {
-	int i;
-	feature_node **x=prob->x;
+public:
+	// the last arguments are passed on to early_stopping
+	solver_monitor(const parameter *param, double deadline, int w_size, double bias, int nr_w, const int *label);
+	~solver_monitor();
+	int max_iter(int default_max_iter) const;
+	int max_newton_iter(int default_max_newton_iter) const;
+	bool stop(double *w);
+	bool cancelled();
+	void reached_max_iter();
+	void info(const char *fmt,...);
+
+	int reason;
+	random_generator random;
+	int nr_thread;
+	training_context *context;
 
-	for(i=0;i<sizeI;i++)
-	{
-		feature_node *s=x[I[i]];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+private:
+	const parameter *param;
+	double deadline;
+	early_stopping *validation;
+};
+
+solver_monitor::solver_monitor(const parameter *param, double deadline, int w_size, double bias, int nr_w, const int *label)
+	: random(param->seed)
+{
+	this->param = param;
+	this->deadline = deadline;
+	this->validation = NULL;
+	if(param->validation != NULL)
+		this->validation = new early_stopping(param, w_size, bias, nr_w, label);
+	reason = STOP_CONVERGED;
+	nr_thread = param->nr_thread;
+	context = param->context;
 }
 
-void l2r_l2_svc_fun::subXTv(double *v, double *XTv)
+solver_monitor::~solver_monitor()
 {
-	int i;
-	int w_size=get_nr_variable();
-	feature_node **x=prob->x;
+	delete validation;
+}
 
-	for(i=0;i<w_size;i++)
-		XTv[i]=0;
-	for(i=0;i<sizeI;i++)
-	{
-		feature_node *s=x[I[i]];
-		while(s->index!=-1)
-		{
-			XTv[s->index-1]+=v[i]*s->value;
-			s++;
-		}
-	}
+int solver_monitor::max_iter(int default_max_iter) const
+{
+	return param->max_iter > 0 ? param->max_iter : default_max_iter;
 }
 
-// A coordinate descent algorithm for 
-// multi-class support vector machines by Crammer and Singer
-//
-//  min_{\alpha}  0.5 \sum_m ||w_m(\alpha)||^2 + \sum_i \sum_m e^m_i alpha^m_i
-//    s.t.     \alpha^m_i <= C^m_i \forall m,i , \sum_m \alpha^m_i=0 \forall i
-// 
-//  where e^m_i = 0 if y_i  = m,
-//        e^m_i = 1 if y_i != m,
-//  C^m_i = C if m  = y_i, 
-//  C^m_i = 0 if m != y_i, 
-//  and w_m(\alpha) = \sum_i \alpha^m_i x_i 
-//
-// Given: 
-// x, y, C
-// eps is the stopping tolerance
-//
-// solution will be put in w
-//
-// See Appendix of LIBLINEAR paper, Fan et al. (2008)
+int solver_monitor::max_newton_iter(int default_max_newton_iter) const
+{
+	return param->max_newton_iter > 0 ? param->max_newton_iter : default_max_newton_iter;
+}
 
-#define GETI(i) (prob->y[i])
-// To support weights for instances, use GETI(i) (i)
+bool solver_monitor::stop(double *w)
+{
+	if(cancelled())
+		return true;
+	if(wall_time() >= deadline)
+	{
+		info("\nWARNING: time budget exhausted\n");
+		reason = STOP_TIME_BUDGET;
+		return true;
+	}
+	if(validation != NULL && validation->stop(w))
+	{
+		reason = STOP_VALIDATION;
+		return true;
+	}
+	return false;
+}
 
-class Solver_MCSVM_CS
+bool solver_monitor::cancelled()
 {
-	public:
-		Solver_MCSVM_CS(const problem *prob, int nr_class, double *C, double eps=0.1, int max_iter=100000);
-		~Solver_MCSVM_CS();
-		void Solve(double *w);
-	private:
-		void solve_sub_problem(double A_i, int yi, double C_yi, int active_i, double *alpha_new);
-		bool be_shrunk(int i, int m, int yi, double alpha_i, double minG);
-		double *B, *C, *G;
-		int w_size, l;
-		int nr_class;
-		int max_iter;
-		double eps;
-		const problem *prob;
-};
+	if(context == NULL || !context->cancel)
+		return false;
+	info("\ncancelled\n");
+	reason = STOP_CANCELLED;
+	return true;
+}
 
-Solver_MCSVM_CS::Solver_MCSVM_CS(const problem *prob, int nr_class, double *weighted_C, double eps, int max_iter)
+void solver_monitor::reached_max_iter()
 {
-	this->w_size = prob->n;
-	this->l = prob->l;
-	this->nr_class = nr_class;
-	this->eps = eps;
-	this->max_iter = max_iter;
-	this->prob = prob;
-	this->B = new double[nr_class];
-	this->G = new double[nr_class];
-	this->C = weighted_C;
+	if(reason == STOP_CONVERGED)
+		reason = STOP_MAX_ITER;
 }
 
-Solver_MCSVM_CS::~Solver_MCSVM_CS()
+void solver_monitor::info(const char *fmt,...)
 {
-	delete[] B;
-	delete[] G;
+	if(context == NULL || context->print_string == NULL)
+		return;
+	char buf[BUFSIZ];
+	va_list ap;
+	va_start(ap,fmt);
+	vsnprintf(buf,sizeof(buf),fmt,ap);
+	va_end(ap);
+	(*context->print_string)(buf, context->print_arg);
 }
 
-int compare_double(const void *a, const void *b)
+// rubylinear addition: the weight of instance i, 1 when the problem has none
+static inline double instance_weight(const problem *prob, int i)
 {
-	if(*(double *)a > *(double *)b)
-		return -1;
-	if(*(double *)a < *(double *)b)
-		return 1;
-	return 0;
+	return prob->W != NULL ? prob->W[i] : 1;
 }
 
-void Solver_MCSVM_CS::solve_sub_problem(double A_i, int yi, double C_yi, int active_i, double *alpha_new)
+// XTv += \sum_{i < count} v[i] x_{I[i]}, with I[i] = i if I is NULL
+template <class Rows>
+static void rows_XTv(const problem *prob, const int *I, int count, const double *v, double *XTv)
 {
-	int r;
-	double *D;
+	Rows x(prob);
+	for(int i=0;i<count;i++)
+		row_axpy(v[i], x[I != NULL ? I[i] : i], XTv);
+}
 
-	clone(D, B, active_i);
-	if(yi < active_i)
-		D[yi] += A_i*C_yi;
-	qsort(D, active_i, sizeof(double), compare_double);
+// XTv += \sum_{i < count} v[i] x_{I[i]}^2 elementwise, with I[i] = i if I is NULL
+template <class Rows>
+static void rows_XTv_sq(const problem *prob, const int *I, int count, const double *v, double *XTv)
+{
+	Rows x(prob);
+	for(int i=0;i<count;i++)
+		row_axpy_sq(v[i], x[I != NULL ? I[i] : i], XTv);
+}
 
-	double beta = D[0] - A_i*C_yi;
-	for(r=1;r<active_i && beta<r*D[r];r++)
-		beta += D[r];
+// rubylinear addition: the rows that the Hessian-vector products of TRON are computed on
+// (subsampled Newton, Byrd et al., SIAM J. Optim. 2011). Each draw keeps a fraction of the
+// rows, in increasing order, and scale makes the sampled Hessian an unbiased estimate of
+// the full one. The rows are drawn with the random numbers of the training
+class hessian_sampler
+{
+public:
+	hessian_sampler(double fraction, int l, random_generator *random);
+	~hessian_sampler();
 
-	beta /= r;
-	for(r=0;r<active_i;r++)
-	{
-		if(r == yi)
-			alpha_new[r] = min(C_yi, (beta-B[r])/A_i);
-		else
-			alpha_new[r] = min((double)0, (beta - B[r])/A_i);
-	}
-	delete[] D;
+	// draws from the count rows I[0..count) (0..count-1 if I is NULL)
+	void draw(const int *I, int count);
+
+	int *rows;
+	int size;
+	double scale;
+
+private:
+	double fraction;
+	random_generator *random;
+};
+
+hessian_sampler::hessian_sampler(double fraction, int l, random_generator *random)
+{
+	this->fraction = fraction;
+	this->random = random;
+	rows = new int[l];
+	size = 0;
+	scale = 1;
 }
 
-bool Solver_MCSVM_CS::be_shrunk(int i, int m, int yi, double alpha_i, double minG)
+hessian_sampler::~hessian_sampler()
 {
-	double bound = 0;
-	if(m == yi)
-		bound = C[GETI(i)];
-	if(alpha_i == bound && G[m] < minG)
-		return true;
-	return false;
+	delete[] rows;
 }
 
-void Solver_MCSVM_CS::Solve(double *w)
+void hessian_sampler::draw(const int *I, int count)
 {
-	int i, m, s;
-	int iter = 0;
-	double *alpha =  new double[l*nr_class];
-	double *alpha_new = new double[nr_class];
-	int *index = new int[l];
-	double *QD = new double[l];
-	int *d_ind = new int[nr_class];
-	double *d_val = new double[nr_class];
-	int *alpha_index = new int[nr_class*l];
-	int *y_index = new int[l];
-	int active_size = l;
-	int *active_size_i = new int[l];
-	double eps_shrink = max(10.0*eps, 1.0); // stopping tolerance for shrinking
-	bool start_from_all = true;
-	// initial
-	for(i=0;i<l*nr_class;i++)
-		alpha[i] = 0;
-	for(i=0;i<w_size*nr_class;i++)
-		w[i] = 0; 
-	for(i=0;i<l;i++)
+	int i;
+	for(i=0;i<count;i++)
+		rows[i] = I != NULL ? I[i] : i;
+	size = min(count, max(1, (int)ceil(fraction*count)));
+	for(i=0;i<size;i++)
 	{
-		for(m=0;m<nr_class;m++)
-			alpha_index[i*nr_class+m] = m;
-		feature_node *xi = prob->x[i];
-		QD[i] = 0;
-		while(xi->index != -1)
-		{
-			QD[i] += (xi->value)*(xi->value);
-			xi++;
-		}
-		active_size_i[i] = nr_class;
-		y_index[i] = prob->y[i];
-		index[i] = i;
+		int j = i+random->uniform(count-i);
+		swap(rows[i], rows[j]);
 	}
+	std::sort(rows, rows+size);
+	scale = size > 0 ? (double)count/size : 1;
+}
 
-	while(iter < max_iter) 
+// rubylinear addition: the losses of the TRON solvers, for rows_loss. evaluate is given the
+// margins yz[0..end-begin) of the samples begin..end-1 and returns the sum of their losses
+// times C. It stores the gradient coefficients of the active samples in coef, packed from
+// index *k on with their rows in I (or at the index of each sample when every sample is
+// active and I is NULL), and the curvature of each sample in D when the Hessian needs it
+#define LOSS_BLOCK 256
+
+struct logistic_loss
+{
+	static inline double evaluate(int begin, int end, const int *y, const double *C, const double *yz,
+		double *coef, double *D, int *I, int *k)
 	{
-		double stopping = -INF;
-		for(i=0;i<active_size;i++)
+		// e = exp(-|yz|) gives both the loss and sigma = 1/(1+exp(-yz)), and the vectorized
+		// kernels compute a block of them at a time
+		double e[LOSS_BLOCK], log1p_e[LOSS_BLOCK];
+		int i, n = end-begin;
+		double f = 0;
+		for(i=0;i<n;i++)
+			e[i] = -fabs(yz[i]);
+		const math_kernels *kernels = math_kernels_in_use();
+		kernels->exp(n, e, e);
+		kernels->log1p(n, e, log1p_e);
+		for(i=0;i<n;i++)
 		{
-			int j = i+rand()%(active_size-i);
-			swap(index[i], index[j]);
+			int j = begin+i;
+			double loss, sigma;
+			if (yz[i] >= 0)
+			{
+				loss = log1p_e[i];
+				sigma = 1/(1 + e[i]);
+			}
+			else
+			{
+				loss = -yz[i]+log1p_e[i];
+				sigma = e[i]/(1 + e[i]);
+			}
+			D[j] = C[j]*sigma*(1-sigma);
+			coef[j] = C[j]*(sigma-1)*y[j];
+			f += C[j]*loss;
 		}
-		for(s=0;s<active_size;s++)
-		{
-			i = index[s];
-			double Ai = QD[i];
-			double *alpha_i = &alpha[i*nr_class];
-			int *alpha_index_i = &alpha_index[i*nr_class];
+		return f;
+	}
+};
 
-			if(Ai > 0)
+struct squared_hinge_loss
+{
+	static inline double evaluate(int begin, int end, const int *y, const double *C, const double *yz,
+		double *coef, double *D, int *I, int *k)
+	{
+		double f = 0;
+		for(int i=0;i<end-begin;i++)
+			if(yz[i] < 1)
 			{
-				for(m=0;m<active_size_i[i];m++)
-					G[m] = 1;
-				if(y_index[i] < active_size_i[i])
-					G[y_index[i]] = 0;
+				int j = begin+i;
+				double d = 1-yz[i];
+				f += C[j]*d*d;
+				coef[*k] = 2*C[j]*y[j]*(yz[i]-1);
+				I[*k] = j;
+				(*k)++;
+			}
+		return f;
+	}
+};
 
-				feature_node *xi = prob->x[i];
-				while(xi->index!= -1)
-				{
-					double *w_i = &w[(xi->index-1)*nr_class];
-					for(m=0;m<active_size_i[i];m++)
-						G[m] += w_i[alpha_index_i[m]]*(xi->value);
-					xi++;
-				}
+// rubylinear addition: a single pass over the rows computing the margins, the loss and the
+// gradient coefficients (see the losses above), a block of rows at a time so that the margins
+// stay in cache. The number of active samples is stored in sizeI when it is not NULL
+template <class Loss, class Rows>
+static double rows_loss(const problem *prob, const double *C, const double *w, double *coef, double *D, int *I, int *sizeI)
+{
+	Rows x(prob);
+	const int *y = prob->y;
+	double yz[LOSS_BLOCK];
+	double f = 0;
+	int k = 0;
+	for(int begin=0;begin<prob->l;begin+=LOSS_BLOCK)
+	{
+		int end = min(prob->l, begin+LOSS_BLOCK);
+		for(int i=begin;i<end;i++)
+			yz[i-begin] = y[i]*row_dot(w, x[i]);
+		f += Loss::evaluate(begin, end, y, C, yz, coef, D, I, &k);
+	}
+	if(sizeI != NULL)
+		*sizeI = k;
+	return f;
+}
 
-				double minG = INF;
-				double maxG = -INF;
-				for(m=0;m<active_size_i[i];m++)
-				{
-					if(alpha_i[alpha_index_i[m]] < 0 && G[m] < minG)
-						minG = G[m];
-					if(G[m] > maxG)
-						maxG = G[m];
-				}
-				if(y_index[i] < active_size_i[i])
-					if(alpha_i[prob->y[i]] < C[GETI(i)] && G[y_index[i]] < minG)
-						minG = G[y_index[i]];
+// rubylinear addition: Hs += \sum_{i < count} scale D_{I[i]} (x_{I[i]}^T s) x_{I[i]}, with
+// I[i] = i if I is NULL, in a single pass over the rows
+template <class Rows>
+static void rows_XTDXv(const problem *prob, const int *I, int count, double scale, const double *D, const double *s, double *Hs)
+{
+	Rows x(prob);
+	for(int i=0;i<count;i++)
+	{
+		int j = I != NULL ? I[i] : i;
+		row_axpy(scale*D[j]*row_dot(s, x[j]), x[j], Hs);
+	}
+}
 
-				for(m=0;m<active_size_i[i];m++)
-				{
-					if(be_shrunk(i, m, y_index[i], alpha_i[alpha_index_i[m]], minG))
-					{
-						active_size_i[i]--;
-						while(active_size_i[i]>m)
-						{
-							if(!be_shrunk(i, active_size_i[i], y_index[i], 
-											alpha_i[alpha_index_i[active_size_i[i]]], minG))
-							{
-								swap(alpha_index_i[m], alpha_index_i[active_size_i[i]]);
-								swap(G[m], G[active_size_i[i]]);
-								if(y_index[i] == active_size_i[i])
-									y_index[i] = m;
-								else if(y_index[i] == m) 
-									y_index[i] = active_size_i[i];
-								break;
-							}
-							active_size_i[i]--;
-						}
-					}
-				}
+class l2r_lr_fun : public function
+{
+public:
+	l2r_lr_fun(const problem *prob, double Cp, double Cn, double hessian_sample, random_generator *random);
+	~l2r_lr_fun();
 
-				if(active_size_i[i] <= 1)
-				{
-					active_size--;
-					swap(index[s], index[active_size]);
-					s--;	
-					continue;
-				}
+	double fun(double *w);
+	void grad(double *w, double *g);
+	void Hv(double *s, double *Hs);
+	void get_diag_preconditioner(double *M);
 
-				if(maxG-minG <= 1e-12)
-					continue;
-				else
-					stopping = max(maxG - minG, stopping);
+	int get_nr_variable(void);
 
-				for(m=0;m<active_size_i[i];m++)
-					B[m] = G[m] - Ai*alpha_i[alpha_index_i[m]] ;
+private:
+	double *C;
+	double *z;
+	double *D;
+	// rubylinear addition: fun stores the curvatures of its w here, grad makes them D. A step
+	// that TRON rejects thus leaves the D of the current w to Hv
+	double *D_new;
+	hessian_sampler *sampler;
+	const problem *prob;
+};
 
-				solve_sub_problem(Ai, y_index[i], C[GETI(i)], active_size_i[i], alpha_new);
-				int nz_d = 0;
-				for(m=0;m<active_size_i[i];m++)
-				{
-					double d = alpha_new[m] - alpha_i[alpha_index_i[m]];
-					alpha_i[alpha_index_i[m]] = alpha_new[m];
-					if(fabs(d) >= 1e-12)
-					{
-						d_ind[nz_d] = alpha_index_i[m];
-						d_val[nz_d] = d;
-						nz_d++;
-					}
-				}
+l2r_lr_fun::l2r_lr_fun(const problem *prob, double Cp, double Cn, double hessian_sample, random_generator *random)
+{
+	int i;
+	int l=prob->l;
+	int *y=prob->y;
 
-				xi = prob->x[i];
-				while(xi->index != -1)
-				{
-					double *w_i = &w[(xi->index-1)*nr_class];
-					for(m=0;m<nz_d;m++)
-						w_i[d_ind[m]] += d_val[m]*xi->value;
-					xi++;
-				}
-			}
-		}
+	this->prob = prob;
 
-		iter++;
-		if(iter % 10 == 0)
-		{
-			info(".");
-		}
+	z = new double[l];
+	D = new double[l];
+	D_new = new double[l];
+	C = new double[l];
+	sampler = hessian_sample > 0 && hessian_sample < 1 ? new hessian_sampler(hessian_sample, l, random) : NULL;
 
-		if(stopping < eps_shrink)
-		{
-			if(stopping < eps && start_from_all == true)
-				break;
-			else
-			{
-				active_size = l;
-				for(i=0;i<l;i++)
-					active_size_i[i] = nr_class;
-				info("*");
-				eps_shrink = max(eps_shrink/2, eps);
-				start_from_all = true;
-			}
-		}
+	for (i=0; i<l; i++)
+	{
+		if (y[i] == 1)
+			C[i] = Cp*instance_weight(prob, i);
 		else
-			start_from_all = false;
+			C[i] = Cn*instance_weight(prob, i);
 	}
+}
+
+l2r_lr_fun::~l2r_lr_fun()
+{
+	delete[] z;
+	delete[] D;
+	delete[] D_new;
+	delete[] C;
+	delete sampler;
+}
 
-	info("\noptimization finished, #iter = %d\n",iter);
-	if (iter >= max_iter)
-		info("\nWARNING: reaching max number of iterations\n");
+// rubylinear addition: also computes the gradient coefficients z and the curvatures for grad
+double l2r_lr_fun::fun(double *w)
+{
+	int i;
+	double f=0;
+	int w_size=get_nr_variable();
 
-	// calculate objective value
-	double v = 0;
-	int nSV = 0;
-	for(i=0;i<w_size*nr_class;i++)
-		v += w[i]*w[i];
-	v = 0.5*v;
-	for(i=0;i<l*nr_class;i++)
-	{
-		v += alpha[i];
-		if(fabs(alpha[i]) > 0)
-			nSV++;
-	}
-	for(i=0;i<l;i++)
-		v -= alpha[i*nr_class+prob->y[i]];
-	info("Objective value = %lf\n",v);
-	info("nSV = %d\n",nSV);
+	DISPATCH_ROWS(prob, f = rows_loss<logistic_loss, Rows>(prob, C, w, z, D_new, NULL, NULL));
+	f = 2*f;
+	for(i=0;i<w_size;i++)
+		f += w[i]*w[i];
+	f /= 2.0;
 
-	delete [] alpha;
-	delete [] alpha_new;
-	delete [] index;
-	delete [] QD;
-	delete [] d_ind;
-	delete [] d_val;
-	delete [] alpha_index;
-	delete [] y_index;
-	delete [] active_size_i;
+	return(f);
 }
 
-// A coordinate descent algorithm for 
-// L1-loss and L2-loss SVM dual problems
-//
-//  min_\alpha  0.5(\alpha^T (Q + D)\alpha) - e^T \alpha,
-//    s.t.      0 <= alpha_i <= upper_bound_i,
-// 
-//  where Qij = yi yj xi^T xj and
-//  D is a diagonal matrix 
-//
-// In L1-SVM case:
-// 		upper_bound_i = Cp if y_i = 1
-// 		upper_bound_i = Cn if y_i = -1
-// 		D_ii = 0
-// In L2-SVM case:
-// 		upper_bound_i = INF
-// 		D_ii = 1/(2*Cp)	if y_i = 1
-// 		D_ii = 1/(2*Cn)	if y_i = -1
-//
-// Given: 
-// x, y, Cp, Cn
-// eps is the stopping tolerance
-//
-// solution will be put in w
-// 
-// See Algorithm 3 of Hsieh et al., ICML 2008
+// rubylinear addition: w must be the one of the last fun call, which TRON guarantees
+void l2r_lr_fun::grad(double *w, double *g)
+{
+	int i;
+	int l=prob->l;
+	int w_size=get_nr_variable();
 
-#undef GETI
-#define GETI(i) (y[i]+1)
-// To support weights for instances, use GETI(i) (i)
+	swap(D, D_new);
+	for(i=0;i<w_size;i++)
+		g[i] = w[i];
+	DISPATCH_ROWS(prob, rows_XTv<Rows>(prob, NULL, l, z, g));
+	if(sampler != NULL)
+		sampler->draw(NULL, l);
+}
 
-static void solve_l2r_l1l2_svc(
-	const problem *prob, double *w, double eps, 
-	double Cp, double Cn, int solver_type)
+int l2r_lr_fun::get_nr_variable(void)
 {
-	int l = prob->l;
-	int w_size = prob->n;
-	int i, s, iter = 0;
-	double C, d, G;
-	double *QD = new double[l];
-	int max_iter = 1000;
-	int *index = new int[l];
-	double *alpha = new double[l];
-	schar *y = new schar[l];
-	int active_size = l;
+	return prob->n;
+}
 
-	// PG: projected gradient, for shrinking and stopping
-	double PG;
-	double PGmax_old = INF;
-	double PGmin_old = -INF;
-	double PGmax_new, PGmin_new;
+// rubylinear addition: the rows S are the sampled ones when subsampling the Hessian
+void l2r_lr_fun::Hv(double *s, double *Hs)
+{
+	int i;
+	int w_size=get_nr_variable();
+	const int *S = sampler != NULL ? sampler->rows : NULL;
+	int sizeS = sampler != NULL ? sampler->size : prob->l;
+	double scale = sampler != NULL ? sampler->scale : 1;
 
-	// default solver_type: L2R_L2LOSS_SVC_DUAL
-	double diag[3] = {0.5/Cn, 0, 0.5/Cp};
-	double upper_bound[3] = {INF, 0, INF};
-	if(solver_type == L2R_L1LOSS_SVC_DUAL)
-	{
-		diag[0] = 0;
-		diag[2] = 0;
-		upper_bound[0] = Cn;
-		upper_bound[2] = Cp;
-	}
+	for(i=0;i<w_size;i++)
+		Hs[i] = s[i];
+	DISPATCH_ROWS(prob, rows_XTDXv<Rows>(prob, S, sizeS, scale, D, s, Hs));
+}
 
-	for(i=0; i<w_size; i++)
-		w[i] = 0;
-	for(i=0; i<l; i++)
-	{
-		alpha[i] = 0;
-		if(prob->y[i] > 0)
-		{
-			y[i] = +1; 
-		}
-		else
-		{
-			y[i] = -1;
-		}
-		QD[i] = diag[GETI(i)];
+// the diagonal of I + X_S^T diag(D) X_S, scaled as in Hv
+void l2r_lr_fun::get_diag_preconditioner(double *M)
+{
+	int i;
+	int w_size=get_nr_variable();
+	const int *S = sampler != NULL ? sampler->rows : NULL;
+	int sizeS = sampler != NULL ? sampler->size : prob->l;
+	double scale = sampler != NULL ? sampler->scale : 1;
+	double *wa = new double[sizeS];
 
-		feature_node *xi = prob->x[i];
-		while (xi->index != -1)
-		{
-			QD[i] += (xi->value)*(xi->value);
-			xi++;
-		}
-		index[i] = i;
-	}
+	for(i=0;i<sizeS;i++)
+		wa[i] = scale*D[S != NULL ? S[i] : i];
+	for(i=0;i<w_size;i++)
+		M[i] = 1;
+	DISPATCH_ROWS(prob, rows_XTv_sq<Rows>(prob, S, sizeS, wa, M));
+	delete[] wa;
+}
 
-	while (iter < max_iter)
-	{
-		PGmax_new = -INF;
-		PGmin_new = INF;
+class l2r_l2_svc_fun : public function
+{
+public:
+	l2r_l2_svc_fun(const problem *prob, double Cp, double Cn, double hessian_sample, random_generator *random);
+	~l2r_l2_svc_fun();
 
-		for (i=0; i<active_size; i++)
-		{
-			int j = i+rand()%(active_size-i);
-			swap(index[i], index[j]);
-		}
+	double fun(double *w);
+	void grad(double *w, double *g);
+	void Hv(double *s, double *Hs);
+	void get_diag_preconditioner(double *M);
 
-		for (s=0; s<active_size; s++)
-		{
-			i = index[s];
-			G = 0;
-			schar yi = y[i];
+	int get_nr_variable(void);
 
-			feature_node *xi = prob->x[i];
-			while(xi->index!= -1)
-			{
-				G += w[xi->index-1]*(xi->value);
-				xi++;
-			}
-			G = G*yi-1;
+private:
+	double *C;
+	double *z;
+	int *I;
+	int sizeI;
+	// rubylinear addition: fun stores the samples with a margin below 1 at its w here, grad
+	// makes them I. A step that TRON rejects thus leaves the I of the current w to Hv
+	int *I_new;
+	int sizeI_new;
+	hessian_sampler *sampler;
+	const problem *prob;
+};
 
-			C = upper_bound[GETI(i)];
-			G += alpha[i]*diag[GETI(i)];
+l2r_l2_svc_fun::l2r_l2_svc_fun(const problem *prob, double Cp, double Cn, double hessian_sample, random_generator *random)
+{
+	int i;
+	int l=prob->l;
+	int *y=prob->y;
 
-			PG = 0;
-			if (alpha[i] == 0)
-			{
-				if (G > PGmax_old)
-				{
-					active_size--;
-					swap(index[s], index[active_size]);
-					s--;
-					continue;
-				}
-				else if (G < 0)
-					PG = G;
-			}
-			else if (alpha[i] == C)
-			{
-				if (G < PGmin_old)
-				{
-					active_size--;
-					swap(index[s], index[active_size]);
-					s--;
-					continue;
-				}
-				else if (G > 0)
-					PG = G;
-			}
-			else
-				PG = G;
+	this->prob = prob;
 
-			PGmax_new = max(PGmax_new, PG);
-			PGmin_new = min(PGmin_new, PG);
+	z = new double[l];
+	C = new double[l];
+	I = new int[l];
+	I_new = new int[l];
+	sizeI = 0;
+	sizeI_new = 0;
+	sampler = hessian_sample > 0 && hessian_sample < 1 ? new hessian_sampler(hessian_sample, l, random) : NULL;
 
-			if(fabs(PG) > 1.0e-12)
-			{
-				double alpha_old = alpha[i];
-				alpha[i] = min(max(alpha[i] - G/QD[i], 0.0), C);
-				d = (alpha[i] - alpha_old)*yi;
-				xi = prob->x[i];
-				while (xi->index != -1)
-				{
-					w[xi->index-1] += d*xi->value;
-					xi++;
-				}
-			}
-		}
+	for (i=0; i<l; i++)
+	{
+		if (y[i] == 1)
+			C[i] = Cp*instance_weight(prob, i);
+		else
+			C[i] = Cn*instance_weight(prob, i);
+	}
+}
 
-		iter++;
-		if(iter % 10 == 0)
-			info(".");
+l2r_l2_svc_fun::~l2r_l2_svc_fun()
+{
+	delete[] z;
+	delete[] C;
+	delete[] I;
+	delete[] I_new;
+	delete sampler;
+}
 
-		if(PGmax_new - PGmin_new <= eps)
-		{
-			if(active_size == l)
-				break;
-			else
-			{
-				active_size = l;
-				info("*");
-				PGmax_old = INF;
-				PGmin_old = -INF;
-				continue;
-			}
-		}
-		PGmax_old = PGmax_new;
-		PGmin_old = PGmin_new;
-		if (PGmax_old <= 0)
-			PGmax_old = INF;
-		if (PGmin_old >= 0)
-			PGmin_old = -INF;
-	}
+// rubylinear addition: also computes the gradient coefficients z of the samples I_new for grad
+double l2r_l2_svc_fun::fun(double *w)
+{
+	int i;
+	double f=0;
+	int w_size=get_nr_variable();
 
-	info("\noptimization finished, #iter = %d\n",iter);
-	if (iter >= max_iter)
-		info("\nWARNING: reaching max number of iterations\nUsing -s 2 may be faster (also see FAQ)\n\n");
+	DISPATCH_ROWS(prob, f = rows_loss<squared_hinge_loss, Rows>(prob, C, w, z, NULL, I_new, &sizeI_new));
+	f = 2*f;
+	for(i=0;i<w_size;i++)
+		f += w[i]*w[i];
+	f /= 2.0;
 
-	// calculate objective value
+	return(f);
+}
 
-	double v = 0;
-	int nSV = 0;
-	for(i=0; i<w_size; i++)
-		v += w[i]*w[i];
-	for(i=0; i<l; i++)
-	{
-		v += alpha[i]*(alpha[i]*diag[GETI(i)] - 2);
-		if(alpha[i] > 0)
-			++nSV;
-	}
-	info("Objective value = %lf\n",v/2);
-	info("nSV = %d\n",nSV);
+// rubylinear addition: w must be the one of the last fun call, which TRON guarantees
+void l2r_l2_svc_fun::grad(double *w, double *g)
+{
+	int i;
+	int w_size=get_nr_variable();
 
-	delete [] QD;
-	delete [] alpha;
-	delete [] y;
-	delete [] index;
+	swap(I, I_new);
+	sizeI = sizeI_new;
+	for(i=0;i<w_size;i++)
+		g[i] = w[i];
+	DISPATCH_ROWS(prob, rows_XTv<Rows>(prob, I, sizeI, z, g));
+	if(sampler != NULL)
+		sampler->draw(I, sizeI);
+}
+
+int l2r_l2_svc_fun::get_nr_variable(void)
+{
+	return prob->n;
+}
+
+// rubylinear addition: the rows S are a sample of I when subsampling the Hessian
+void l2r_l2_svc_fun::Hv(double *s, double *Hs)
+{
+	int i;
+	int w_size=get_nr_variable();
+	const int *S = sampler != NULL ? sampler->rows : I;
+	int sizeS = sampler != NULL ? sampler->size : sizeI;
+	double scale = sampler != NULL ? sampler->scale : 1;
+
+	for(i=0;i<w_size;i++)
+		Hs[i] = s[i];
+	DISPATCH_ROWS(prob, rows_XTDXv<Rows>(prob, S, sizeS, 2*scale, C, s, Hs));
+}
+
+// the diagonal of I + 2 X_S^T diag(C_S) X_S, scaled as in Hv
+void l2r_l2_svc_fun::get_diag_preconditioner(double *M)
+{
+	int i;
+	int w_size=get_nr_variable();
+	const int *S = sampler != NULL ? sampler->rows : I;
+	int sizeS = sampler != NULL ? sampler->size : sizeI;
+	double scale = sampler != NULL ? sampler->scale : 1;
+	double *wa = new double[prob->l];
+
+	for(i=0;i<sizeS;i++)
+		wa[i] = 2*scale*C[S[i]];
+	for(i=0;i<w_size;i++)
+		M[i] = 1;
+	DISPATCH_ROWS(prob, rows_XTv_sq<Rows>(prob, S, sizeS, wa, M));
+	delete[] wa;
 }
 
 // A coordinate descent algorithm for 
-// the dual of L2-regularized logistic regression problems
+// multi-class support vector machines by Crammer and Singer
 //
-//  min_\alpha  0.5(\alpha^T Q \alpha) + \sum \alpha_i log (\alpha_i) + (upper_bound_i - alpha_i) log (upper_bound_i - alpha_i) ,
-//    s.t.      0 <= alpha_i <= upper_bound_i,
+//  min_{\alpha}  0.5 \sum_m ||w_m(\alpha)||^2 + \sum_i \sum_m e^m_i alpha^m_i
+//    s.t.     \alpha^m_i <= C^m_i \forall m,i , \sum_m \alpha^m_i=0 \forall i
 // 
-//  where Qij = yi yj xi^T xj and 
-//  upper_bound_i = Cp if y_i = 1
-//  upper_bound_i = Cn if y_i = -1
+//  where e^m_i = 0 if y_i  = m,
+//        e^m_i = 1 if y_i != m,
+//  C^m_i = C_{y_i} W_i if m  = y_i, 
+//  C^m_i = 0 if m != y_i, 
+//  and w_m(\alpha) = \sum_i \alpha^m_i x_i 
 //
 // Given: 
-// x, y, Cp, Cn
+// x, y, C, W (the instance weights)
 // eps is the stopping tolerance
 //
 // solution will be put in w
 //
-// See Algorithm 5 of Yu et al., MLJ 2010
+// See Appendix of LIBLINEAR paper, Fan et al. (2008)
 
-#undef GETI
-#define GETI(i) (y[i]+1)
-// To support weights for instances, use GETI(i) (i)
+#define GETI(i) (i)
 
-void solve_l2r_lr_dual(const problem *prob, double *w, double eps, double Cp, double Cn)
+// rubylinear addition: the dual variables of an instance, stored sparsely as
+// (class, alpha) entries. Unless all the classes are active for the instance
+// (active == nr_class), its first active entries are the active classes. The
+// other entries are the nonzero alphas of the remaining classes
+struct mcsvm_alpha
 {
-	int l = prob->l;
-	int w_size = prob->n;
-	int i, s, iter = 0;
-	double *xTx = new double[l];
-	int max_iter = 1000;
-	int *index = new int[l];		
-	double *alpha = new double[2*l]; // store alpha and C - alpha
-	schar *y = new schar[l];	
-	int max_inner_iter = 100; // for inner Newton
-	double innereps = 1e-2; 
-	double innereps_min = min(1e-8, eps);
-	double upper_bound[3] = {Cn, 0, Cp};
-
-	for(i=0; i<w_size; i++)
-		w[i] = 0;
-	for(i=0; i<l; i++)
-	{
-		if(prob->y[i] > 0)
-		{
-			y[i] = +1; 
-		}
-		else
-		{
-			y[i] = -1;
-		}
-		alpha[2*i] = min(0.001*upper_bound[GETI(i)], 1e-8);
-		alpha[2*i+1] = upper_bound[GETI(i)] - alpha[2*i];
-
-		xTx[i] = 0;
-		feature_node *xi = prob->x[i];
-		while (xi->index != -1)
-		{
-			xTx[i] += (xi->value)*(xi->value);
-			w[xi->index-1] += y[i]*alpha[2*i]*xi->value;
-			xi++;
-		}
-		index[i] = i;
-	}
+	int *index;
+	double *value;
+	int size, capacity;
+	int active;
+};
 
-	while (iter < max_iter)
-	{
-		for (i=0; i<l; i++)
-		{
-			int j = i+rand()%(l-i);
-			swap(index[i], index[j]);
-		}
-		int newton_iter = 0;
-		double Gmax = 0;
-		for (s=0; s<l; s++)
-		{
-			i = index[s];
-			schar yi = y[i];
-			double C = upper_bound[GETI(i)];
-			double ywTx = 0, xisq = xTx[i];
-			feature_node *xi = prob->x[i];
-			while (xi->index != -1)
-			{
-				ywTx += w[xi->index-1]*xi->value;
-				xi++;
-			}
-			ywTx *= y[i];
-			double a = xisq, b = ywTx;
-
-			// Decide to minimize g_1(z) or g_2(z)
-			int ind1 = 2*i, ind2 = 2*i+1, sign = 1;
-			if(0.5*a*(alpha[ind2]-alpha[ind1])+b < 0) 
-			{
-				ind1 = 2*i+1;
-				ind2 = 2*i;
-				sign = -1;
-			}
-
-			//  g_t(z) = z*log(z) + (C-z)*log(C-z) + 0.5a(z-alpha_old)^2 + sign*b(z-alpha_old)
-			double alpha_old = alpha[ind1];
-			double z = alpha_old;
-			if(C - z < 0.5 * C) 
-				z = 0.1*z;
-			double gp = a*(z-alpha_old)+sign*b+log(z/(C-z));
-			Gmax = max(Gmax, fabs(gp));
-
-			// Newton method on the sub-problem
-			const double eta = 0.1; // xi in the paper
-			int inner_iter = 0;
-			while (inner_iter <= max_inner_iter) 
-			{
-				if(fabs(gp) < innereps)
-					break;
-				double gpp = a + C/(C-z)/z;
-				double tmpz = z - gp/gpp;
-				if(tmpz <= 0) 
-					z *= eta;
-				else // tmpz in (0, C)
-					z = tmpz;
-				gp = a*(z-alpha_old)+sign*b+log(z/(C-z));
-				newton_iter++;
-				inner_iter++;
-			}
+class Solver_MCSVM_CS
+{
+	public:
+		Solver_MCSVM_CS(const problem *prob, int nr_class, double *C, double eps, solver_monitor *monitor);
+		~Solver_MCSVM_CS();
+		int Solve(double *w);
+	private:
+		template <class Rows> int solve_rows(double *w);
+		void solve_sub_problem(double A_i, int yi, double C_yi, int active_i, double *alpha_new);
+		bool be_shrunk(int i, int m, int yi, double alpha_i, double minG);
+		void store_alpha(mcsvm_alpha *alpha, int active, const int *active_i, double *alpha_i);
+		double *B, *C, *G;
+		double *D; // workspace of solve_sub_problem
+		bool *in_active; // workspace of store_alpha
+		int *entry_index;
+		double *entry_value;
+		int w_size, l;
+		int nr_class;
+		int max_iter;
+		double eps;
+		const problem *prob;
+		solver_monitor *monitor;
+};
 
-			if(inner_iter > 0) // update w
-			{
-				alpha[ind1] = z;
-				alpha[ind2] = C-z;
-				xi = prob->x[i];
-				while (xi->index != -1)
-				{
-					w[xi->index-1] += sign*(z-alpha_old)*yi*xi->value;
-					xi++;
-				}  
-			}
-		}
+Solver_MCSVM_CS::Solver_MCSVM_CS(const problem *prob, int nr_class, double *weighted_C, double eps, solver_monitor *monitor)
+{
+	this->w_size = prob->n;
+	this->l = prob->l;
+	this->nr_class = nr_class;
+	this->eps = eps;
+	this->max_iter = monitor->max_iter(100000);
+	this->prob = prob;
+	this->B = new double[nr_class];
+	this->G = new double[nr_class];
+	this->D = new double[nr_class];
+	this->in_active = new bool[nr_class];
+	this->entry_index = new int[nr_class];
+	this->entry_value = new double[nr_class];
+	for(int m=0; m<nr_class; m++)
+		in_active[m] = false;
+	this->C = new double[l];
+	for(int i=0; i<l; i++)
+		this->C[i] = weighted_C[prob->y[i]]*instance_weight(prob, i);
+	this->monitor = monitor;
+}
 
-		iter++;
-		if(iter % 10 == 0)
-			info(".");
+Solver_MCSVM_CS::~Solver_MCSVM_CS()
+{
+	delete[] B;
+	delete[] C;
+	delete[] G;
+	delete[] D;
+	delete[] in_active;
+	delete[] entry_index;
+	delete[] entry_value;
+}
 
-		if(Gmax < eps) 
-			break;
+void Solver_MCSVM_CS::solve_sub_problem(double A_i, int yi, double C_yi, int active_i, double *alpha_new)
+{
+	int r;
 
-		if(newton_iter <= l/10) 
-			innereps = max(innereps_min, 0.1*innereps);
+	memcpy(D, B, sizeof(double)*active_i);
+	if(yi < active_i)
+		D[yi] += A_i*C_yi;
 
+	// rubylinear addition: beta only needs the largest values of D, in decreasing
+	// order, until the condition below fails, so they are popped from a heap instead
+	// of sorting all of D. The heap is D[0..size) and the popped values go after it
+	int size = active_i;
+	std::make_heap(D, D+size);
+	std::pop_heap(D, D+size--);
+	double beta = D[size] - A_i*C_yi;
+	for(r=1;r<active_i && beta<r*D[0];r++)
+	{
+		std::pop_heap(D, D+size--);
+		beta += D[size];
 	}
 
-	info("\noptimization finished, #iter = %d\n",iter);
-	if (iter >= max_iter)
-		info("\nWARNING: reaching max number of iterations\nUsing -s 0 may be faster (also see FAQ)\n\n");
-
-	// calculate objective value
-	
-	double v = 0;
-	for(i=0; i<w_size; i++)
-		v += w[i] * w[i];
-	v *= 0.5;
-	for(i=0; i<l; i++)
-		v += alpha[2*i] * log(alpha[2*i]) + alpha[2*i+1] * log(alpha[2*i+1]) 
-			- upper_bound[GETI(i)] * log(upper_bound[GETI(i)]);
-	info("Objective value = %lf\n", v);
-
-	delete [] xTx;
-	delete [] alpha;
-	delete [] y;
-	delete [] index;
+	beta /= r;
+	for(r=0;r<active_i;r++)
+	{
+		if(r == yi)
+			alpha_new[r] = min(C_yi, (beta-B[r])/A_i);
+		else
+			alpha_new[r] = min((double)0, (beta - B[r])/A_i);
+	}
 }
 
-// A coordinate descent algorithm for 
-// L1-regularized L2-loss support vector classification
-//
-//  min_w \sum |wj| + C \sum max(0, 1-yi w^T xi)^2,
-//
-// Given: 
-// x, y, Cp, Cn
-// eps is the stopping tolerance
-//
-// solution will be put in w
-//
-// See Yuan et al. (2010) and appendix of LIBLINEAR paper, Fan et al. (2008)
-
-#undef GETI
-#define GETI(i) (y[i]+1)
-// To support weights for instances, use GETI(i) (i)
-
-static void solve_l1r_l2_svc(
-	problem *prob_col, double *w, double eps, 
-	double Cp, double Cn)
+bool Solver_MCSVM_CS::be_shrunk(int i, int m, int yi, double alpha_i, double minG)
 {
-	int l = prob_col->l;
-	int w_size = prob_col->n;
-	int j, s, iter = 0;
-	int max_iter = 1000;
-	int active_size = w_size;
-	int max_num_linesearch = 20;
-
-	double sigma = 0.01;
-	double d, G_loss, G, H;
-	double Gmax_old = INF;
-	double Gmax_new, Gnorm1_new;
-	double Gnorm1_init;
-	double d_old, d_diff;
-	double loss_old, loss_new;
-	double appxcond, cond;
-
-	int *index = new int[w_size];
-	schar *y = new schar[l];
-	double *b = new double[l]; // b = 1-ywTx
-	double *xj_sq = new double[w_size];
-	feature_node *x;
-
-	double C[3] = {Cn,0,Cp};
+	double bound = 0;
+	if(m == yi)
+		bound = C[GETI(i)];
+	if(alpha_i == bound && G[m] < minG)
+		return true;
+	return false;
+}
 
-	for(j=0; j<l; j++)
+// Stores the alphas of an instance, scattered by class in alpha_i, back into its
+// sparse entries, and clears alpha_i. active_i lists the active classes
+void Solver_MCSVM_CS::store_alpha(mcsvm_alpha *alpha, int active, const int *active_i, double *alpha_i)
+{
+	int m, size = 0;
+	if(active == nr_class)
 	{
-		b[j] = 1;
-		if(prob_col->y[j] > 0)
-			y[j] = 1;
-		else
-			y[j] = -1;
+		for(m=0;m<nr_class;m++)
+			if(alpha_i[m] != 0)
+			{
+				entry_index[size] = m;
+				entry_value[size++] = alpha_i[m];
+			}
 	}
-	for(j=0; j<w_size; j++)
+	else
 	{
-		w[j] = 0;
-		index[j] = j;
-		xj_sq[j] = 0;
-		x = prob_col->x[j];
-		while(x->index != -1)
+		for(m=0;m<active;m++)
 		{
-			int ind = x->index-1;
-			double val = x->value;
-			x->value *= y[ind]; // x->value stores yi*xij
-			xj_sq[j] += C[GETI(ind)]*val*val;
-			x++;
+			in_active[active_i[m]] = true;
+			entry_index[size] = active_i[m];
+			entry_value[size++] = alpha_i[active_i[m]];
+		}
+		for(m=0;m<alpha->size;m++)
+		{
+			int c = alpha->index[m];
+			if(!in_active[c] && alpha_i[c] != 0)
+			{
+				entry_index[size] = c;
+				entry_value[size++] = alpha_i[c];
+			}
 		}
 	}
 
-	while(iter < max_iter)
+	for(m=0;m<alpha->size;m++)
+		alpha_i[alpha->index[m]] = 0;
+	for(m=0;m<size;m++)
 	{
-		Gmax_new = 0;
-		Gnorm1_new = 0;
+		alpha_i[entry_index[m]] = 0;
+		in_active[entry_index[m]] = false;
+	}
+
+	// shrinking usually leaves few entries, so give back the memory of large lists
+	if(size > alpha->capacity || 4*size < alpha->capacity)
+	{
+		alpha->capacity = size > alpha->capacity ? min(max(size, 2*alpha->capacity), nr_class) : size;
+		alpha->index = (int *)realloc(alpha->index, sizeof(int)*max(alpha->capacity, 1));
+		alpha->value = (double *)realloc(alpha->value, sizeof(double)*max(alpha->capacity, 1));
+	}
+	memcpy(alpha->index, entry_index, sizeof(int)*size);
+	memcpy(alpha->value, entry_value, sizeof(double)*size);
+	alpha->size = size;
+	alpha->active = active;
+}
+
+int Solver_MCSVM_CS::Solve(double *w)
+{
+	int iter = 0;
+	DISPATCH_ROWS(prob, iter = solve_rows<Rows>(w));
+	return iter;
+}
+
+template <class Rows>
+int Solver_MCSVM_CS::solve_rows(double *w)
+{
+	int i, m, s;
+	int iter = 0;
+	bool converged = false;
+	mcsvm_alpha *alpha = new mcsvm_alpha[l];
+	double *alpha_new = new double[nr_class];
+	int *index = new int[l];
+	double *QD = new double[l];
+	int *d_ind = new int[nr_class];
+	double *d_val = new double[nr_class];
+	double *alpha_i = new double[nr_class]; // the alphas of the current instance, by class
+	int *active_i = new int[nr_class]; // its active classes
+	int active_size = l;
+	double eps_shrink = max(10.0*eps, 1.0); // stopping tolerance for shrinking
+	bool start_from_all = true;
+	Rows x(prob);
+	// initial
+	for(m=0;m<nr_class;m++)
+		alpha_i[m] = 0;
+	for(i=0;i<w_size*nr_class;i++)
+		w[i] = 0; 
+	for(i=0;i<l;i++)
+	{
+		alpha[i].index = NULL;
+		alpha[i].value = NULL;
+		alpha[i].size = 0;
+		alpha[i].capacity = 0;
+		alpha[i].active = nr_class;
+		QD[i] = row_sqnorm(x[i]);
+		index[i] = i;
+	}
 
-		for(j=0; j<active_size; j++)
+	while(iter < max_iter) 
+	{
+		double stopping = -INF;
+		for(i=0;i<active_size;i++)
 		{
-			int i = j+rand()%(active_size-j);
+			int j = i+monitor->random.uniform(active_size-i);
 			swap(index[i], index[j]);
 		}
-
-		for(s=0; s<active_size; s++)
+		for(s=0;s<active_size;s++)
 		{
-			j = index[s];
-			G_loss = 0;
-			H = 0;
+			i = index[s];
+			double Ai = QD[i];
 
-			x = prob_col->x[j];
-			while(x->index != -1)
+			if(Ai > 0)
 			{
-				int ind = x->index-1;
-				if(b[ind] > 0)
+				int active = alpha[i].active;
+				for(m=0;m<alpha[i].size;m++)
+					alpha_i[alpha[i].index[m]] = alpha[i].value[m];
+				for(m=0;m<active;m++)
+					active_i[m] = active == nr_class ? m : alpha[i].index[m];
+
+				// the position of the label in active_i, active if it is not active
+				int y_index = active;
+				for(m=0;m<active;m++)
 				{
-					double val = x->value;
-					double tmp = C[GETI(ind)]*val;
-					G_loss -= tmp*b[ind];
-					H += tmp*val;
+					G[m] = 1;
+					if(active_i[m] == prob->y[i])
+					{
+						G[m] = 0;
+						y_index = m;
+					}
 				}
-				x++;
-			}
-			G_loss *= 2;
 
-			G = G_loss;
-			H *= 2;
-			H = max(H, 1e-12);
-
-			double Gp = G+1;
-			double Gn = G-1;
-			double violation = 0;
-			if(w[j] == 0)
-			{
-				if(Gp < 0)
-					violation = -Gp;
-				else if(Gn > 0)
-					violation = Gn;
-				else if(Gp>Gmax_old/l && Gn<-Gmax_old/l)
+				for(typename Rows::row xi = x[i]; xi.more(); xi.next())
 				{
-					active_size--;
-					swap(index[s], index[active_size]);
-					s--;
-					continue;
+					double *w_i = &w[(xi.index()-1)*nr_class];
+					double xv = xi.value();
+					for(m=0;m<active;m++)
+						G[m] += w_i[active_i[m]]*xv;
 				}
-			}
-			else if(w[j] > 0)
-				violation = fabs(Gp);
-			else
-				violation = fabs(Gn);
-
-			Gmax_new = max(Gmax_new, violation);
-			Gnorm1_new += violation;
-
-			// obtain Newton direction d
-			if(Gp <= H*w[j])
-				d = -Gp/H;
-			else if(Gn >= H*w[j])
-				d = -Gn/H;
-			else
-				d = -w[j];
-
-			if(fabs(d) < 1.0e-12)
-				continue;
-
-			double delta = fabs(w[j]+d)-fabs(w[j]) + G*d;
-			d_old = 0;
-			int num_linesearch;
-			for(num_linesearch=0; num_linesearch < max_num_linesearch; num_linesearch++)
-			{
-				d_diff = d_old - d;
-				cond = fabs(w[j]+d)-fabs(w[j]) - sigma*delta;
 
-				appxcond = xj_sq[j]*d*d + G_loss*d + cond;
-				if(appxcond <= 0)
+				double minG = INF;
+				double maxG = -INF;
+				for(m=0;m<active;m++)
 				{
-					x = prob_col->x[j];
-					while(x->index != -1)
-					{
-						b[x->index-1] += d_diff*x->value;
-						x++;
-					}
-					break;
+					if(alpha_i[active_i[m]] < 0 && G[m] < minG)
+						minG = G[m];
+					if(G[m] > maxG)
+						maxG = G[m];
 				}
+				if(y_index < active)
+					if(alpha_i[prob->y[i]] < C[GETI(i)] && G[y_index] < minG)
+						minG = G[y_index];
 
-				if(num_linesearch == 0)
-				{
-					loss_old = 0;
-					loss_new = 0;
-					x = prob_col->x[j];
-					while(x->index != -1)
-					{
-						int ind = x->index-1;
-						if(b[ind] > 0)
-							loss_old += C[GETI(ind)]*b[ind]*b[ind];
-						double b_new = b[ind] + d_diff*x->value;
-						b[ind] = b_new;
-						if(b_new > 0)
-							loss_new += C[GETI(ind)]*b_new*b_new;
-						x++;
-					}
-				}
-				else
+				for(m=0;m<active;m++)
 				{
-					loss_new = 0;
-					x = prob_col->x[j];
-					while(x->index != -1)
+					if(be_shrunk(i, m, y_index, alpha_i[active_i[m]], minG))
 					{
-						int ind = x->index-1;
-						double b_new = b[ind] + d_diff*x->value;
-						b[ind] = b_new;
-						if(b_new > 0)
-							loss_new += C[GETI(ind)]*b_new*b_new;
-						x++;
+						active--;
+						while(active>m)
+						{
+							if(!be_shrunk(i, active, y_index, alpha_i[active_i[active]], minG))
+							{
+								swap(active_i[m], active_i[active]);
+								swap(G[m], G[active]);
+								if(y_index == active)
+									y_index = m;
+								else if(y_index == m) 
+									y_index = active;
+								break;
+							}
+							active--;
+						}
 					}
 				}
 
-				cond = cond + loss_new - loss_old;
-				if(cond <= 0)
-					break;
-				else
+				if(active <= 1)
 				{
-					d_old = d;
-					d *= 0.5;
-					delta *= 0.5;
+					active_size--;
+					swap(index[s], index[active_size]);
+					s--;	
 				}
-			}
+				else if(maxG-minG > 1e-12)
+				{
+					stopping = max(maxG - minG, stopping);
 
-			w[j] += d;
+					for(m=0;m<active;m++)
+						B[m] = G[m] - Ai*alpha_i[active_i[m]] ;
 
-			// recompute b[] if line search takes too many steps
-			if(num_linesearch >= max_num_linesearch)
-			{
-				info("#");
-				for(int i=0; i<l; i++)
-					b[i] = 1;
+					solve_sub_problem(Ai, y_index, C[GETI(i)], active, alpha_new);
+					int nz_d = 0;
+					for(m=0;m<active;m++)
+					{
+						double d = alpha_new[m] - alpha_i[active_i[m]];
+						alpha_i[active_i[m]] = alpha_new[m];
+						if(fabs(d) >= 1e-12)
+						{
+							d_ind[nz_d] = active_i[m];
+							d_val[nz_d] = d;
+							nz_d++;
+						}
+					}
 
-				for(int i=0; i<w_size; i++)
-				{
-					if(w[i]==0) continue;
-					x = prob_col->x[i];
-					while(x->index != -1)
+					for(typename Rows::row xi = x[i]; xi.more(); xi.next())
 					{
-						b[x->index-1] -= w[i]*x->value;
-						x++;
+						double *w_i = &w[(xi.index()-1)*nr_class];
+						double xv = xi.value();
+						for(m=0;m<nz_d;m++)
+							w_i[d_ind[m]] += d_val[m]*xv;
 					}
 				}
+				store_alpha(&alpha[i], active, active_i, alpha_i);
 			}
 		}
 
-		if(iter == 0)
-			Gnorm1_init = Gnorm1_new;
 		iter++;
 		if(iter % 10 == 0)
-			info(".");
+		{
+			monitor->info(".");
+		}
+		if(monitor->stop(w))
+			break;
 
-		if(Gnorm1_new <= eps*Gnorm1_init)
+		if(stopping < eps_shrink)
 		{
-			if(active_size == w_size)
+			if(stopping < eps && start_from_all == true)
+			{
+				converged = true;
 				break;
+			}
 			else
 			{
-				active_size = w_size;
-				info("*");
-				Gmax_old = INF;
-				continue;
+				active_size = l;
+				for(i=0;i<l;i++)
+					alpha[i].active = nr_class;
+				monitor->info("*");
+				eps_shrink = max(eps_shrink/2, eps);
+				start_from_all = true;
 			}
 		}
-
-		Gmax_old = Gmax_new;
+		else
+			start_from_all = false;
 	}
 
-	info("\noptimization finished, #iter = %d\n", iter);
-	if(iter >= max_iter)
-		info("\nWARNING: reaching max number of iterations\n");
+	monitor->info("\noptimization finished, #iter = %d\n",iter);
+	if (iter >= max_iter && !converged)
+	{
+		monitor->info("\nWARNING: reaching max number of iterations\n");
+		monitor->reached_max_iter();
+	}
 
 	// calculate objective value
-
 	double v = 0;
-	int nnz = 0;
-	for(j=0; j<w_size; j++)
+	int nSV = 0;
+	for(i=0;i<w_size*nr_class;i++)
+		v += w[i]*w[i];
+	v = 0.5*v;
+	for(i=0;i<l;i++)
 	{
-		x = prob_col->x[j];
-		while(x->index != -1)
+		for(m=0;m<alpha[i].size;m++)
 		{
-			x->value *= prob_col->y[x->index-1]; // restore x->value
-			x++;
+			v += alpha[i].value[m];
+			if(alpha[i].index[m] == prob->y[i])
+				v -= alpha[i].value[m];
+			if(fabs(alpha[i].value[m]) > 0)
+				nSV++;
 		}
-		if(w[j] != 0)
+		free(alpha[i].index);
+		free(alpha[i].value);
+	}
+	monitor->info("Objective value = %lf\n",v);
+	monitor->info("nSV = %d\n",nSV);
+
+	delete [] alpha;
+	delete [] alpha_new;
+	delete [] index;
+	delete [] QD;
+	delete [] d_ind;
+	delete [] d_val;
+	delete [] alpha_i;
+	delete [] active_i;
+
+	return iter;
+}
+
+// rubylinear addition: the threads of a parallel solver, started once per solve
+// and kept waiting on a condition variable between the passes. run() hands
+// task t to thread t (task 0, and any task whose thread could not be started,
+// runs on the calling thread) and returns once they are all done. The mutex
+// orders everything a pass writes before what the next one reads
+class worker_pool
+{
+public:
+	worker_pool(int nr_thread);
+	~worker_pool();
+	void run(void *(*work)(void *), void *tasks, size_t task_size, int nr_task);
+
+private:
+	struct worker
+	{
+		worker_pool *pool;
+		int id;
+		pthread_t thread;
+	};
+	static void *worker_loop(void *arg);
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	worker *workers;
+	int nr_started;	// the workers 1..nr_started are running
+	long generation;	// incremented by each pass
+	int pending;	// the tasks of the pass the workers have not finished
+	bool stopping;
+	void *(*work)(void *);
+	char *tasks;
+	size_t task_size;
+	int nr_task;
+};
+
+worker_pool::worker_pool(int nr_thread)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&start, NULL);
+	pthread_cond_init(&done, NULL);
+	generation = 0;
+	pending = 0;
+	stopping = false;
+	work = NULL;
+	tasks = NULL;
+	task_size = 0;
+	nr_task = 0;
+	workers = new worker[max(nr_thread, 1)];
+	nr_started = 0;
+	for(int t=1;t<nr_thread;t++)
+	{
+		workers[t].pool = this;
+		workers[t].id = t;
+		if(pthread_create(&workers[t].thread, NULL, worker_loop, &workers[t]) != 0)
+			break;
+		nr_started = t;
+	}
+}
+
+worker_pool::~worker_pool()
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&lock);
+	for(int t=1;t<=nr_started;t++)
+		pthread_join(workers[t].thread, NULL);
+	delete[] workers;
+	pthread_cond_destroy(&start);
+	pthread_cond_destroy(&done);
+	pthread_mutex_destroy(&lock);
+}
+
+void *worker_pool::worker_loop(void *arg)
+{
+	worker *self = (worker *)arg;
+	worker_pool *pool = self->pool;
+	long seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while(1)
+	{
+		while(pool->generation == seen && !pool->stopping)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if(pool->stopping)
+			break;
+		seen = pool->generation;
+		if(self->id < pool->nr_task)
 		{
-			v += fabs(w[j]);
-			nnz++;
+			pthread_mutex_unlock(&pool->lock);
+			pool->work(pool->tasks + self->id*pool->task_size);
+			pthread_mutex_lock(&pool->lock);
+			if(--pool->pending == 0)
+				pthread_cond_signal(&pool->done);
 		}
 	}
-	for(j=0; j<l; j++)
-		if(b[j] > 0)
-			v += C[GETI(j)]*b[j]*b[j];
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+void worker_pool::run(void *(*work)(void *), void *tasks, size_t task_size, int nr_task)
+{
+	int nr_worker = min(nr_task-1, nr_started);
+	if(nr_worker > 0)
+	{
+		pthread_mutex_lock(&lock);
+		this->work = work;
+		this->tasks = (char *)tasks;
+		this->task_size = task_size;
+		this->nr_task = nr_task;
+		pending = nr_worker;
+		generation++;
+		pthread_cond_broadcast(&start);
+		pthread_mutex_unlock(&lock);
+	}
+	work(tasks);
+	for(int t=nr_worker+1;t<nr_task;t++)
+		work((char *)tasks + t*task_size);
+	if(nr_worker > 0)
+	{
+		pthread_mutex_lock(&lock);
+		while(pending > 0)
+			pthread_cond_wait(&done, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+}
 
-	info("Objective value = %lf\n", v);
-	info("#nonzeros/#features = %d/%d\n", nnz, w_size);
+// rubylinear addition: the kernels of the parallel dual solvers, whose threads
+// share w. They read w with relaxed atomic loads and add to it with a compare
+// and swap loop, so that no update is lost (the atomic variant of PASSCoDe,
+// Hsieh et al., ICML 2015)
+static inline void shared_add(double *p, double v)
+{
+	double old, sum;
+	__atomic_load(p, &old, __ATOMIC_RELAXED);
+	do
+		sum = old + v;
+	while(!__atomic_compare_exchange(p, &old, &sum, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-	delete [] index;
-	delete [] y;
-	delete [] b;
-	delete [] xj_sq;
+template <class Row>
+static double row_dot_shared(double *w, Row x)
+{
+	double dot = 0, wj;
+	for(; x.more(); x.next())
+	{
+		__atomic_load(&w[x.index()-1], &wj, __ATOMIC_RELAXED);
+		dot += wj*x.value();
+	}
+	return dot;
+}
+
+template <class Row>
+static void row_axpy_shared(double a, Row x, double *w)
+{
+	for(; x.more(); x.next())
+		shared_add(&w[x.index()-1], a*x.value());
+}
+
+// the instances index[0..size) that one thread of a dual solver updates during
+// an outer iteration
+struct dual_slice
+{
+	int *index;
+	int size;
+};
+
+// rubylinear addition: splits the shuffled index[0..size) in nr_thread slices
+template <class Slice>
+static void split_slices(int *index, int size, Slice *slices, int nr_thread)
+{
+	for(int t=0;t<nr_thread;t++)
+	{
+		int begin = (int)((long)t*size/nr_thread);
+		slices[t].index = index + begin;
+		slices[t].size = (int)((long)(t+1)*size/nr_thread) - begin;
+	}
 }
 
 // A coordinate descent algorithm for 
-// L1-regularized logistic regression problems
+// L1-loss and L2-loss SVM dual problems
 //
-//  min_w \sum |wj| + C \sum log(1+exp(-yi w^T xi)),
+//  min_\alpha  0.5(\alpha^T (Q + D)\alpha) - e^T \alpha,
+//    s.t.      0 <= alpha_i <= upper_bound_i,
+// 
+//  where Qij = yi yj xi^T xj and
+//  D is a diagonal matrix 
+//
+// In L1-SVM case:
+// 		upper_bound_i = Cp*W_i if y_i = 1
+// 		upper_bound_i = Cn*W_i if y_i = -1
+// 		D_ii = 0
+// In L2-SVM case:
+// 		upper_bound_i = INF
+// 		D_ii = 1/(2*Cp*W_i)	if y_i = 1
+// 		D_ii = 1/(2*Cn*W_i)	if y_i = -1
 //
 // Given: 
-// x, y, Cp, Cn
+// x, y, Cp, Cn, W (the instance weights)
 // eps is the stopping tolerance
 //
 // solution will be put in w
 //
-// See Yuan et al. (2011) and appendix of LIBLINEAR paper, Fan et al. (2008)
+// alpha, if not NULL, holds the dual solution to start from (w must then be
+// \sum y_i alpha_i x_i) and receives the new one; otherwise the solver
+// starts from alpha = w = 0
+//
+// With nr_thread > 1 the instances of each outer iteration are split between
+// nr_thread threads which update w concurrently. Each thread shrinks the
+// instances of its own slice, and the projected gradient bounds are combined
+// before the stopping test, which is unchanged
+// 
+// See Algorithm 3 of Hsieh et al., ICML 2008
 
 #undef GETI
-#define GETI(i) (y[i]+1)
-// To support weights for instances, use GETI(i) (i)
+#define GETI(i) (i)
 
-static void solve_l1r_lr(
-	const problem *prob_col, double *w, double eps, 
-	double Cp, double Cn)
+template <class Rows>
+struct l1l2_svc_slice : dual_slice
 {
-	int l = prob_col->l;
-	int w_size = prob_col->n;
-	int j, s, newton_iter=0, iter=0;
-	int max_newton_iter = 100;
-	int max_iter = 1000;
-	int max_num_linesearch = 20;
-	int active_size;
-	int QP_active_size;
+	const Rows *x;
+	double *w, *alpha;
+	const schar *y;
+	const double *QD, *diag, *upper_bound;
+	double PGmax_old, PGmin_old;
+	double PGmax_new, PGmin_new;
+	int active_size; // the active instances are moved to the start of the slice
+};
 
-	double nu = 1e-12;
-	double inner_eps = 1;
-	double sigma = 0.01;
-	double w_norm=0, w_norm_new;
-	double z, G, H;
-	double Gnorm1_init;
-	double Gmax_old = INF;
-	double Gmax_new, Gnorm1_new;
-	double QP_Gmax_old = INF;
-	double QP_Gmax_new, QP_Gnorm1_new;
-	double delta, negsum_xTd, cond;
+template <class Rows, bool shared>
+static void *l1l2_svc_pass(void *arg)
+{
+	l1l2_svc_slice<Rows> *slice = (l1l2_svc_slice<Rows> *)arg;
+	const Rows &x = *slice->x;
+	double *w = slice->w, *alpha = slice->alpha;
+	const schar *y = slice->y;
+	const double *QD = slice->QD, *diag = slice->diag, *upper_bound = slice->upper_bound;
+	int *index = slice->index;
+	int active_size = slice->size;
+	double PGmax_old = slice->PGmax_old, PGmin_old = slice->PGmin_old;
+	double PGmax_new = -INF, PGmin_new = INF;
+	int i, s;
+	double C, d, G, PG;
+
+	for (s=0; s<active_size; s++)
+	{
+		i = index[s];
+		schar yi = y[i];
 
-	int *index = new int[w_size];
-	schar *y = new schar[l];
-	double *Hdiag = new double[w_size];
-	double *Grad = new double[w_size];
-	double *wpd = new double[w_size];
-	double *xjneg_sum = new double[w_size];
-	double *xTd = new double[l];
-	double *exp_wTx = new double[l];
-	double *exp_wTx_new = new double[l];
-	double *tau = new double[l];
-	double *D = new double[l];
-	feature_node *x;
+		G = shared ? row_dot_shared(w, x[i]) : row_dot(w, x[i]);
+		G = G*yi-1;
 
-	double C[3] = {Cn,0,Cp};
+		C = upper_bound[GETI(i)];
+		G += alpha[i]*diag[GETI(i)];
 
-	for(j=0; j<l; j++)
-	{
-		if(prob_col->y[j] > 0)
-			y[j] = 1;
+		PG = 0;
+		if (alpha[i] == 0)
+		{
+			if (G > PGmax_old)
+			{
+				active_size--;
+				swap(index[s], index[active_size]);
+				s--;
+				continue;
+			}
+			else if (G < 0)
+				PG = G;
+		}
+		else if (alpha[i] == C)
+		{
+			if (G < PGmin_old)
+			{
+				active_size--;
+				swap(index[s], index[active_size]);
+				s--;
+				continue;
+			}
+			else if (G > 0)
+				PG = G;
+		}
 		else
-			y[j] = -1;
+			PG = G;
 
-		// assume initial w is 0
-		exp_wTx[j] = 1;
-		tau[j] = C[GETI(j)]*0.5;
-		D[j] = C[GETI(j)]*0.25;
+		PGmax_new = max(PGmax_new, PG);
+		PGmin_new = min(PGmin_new, PG);
+
+		if(fabs(PG) > 1.0e-12)
+		{
+			double alpha_old = alpha[i];
+			alpha[i] = min(max(alpha[i] - G/QD[i], 0.0), C);
+			d = (alpha[i] - alpha_old)*yi;
+			if(shared)
+				row_axpy_shared(d, x[i], w);
+			else
+				row_axpy(d, x[i], w);
+		}
 	}
-	for(j=0; j<w_size; j++)
+
+	slice->PGmax_new = PGmax_new;
+	slice->PGmin_new = PGmin_new;
+	slice->active_size = active_size;
+	return NULL;
+}
+
+template <class Rows>
+static int solve_l2r_l1l2_svc(
+	const problem *prob, double *w, double *alpha_init, double eps, 
+	double Cp, double Cn, int solver_type, solver_monitor *monitor)
+{
+	Rows x(prob);
+	int l = prob->l;
+	int w_size = prob->n;
+	int i, iter = 0;
+	double *QD = new double[l];
+	int max_iter = monitor->max_iter(1000);
+	bool converged = false;
+	int *index = new int[l];
+	double *alpha = alpha_init != NULL ? alpha_init : new double[l];
+	schar *y = new schar[l];
+	int active_size = l;
+	int nr_thread = max(monitor->nr_thread, 1);
+	l1l2_svc_slice<Rows> *slices = new l1l2_svc_slice<Rows>[nr_thread];
+	worker_pool *pool = nr_thread > 1 ? new worker_pool(nr_thread) : NULL;
+	int *index_tmp = nr_thread > 1 ? new int[l] : NULL;
+
+	// PG: projected gradient, for shrinking and stopping
+	double PGmax_old = INF;
+	double PGmin_old = -INF;
+	double PGmax_new, PGmin_new;
+
+	double *diag = new double[l];
+	double *upper_bound = new double[l];
+
+	if(alpha_init == NULL)
 	{
-		w[j] = 0;
-		wpd[j] = w[j];
-		index[j] = j;
-		xjneg_sum[j] = 0;
-		x = prob_col->x[j];
-		while(x->index != -1)
+		for(i=0; i<w_size; i++)
+			w[i] = 0;
+		for(i=0; i<l; i++)
+			alpha[i] = 0;
+	}
+	for(i=0; i<l; i++)
+	{
+		if(prob->y[i] > 0)
 		{
-			int ind = x->index-1;
-			if(y[ind] == -1)
-				xjneg_sum[j] += C[GETI(ind)]*x->value;
-			x++;
+			y[i] = +1; 
+		}
+		else
+		{
+			y[i] = -1;
 		}
+		double Ci = (y[i] > 0 ? Cp : Cn)*instance_weight(prob, i);
+		if(solver_type == L2R_L1LOSS_SVC_DUAL)
+		{
+			diag[i] = 0;
+			upper_bound[i] = Ci;
+		}
+		else // default solver_type: L2R_L2LOSS_SVC_DUAL
+		{
+			diag[i] = 0.5/Ci;
+			upper_bound[i] = INF;
+		}
+		QD[i] = diag[GETI(i)] + row_sqnorm(x[i]);
+		index[i] = i;
+	}
+	for(int t=0; t<nr_thread; t++)
+	{
+		slices[t].x = &x;
+		slices[t].w = w;
+		slices[t].alpha = alpha;
+		slices[t].y = y;
+		slices[t].QD = QD;
+		slices[t].diag = diag;
+		slices[t].upper_bound = upper_bound;
 	}
 
-	while(newton_iter < max_newton_iter)
+	while (iter < max_iter)
 	{
-		Gmax_new = 0;
-		Gnorm1_new = 0;
-		active_size = w_size;
+		PGmax_new = -INF;
+		PGmin_new = INF;
 
-		for(s=0; s<active_size; s++)
+		for (i=0; i<active_size; i++)
 		{
-			j = index[s];
-			Hdiag[j] = nu;
-			Grad[j] = 0;
+			int j = i+monitor->random.uniform(active_size-i);
+			swap(index[i], index[j]);
+		}
 
-			double tmp = 0;
-			x = prob_col->x[j];
-			while(x->index != -1)
+		split_slices(index, active_size, slices, nr_thread);
+		for(int t=0; t<nr_thread; t++)
+		{
+			slices[t].PGmax_old = PGmax_old;
+			slices[t].PGmin_old = PGmin_old;
+		}
+		if(nr_thread == 1)
+			l1l2_svc_pass<Rows, false>(&slices[0]);
+		else
+			pool->run(l1l2_svc_pass<Rows, true>, slices, sizeof(slices[0]), nr_thread);
+
+		// the instances still active go first, then those shrunk in this iteration
+		int new_active_size = 0;
+		for(int t=0; t<nr_thread; t++)
+		{
+			PGmax_new = max(PGmax_new, slices[t].PGmax_new);
+			PGmin_new = min(PGmin_new, slices[t].PGmin_new);
+			if(nr_thread > 1)
+				memcpy(index_tmp+new_active_size, slices[t].index, sizeof(int)*slices[t].active_size);
+			new_active_size += slices[t].active_size;
+		}
+		if(nr_thread > 1)
+		{
+			int k = new_active_size;
+			for(int t=0; t<nr_thread; t++)
 			{
-				int ind = x->index-1;
-				Hdiag[j] += x->value*x->value*D[ind];
-				tmp += x->value*tau[ind];
-				x++;
+				memcpy(index_tmp+k, slices[t].index+slices[t].active_size, sizeof(int)*(slices[t].size-slices[t].active_size));
+				k += slices[t].size-slices[t].active_size;
 			}
-			Grad[j] = -tmp + xjneg_sum[j];
+			memcpy(index, index_tmp, sizeof(int)*active_size);
+		}
+		active_size = new_active_size;
 
-			double Gp = Grad[j]+1;
-			double Gn = Grad[j]-1;
-			double violation = 0;
+		iter++;
+		if(iter % 10 == 0)
+			monitor->info(".");
+		if(monitor->stop(w))
+			break;
+
+		if(PGmax_new - PGmin_new <= eps)
+		{
+			if(active_size == l)
+			{
+				converged = true;
+				break;
+			}
+			else
+			{
+				active_size = l;
+				monitor->info("*");
+				PGmax_old = INF;
+				PGmin_old = -INF;
+				continue;
+			}
+		}
+		PGmax_old = PGmax_new;
+		PGmin_old = PGmin_new;
+		if (PGmax_old <= 0)
+			PGmax_old = INF;
+		if (PGmin_old >= 0)
+			PGmin_old = -INF;
+	}
+
+	monitor->info("\noptimization finished, #iter = %d\n",iter);
+	if (iter >= max_iter && !converged)
+	{
+		monitor->info("\nWARNING: reaching max number of iterations\nUsing -s 2 may be faster (also see FAQ)\n\n");
+		monitor->reached_max_iter();
+	}
+
+	// calculate objective value
+
+	double v = 0;
+	int nSV = 0;
+	for(i=0; i<w_size; i++)
+		v += w[i]*w[i];
+	for(i=0; i<l; i++)
+	{
+		v += alpha[i]*(alpha[i]*diag[GETI(i)] - 2);
+		if(alpha[i] > 0)
+			++nSV;
+	}
+	monitor->info("Objective value = %lf\n",v/2);
+	monitor->info("nSV = %d\n",nSV);
+
+	delete [] diag;
+	delete [] upper_bound;
+	delete [] QD;
+	if(alpha_init == NULL)
+		delete [] alpha;
+	delete [] y;
+	delete [] index;
+	delete [] slices;
+	delete pool;
+	delete [] index_tmp;
+
+	return iter;
+}
+
+// A coordinate descent algorithm for 
+// the dual of L2-regularized logistic regression problems
+//
+//  min_\alpha  0.5(\alpha^T Q \alpha) + \sum \alpha_i log (\alpha_i) + (upper_bound_i - alpha_i) log (upper_bound_i - alpha_i) ,
+//    s.t.      0 <= alpha_i <= upper_bound_i,
+// 
+//  where Qij = yi yj xi^T xj and 
+//  upper_bound_i = Cp*W_i if y_i = 1
+//  upper_bound_i = Cn*W_i if y_i = -1
+//
+// Given: 
+// x, y, Cp, Cn, W (the instance weights)
+// eps is the stopping tolerance
+//
+// solution will be put in w
+//
+// alpha, if not NULL, holds the 2*l values alpha_i, upper_bound_i - alpha_i
+// to start from (w must then be \sum y_i alpha_i x_i) and receives the new
+// ones; otherwise the solver starts from alpha_i = min(0.001 upper_bound_i, 1e-8)
+//
+// With nr_thread > 1 the instances of each outer iteration are split between
+// nr_thread threads which update w concurrently, as in solve_l2r_l1l2_svc
+//
+// See Algorithm 5 of Yu et al., MLJ 2010
+
+#undef GETI
+#define GETI(i) (i)
+
+template <class Rows>
+struct lr_dual_slice : dual_slice
+{
+	const Rows *x;
+	double *w, *alpha;
+	const schar *y;
+	const double *xTx, *upper_bound;
+	int max_inner_iter;
+	double innereps;
+	double Gmax;
+	int newton_iter;
+};
+
+template <class Rows, bool shared>
+static void *lr_dual_pass(void *arg)
+{
+	lr_dual_slice<Rows> *slice = (lr_dual_slice<Rows> *)arg;
+	const Rows &x = *slice->x;
+	double *w = slice->w, *alpha = slice->alpha;
+	const schar *y = slice->y;
+	const double *xTx = slice->xTx, *upper_bound = slice->upper_bound;
+	int max_inner_iter = slice->max_inner_iter;
+	double innereps = slice->innereps;
+	int newton_iter = 0;
+	double Gmax = 0;
+	for (int s=0; s<slice->size; s++)
+	{
+		int i = slice->index[s];
+		schar yi = y[i];
+		double C = upper_bound[GETI(i)];
+		double ywTx = shared ? row_dot_shared(w, x[i]) : row_dot(w, x[i]), xisq = xTx[i];
+		ywTx *= y[i];
+		double a = xisq, b = ywTx;
+
+		// Decide to minimize g_1(z) or g_2(z)
+		int ind1 = 2*i, ind2 = 2*i+1, sign = 1;
+		if(0.5*a*(alpha[ind2]-alpha[ind1])+b < 0) 
+		{
+			ind1 = 2*i+1;
+			ind2 = 2*i;
+			sign = -1;
+		}
+
+		//  g_t(z) = z*log(z) + (C-z)*log(C-z) + 0.5a(z-alpha_old)^2 + sign*b(z-alpha_old)
+		double alpha_old = alpha[ind1];
+		double z = alpha_old;
+		if(C - z < 0.5 * C) 
+			z = 0.1*z;
+		double gp = a*(z-alpha_old)+sign*b+log(z/(C-z));
+		Gmax = max(Gmax, fabs(gp));
+
+		// Newton method on the sub-problem
+		const double eta = 0.1; // xi in the paper
+		int inner_iter = 0;
+		while (inner_iter <= max_inner_iter) 
+		{
+			if(fabs(gp) < innereps)
+				break;
+			double gpp = a + C/(C-z)/z;
+			double tmpz = z - gp/gpp;
+			if(tmpz <= 0) 
+				z *= eta;
+			else // tmpz in (0, C)
+				z = tmpz;
+			gp = a*(z-alpha_old)+sign*b+log(z/(C-z));
+			newton_iter++;
+			inner_iter++;
+		}
+
+		if(inner_iter > 0) // update w
+		{
+			alpha[ind1] = z;
+			alpha[ind2] = C-z;
+			if(shared)
+				row_axpy_shared(sign*(z-alpha_old)*yi, x[i], w);
+			else
+				row_axpy(sign*(z-alpha_old)*yi, x[i], w);
+		}
+	}
+	slice->Gmax = Gmax;
+	slice->newton_iter = newton_iter;
+	return NULL;
+}
+
+template <class Rows>
+static int solve_l2r_lr_dual(const problem *prob, double *w, double *alpha_init, double eps, double Cp, double Cn, solver_monitor *monitor)
+{
+	Rows x(prob);
+	int l = prob->l;
+	int w_size = prob->n;
+	int i, iter = 0;
+	double *xTx = new double[l];
+	int max_iter = monitor->max_iter(1000);
+	bool converged = false;
+	int *index = new int[l];		
+	double *alpha = alpha_init != NULL ? alpha_init : new double[2*l]; // store alpha and C - alpha
+	schar *y = new schar[l];	
+	int max_inner_iter = 100; // for inner Newton
+	double innereps = 1e-2; 
+	double innereps_min = min(1e-8, eps);
+	double *upper_bound = new double[l];
+	int nr_thread = max(monitor->nr_thread, 1);
+	lr_dual_slice<Rows> *slices = new lr_dual_slice<Rows>[nr_thread];
+	worker_pool *pool = nr_thread > 1 ? new worker_pool(nr_thread) : NULL;
+
+	if(alpha_init == NULL)
+		for(i=0; i<w_size; i++)
+			w[i] = 0;
+	for(i=0; i<l; i++)
+	{
+		if(prob->y[i] > 0)
+		{
+			y[i] = +1; 
+		}
+		else
+		{
+			y[i] = -1;
+		}
+		upper_bound[i] = (y[i] > 0 ? Cp : Cn)*instance_weight(prob, i);
+		if(alpha_init == NULL)
+		{
+			alpha[2*i] = min(0.001*upper_bound[GETI(i)], 1e-8);
+			alpha[2*i+1] = upper_bound[GETI(i)] - alpha[2*i];
+		}
+
+		xTx[i] = row_sqnorm(x[i]);
+		if(alpha_init == NULL)
+			row_axpy(y[i]*alpha[2*i], x[i], w);
+		index[i] = i;
+	}
+
+	while (iter < max_iter)
+	{
+		for (i=0; i<l; i++)
+		{
+			int j = i+monitor->random.uniform(l-i);
+			swap(index[i], index[j]);
+		}
+		split_slices(index, l, slices, nr_thread);
+		for(int t=0; t<nr_thread; t++)
+		{
+			slices[t].x = &x;
+			slices[t].w = w;
+			slices[t].alpha = alpha;
+			slices[t].y = y;
+			slices[t].xTx = xTx;
+			slices[t].upper_bound = upper_bound;
+			slices[t].max_inner_iter = max_inner_iter;
+			slices[t].innereps = innereps;
+		}
+		if(nr_thread == 1)
+			lr_dual_pass<Rows, false>(&slices[0]);
+		else
+			pool->run(lr_dual_pass<Rows, true>, slices, sizeof(slices[0]), nr_thread);
+
+		int newton_iter = 0;
+		double Gmax = 0;
+		for(int t=0; t<nr_thread; t++)
+		{
+			newton_iter += slices[t].newton_iter;
+			Gmax = max(Gmax, slices[t].Gmax);
+		}
+
+		iter++;
+		if(iter % 10 == 0)
+			monitor->info(".");
+		if(monitor->stop(w))
+			break;
+
+		if(Gmax < eps) 
+		{
+			converged = true;
+			break;
+		}
+
+		if(newton_iter <= l/10) 
+			innereps = max(innereps_min, 0.1*innereps);
+
+	}
+
+	monitor->info("\noptimization finished, #iter = %d\n",iter);
+	if (iter >= max_iter && !converged)
+	{
+		monitor->info("\nWARNING: reaching max number of iterations\nUsing -s 0 may be faster (also see FAQ)\n\n");
+		monitor->reached_max_iter();
+	}
+
+	// calculate objective value
+	
+	double v = 0;
+	for(i=0; i<w_size; i++)
+		v += w[i] * w[i];
+	v *= 0.5;
+	for(i=0; i<l; i++)
+		v += alpha[2*i] * log(alpha[2*i]) + alpha[2*i+1] * log(alpha[2*i+1]) 
+			- upper_bound[GETI(i)] * log(upper_bound[GETI(i)]);
+	monitor->info("Objective value = %lf\n", v);
+
+	delete [] upper_bound;
+	delete [] xTx;
+	if(alpha_init == NULL)
+		delete [] alpha;
+	delete [] y;
+	delete [] index;
+	delete [] slices;
+	delete pool;
+
+	return iter;
+}
+
+// rubylinear addition: Shotgun style parallel coordinate descent for the L1
+// solvers (Bradley et al., ICML 2011). The features are colored once so that
+// the columns of the features of a color have no instance in common: their
+// updates of the per-instance array (b or xTd) then never touch the same entry
+// and need no atomics. Each outer iteration goes through the colors in random
+// order and splits the shuffled active features of a color between the
+// threads, which all finish before the next color starts. A feature update
+// only reads the entries of its own column, so the result does not depend on
+// how the threads interleave. The features left when the colors get small go
+// in a last color whose columns may overlap, updated on one thread.
+
+#define SHOTGUN_MAX_COLORS 256
+#define SHOTGUN_MIN_COLOR_SIZE 16
+#define SHOTGUN_MIN_SLICE_SIZE 64 // fewer features per thread are not worth a thread
+
+// what a feature update reports
+enum { FEATURE_SHRUNK, FEATURE_UPDATED, FEATURE_RECOMPUTE };
+
+struct feature_colors
+{
+	int nr_color;
+	bool overlap; // whether the columns of the last color may overlap
+	int *start; // the features of color c are feature[start[c]..start[c+1])
+	int *feature;
+	int *active_size; // and the first active_size[c] of them are active
+	int *order;
+	int *feature_tmp;
+	long nr_pass, nr_parallel_pass; // the passes over a color, and those split between threads
+};
+
+// greedily colors the features of prob_col: each pass over the features not yet
+// colored takes those whose column has no instance in common with the columns
+// already taken
+static void color_features(const problem *prob_col, feature_colors *colors)
+{
+	int l = prob_col->l;
+	int w_size = prob_col->n;
+	int *color = new int[w_size];
+	int *owner = new int[l]; // the last color whose columns have the instance
+	int nr_color = 0, nr_left = w_size;
+	int j, c;
+
+	for(j=0; j<w_size; j++)
+		color[j] = -1;
+	for(j=0; j<l; j++)
+		owner[j] = -1;
+
+	while(nr_left > 0 && nr_color < SHOTGUN_MAX_COLORS)
+	{
+		int size = 0;
+		for(j=0; j<w_size; j++)
+		{
+			if(color[j] != -1)
+				continue;
+			feature_node *x = prob_col->x[j];
+			while(x->index != -1 && owner[x->index-1] != nr_color)
+				x++;
+			if(x->index != -1)
+				continue;
+			for(x=prob_col->x[j]; x->index != -1; x++)
+				owner[x->index-1] = nr_color;
+			color[j] = nr_color;
+			size++;
+		}
+		nr_left -= size;
+		nr_color++;
+		if(size < SHOTGUN_MIN_COLOR_SIZE)
+			break;
+	}
+	colors->overlap = nr_left > 0;
+	if(colors->overlap)
+	{
+		for(j=0; j<w_size; j++)
+			if(color[j] == -1)
+				color[j] = nr_color;
+		nr_color++;
+	}
+
+	colors->nr_color = nr_color;
+	colors->nr_pass = 0;
+	colors->nr_parallel_pass = 0;
+	colors->start = new int[nr_color+1];
+	colors->feature = new int[w_size];
+	colors->active_size = new int[nr_color];
+	colors->order = new int[nr_color];
+	colors->feature_tmp = new int[w_size];
+	for(c=0; c<=nr_color; c++)
+		colors->start[c] = 0;
+	for(j=0; j<w_size; j++)
+		colors->start[color[j]+1]++;
+	for(c=0; c<nr_color; c++)
+	{
+		colors->start[c+1] += colors->start[c];
+		colors->active_size[c] = 0;
+	}
+	for(j=0; j<w_size; j++)
+	{
+		c = color[j];
+		colors->feature[colors->start[c] + colors->active_size[c]++] = j;
+	}
+
+	delete [] color;
+	delete [] owner;
+}
+
+// makes all the features active again
+static void reactivate_colors(feature_colors *colors)
+{
+	for(int c=0; c<colors->nr_color; c++)
+		colors->active_size[c] = colors->start[c+1] - colors->start[c];
+}
+
+// makes the features index[0..size) the active ones
+static void activate_features(feature_colors *colors, const int *index, int size)
+{
+	int *active = colors->feature_tmp;
+	int c, j, s;
+	for(c=0; c<colors->nr_color; c++)
+		for(s=colors->start[c]; s<colors->start[c+1]; s++)
+			active[colors->feature[s]] = 0;
+	for(j=0; j<size; j++)
+		active[index[j]] = 1;
+	for(c=0; c<colors->nr_color; c++)
+	{
+		int *feature = colors->feature + colors->start[c];
+		int k = 0;
+		for(s=0; s<colors->start[c+1]-colors->start[c]; s++)
+			if(active[feature[s]])
+				swap(feature[k++], feature[s]);
+		colors->active_size[c] = k;
+	}
+}
+
+static void free_colors(feature_colors *colors)
+{
+	delete [] colors->start;
+	delete [] colors->feature;
+	delete [] colors->active_size;
+	delete [] colors->order;
+	delete [] colors->feature_tmp;
+}
+
+// the features index[0..size) of a color that one thread updates. Solver has
+// int update(int j, double &Gmax_new, double &Gnorm1_new)
+template <class Solver>
+struct shotgun_slice : dual_slice
+{
+	Solver *solver;
+	int active_size;
+	double Gmax_new, Gnorm1_new;
+	void (Solver::*recompute_now)();	// when the slice is alone on its color, else NULL
+	int nr_recompute;	// the updates asking for the per-instance array to be recomputed
+};
+
+template <class Solver>
+static void *shotgun_pass(void *arg)
+{
+	shotgun_slice<Solver> *slice = (shotgun_slice<Solver> *)arg;
+	slice->active_size = slice->size;
+	for(int s=0; s<slice->active_size; s++)
+	{
+		int status = slice->solver->update(slice->index[s], slice->Gmax_new, slice->Gnorm1_new);
+		if(status == FEATURE_SHRUNK)
+		{
+			slice->active_size--;
+			swap(slice->index[s], slice->index[slice->active_size]);
+			s--;
+		}
+		else if(status == FEATURE_RECOMPUTE)
+		{
+			slice->nr_recompute++;
+			if(slice->recompute_now != NULL)
+				(slice->solver->*slice->recompute_now)();
+		}
+	}
+	return NULL;
+}
+
+// one outer iteration over the active features of every color. Returns how
+// many stay active. When an update asks for it, recompute (NULL if the solver
+// never does) rebuilds the per-instance array: right away when a single thread
+// goes through the color, else once the pass is done and before the next
+// color reads the array. The features of a color share no instance, so the
+// others of the pass never read the entries that update left stale
+template <class Solver>
+static int shotgun_iteration(
+	Solver *solver, feature_colors *colors, shotgun_slice<Solver> *slices, worker_pool *pool, int nr_thread,
+	solver_monitor *monitor, void (Solver::*recompute)(), double &Gmax_new, double &Gnorm1_new)
+{
+	int c, k, s, t;
+	int nr_color = colors->nr_color;
+	int active_size = 0;
+	random_generator *random = &monitor->random;
+
+	for(t=0; t<nr_thread; t++)
+	{
+		slices[t].solver = solver;
+		slices[t].Gmax_new = 0;
+		slices[t].Gnorm1_new = 0;
+	}
+
+	for(c=0; c<nr_color; c++)
+		colors->order[c] = c;
+	for(k=0; k<nr_color; k++)
+	{
+		int i = k+random->uniform(nr_color-k);
+		swap(colors->order[i], colors->order[k]);
+	}
+
+	for(k=0; k<nr_color; k++)
+	{
+		c = colors->order[k];
+		int *feature = colors->feature + colors->start[c];
+		int size = colors->active_size[c];
+		for(s=0; s<size; s++)
+		{
+			int i = s+random->uniform(size-s);
+			swap(feature[i], feature[s]);
+		}
+
+		int nr_slice = 1;
+		if(!(colors->overlap && c == nr_color-1))
+			nr_slice = max(1, min(nr_thread, size/SHOTGUN_MIN_SLICE_SIZE));
+		split_slices(feature, size, slices, nr_slice);
+		colors->nr_pass++;
+		if(nr_slice > 1)
+			colors->nr_parallel_pass++;
+		for(t=0; t<nr_slice; t++)
+		{
+			slices[t].recompute_now = nr_slice == 1 ? recompute : NULL;
+			slices[t].nr_recompute = 0;
+		}
+		if(nr_slice == 1)
+			shotgun_pass<Solver>(&slices[0]);
+		else
+			pool->run(shotgun_pass<Solver>, slices, sizeof(slices[0]), nr_slice);
+		int nr_recompute = 0;
+		for(t=0; t<nr_slice; t++)
+			nr_recompute += slices[t].nr_recompute;
+		if(nr_recompute > 0)
+		{
+			monitor->info("#");
+			// no pass is running on the pool here
+			if(nr_slice > 1)
+				(solver->*recompute)();
+		}
+
+		// the features still active go first, then those shrunk in this iteration
+		int *feature_tmp = colors->feature_tmp;
+		int new_size = 0;
+		for(t=0; t<nr_slice; t++)
+		{
+			memcpy(feature_tmp+new_size, slices[t].index, sizeof(int)*slices[t].active_size);
+			new_size += slices[t].active_size;
+		}
+		s = new_size;
+		for(t=0; t<nr_slice; t++)
+		{
+			memcpy(feature_tmp+s, slices[t].index+slices[t].active_size, sizeof(int)*(slices[t].size-slices[t].active_size));
+			s += slices[t].size-slices[t].active_size;
+		}
+		memcpy(feature, feature_tmp, sizeof(int)*size);
+		colors->active_size[c] = new_size;
+		active_size += new_size;
+	}
+
+	Gmax_new = 0;
+	Gnorm1_new = 0;
+	for(t=0; t<nr_thread; t++)
+	{
+		Gmax_new = max(Gmax_new, slices[t].Gmax_new);
+		Gnorm1_new += slices[t].Gnorm1_new;
+	}
+	return active_size;
+}
+
+// A coordinate descent algorithm for 
+// L1-regularized L2-loss support vector classification
+//
+//  min_w \sum |wj| + C \sum max(0, 1-yi w^T xi)^2,
+//
+// Given: 
+// x, y, Cp, Cn, W (the instance weights)
+// eps is the stopping tolerance
+//
+// w holds the initial solution (zero or a warm start) and the solution
+// will be put in w
+//
+// See Yuan et al. (2010) and appendix of LIBLINEAR paper, Fan et al. (2008)
+
+#undef GETI
+#define GETI(i) (i)
+
+// rubylinear addition: what the feature updates of solve_l1r_l2_svc share, so
+// that the sequential loop and the Shotgun threads run the same code
+struct l1r_l2_svc_state
+{
+	const problem *prob_col;
+	const schar *y;
+	double *w;
+	double *b; // b = 1-ywTx
+	double *xj_sq;
+	double *C;
+	double Gmax_old;
+	int l, w_size;
+
+	int update(int j, double &Gmax_new, double &Gnorm1_new);
+	void recompute_b();
+};
+
+int l1r_l2_svc_state::update(int j, double &Gmax_new, double &Gnorm1_new)
+{
+	const int max_num_linesearch = 20;
+	const double sigma = 0.01;
+	double d, G_loss, G, H;
+	double d_old, d_diff;
+	double loss_old = 0, loss_new;
+	double appxcond, cond;
+	feature_node *x;
+
+	G_loss = 0;
+	H = 0;
+
+	x = prob_col->x[j];
+	while(x->index != -1)
+	{
+		int ind = x->index-1;
+		if(b[ind] > 0)
+		{
+			double val = y[ind]*x->value;
+			double tmp = C[GETI(ind)]*val;
+			G_loss -= tmp*b[ind];
+			H += tmp*val;
+		}
+		x++;
+	}
+	G_loss *= 2;
+
+	G = G_loss;
+	H *= 2;
+	H = max(H, 1e-12);
+
+	double Gp = G+1;
+	double Gn = G-1;
+	double violation = 0;
+	if(w[j] == 0)
+	{
+		if(Gp < 0)
+			violation = -Gp;
+		else if(Gn > 0)
+			violation = Gn;
+		else if(Gp>Gmax_old/l && Gn<-Gmax_old/l)
+			return FEATURE_SHRUNK;
+	}
+	else if(w[j] > 0)
+		violation = fabs(Gp);
+	else
+		violation = fabs(Gn);
+
+	Gmax_new = max(Gmax_new, violation);
+	Gnorm1_new += violation;
+
+	// obtain Newton direction d
+	if(Gp <= H*w[j])
+		d = -Gp/H;
+	else if(Gn >= H*w[j])
+		d = -Gn/H;
+	else
+		d = -w[j];
+
+	if(fabs(d) < 1.0e-12)
+		return FEATURE_UPDATED;
+
+	double delta = fabs(w[j]+d)-fabs(w[j]) + G*d;
+	d_old = 0;
+	int num_linesearch;
+	for(num_linesearch=0; num_linesearch < max_num_linesearch; num_linesearch++)
+	{
+		d_diff = d_old - d;
+		cond = fabs(w[j]+d)-fabs(w[j]) - sigma*delta;
+
+		appxcond = xj_sq[j]*d*d + G_loss*d + cond;
+		if(appxcond <= 0)
+		{
+			x = prob_col->x[j];
+			while(x->index != -1)
+			{
+				int ind = x->index-1;
+				b[ind] += d_diff*y[ind]*x->value;
+				x++;
+			}
+			break;
+		}
+
+		if(num_linesearch == 0)
+		{
+			loss_old = 0;
+			loss_new = 0;
+			x = prob_col->x[j];
+			while(x->index != -1)
+			{
+				int ind = x->index-1;
+				if(b[ind] > 0)
+					loss_old += C[GETI(ind)]*b[ind]*b[ind];
+				double b_new = b[ind] + d_diff*y[ind]*x->value;
+				b[ind] = b_new;
+				if(b_new > 0)
+					loss_new += C[GETI(ind)]*b_new*b_new;
+				x++;
+			}
+		}
+		else
+		{
+			loss_new = 0;
+			x = prob_col->x[j];
+			while(x->index != -1)
+			{
+				int ind = x->index-1;
+				double b_new = b[ind] + d_diff*y[ind]*x->value;
+				b[ind] = b_new;
+				if(b_new > 0)
+					loss_new += C[GETI(ind)]*b_new*b_new;
+				x++;
+			}
+		}
+
+		cond = cond + loss_new - loss_old;
+		if(cond <= 0)
+			break;
+		else
+		{
+			d_old = d;
+			d *= 0.5;
+			delta *= 0.5;
+		}
+	}
+
+	w[j] += d;
+
+	// b[] has to be recomputed if line search takes too many steps
+	return num_linesearch >= max_num_linesearch ? FEATURE_RECOMPUTE : FEATURE_UPDATED;
+}
+
+void l1r_l2_svc_state::recompute_b()
+{
+	for(int i=0; i<l; i++)
+		b[i] = 1;
+
+	for(int i=0; i<w_size; i++)
+	{
+		if(w[i]==0) continue;
+		feature_node *x = prob_col->x[i];
+		while(x->index != -1)
+		{
+			int ind = x->index-1;
+			b[ind] -= w[i]*y[ind]*x->value;
+			x++;
+		}
+	}
+}
+
+static int solve_l1r_l2_svc(
+	const problem *prob_col, double *w, double eps, 
+	double Cp, double Cn, solver_monitor *monitor)
+{
+	int l = prob_col->l;
+	int w_size = prob_col->n;
+	int j, s, iter = 0;
+	int max_iter = monitor->max_iter(1000);
+	bool converged = false;
+	int active_size = w_size;
+	int nr_thread = monitor->nr_thread;
+
+	double G_loss;
+	double Gmax_old = INF;
+	double Gmax_new, Gnorm1_new;
+	double Gnorm1_init;
+
+	int *index = new int[w_size];
+	schar *y = new schar[l];
+	double *b = new double[l]; // b = 1-ywTx
+	double *xj_sq = new double[w_size];
+	feature_node *x;
+
+	double *C = new double[l];
+
+	l1r_l2_svc_state state = {prob_col, y, w, b, xj_sq, C, INF, l, w_size};
+
+	// rubylinear addition: with several threads, Shotgun over colored features
+	feature_colors colors;
+	shotgun_slice<l1r_l2_svc_state> *slices = NULL;
+	worker_pool *pool = NULL;
+	if(nr_thread > 1)
+	{
+		color_features(prob_col, &colors);
+		slices = new shotgun_slice<l1r_l2_svc_state>[nr_thread];
+		pool = new worker_pool(nr_thread);
+	}
+
+	// when warm starting, the stopping condition stays relative to the
+	// violation at w=0, which is computed along with xj_sq
+	bool warm_start = false;
+	for(j=0; j<w_size; j++)
+		if(w[j] != 0)
+			warm_start = true;
+	Gnorm1_init = 0;
+
+	for(j=0; j<l; j++)
+	{
+		b[j] = 1;
+		if(prob_col->y[j] > 0)
+			y[j] = 1;
+		else
+			y[j] = -1;
+		C[j] = (y[j] > 0 ? Cp : Cn)*instance_weight(prob_col, j);
+	}
+	for(j=0; j<w_size; j++)
+	{
+		index[j] = j;
+		xj_sq[j] = 0;
+		G_loss = 0;
+		x = prob_col->x[j];
+		while(x->index != -1)
+		{
+			int ind = x->index-1;
+			double val = y[ind]*x->value; // yi*xij, prob_col is left unchanged
+			b[ind] -= w[j]*val;
+			xj_sq[j] += C[GETI(ind)]*val*val;
+			G_loss -= C[GETI(ind)]*val;
+			x++;
+		}
+		G_loss *= 2;
+		if(G_loss+1 < 0)
+			Gnorm1_init += -(G_loss+1);
+		else if(G_loss-1 > 0)
+			Gnorm1_init += G_loss-1;
+	}
+
+	while(iter < max_iter)
+	{
+		Gmax_new = 0;
+		Gnorm1_new = 0;
+		state.Gmax_old = Gmax_old;
+
+		if(nr_thread > 1)
+			active_size = shotgun_iteration(&state, &colors, slices, pool, nr_thread, monitor, &l1r_l2_svc_state::recompute_b, Gmax_new, Gnorm1_new);
+		else
+		{
+			for(j=0; j<active_size; j++)
+			{
+				int i = j+monitor->random.uniform(active_size-j);
+				swap(index[i], index[j]);
+			}
+
+			for(s=0; s<active_size; s++)
+			{
+				int status = state.update(index[s], Gmax_new, Gnorm1_new);
+				if(status == FEATURE_SHRUNK)
+				{
+					active_size--;
+					swap(index[s], index[active_size]);
+					s--;
+				}
+				else if(status == FEATURE_RECOMPUTE)
+				{
+					monitor->info("#");
+					state.recompute_b();
+				}
+			}
+		}
+
+		if(iter == 0 && !warm_start)
+			Gnorm1_init = Gnorm1_new;
+		iter++;
+		if(iter % 10 == 0)
+			monitor->info(".");
+		if(monitor->stop(w))
+			break;
+
+		if(Gnorm1_new <= eps*Gnorm1_init)
+		{
+			if(active_size == w_size)
+			{
+				converged = true;
+				break;
+			}
+			else
+			{
+				active_size = w_size;
+				if(nr_thread > 1)
+					reactivate_colors(&colors);
+				monitor->info("*");
+				Gmax_old = INF;
+				continue;
+			}
+		}
+
+		Gmax_old = Gmax_new;
+	}
+
+	monitor->info("\noptimization finished, #iter = %d\n", iter);
+	if(nr_thread > 1)
+		monitor->info("%ld of %ld color passes on several threads\n", colors.nr_parallel_pass, colors.nr_pass);
+	if(iter >= max_iter && !converged)
+	{
+		monitor->info("\nWARNING: reaching max number of iterations\n");
+		monitor->reached_max_iter();
+	}
+
+	// calculate objective value
+
+	double v = 0;
+	int nnz = 0;
+	for(j=0; j<w_size; j++)
+	{
+		if(w[j] != 0)
+		{
+			v += fabs(w[j]);
+			nnz++;
+		}
+	}
+	for(j=0; j<l; j++)
+		if(b[j] > 0)
+			v += C[GETI(j)]*b[j]*b[j];
+
+	monitor->info("Objective value = %lf\n", v);
+	monitor->info("#nonzeros/#features = %d/%d\n", nnz, w_size);
+
+	delete [] C;
+	delete [] index;
+	delete [] y;
+	delete [] b;
+	delete [] xj_sq;
+	if(nr_thread > 1)
+	{
+		free_colors(&colors);
+		delete [] slices;
+		delete pool;
+	}
+
+	return iter;
+}
+
+// A coordinate descent algorithm for 
+// L1-regularized logistic regression problems
+//
+//  min_w \sum |wj| + C \sum log(1+exp(-yi w^T xi)),
+//
+// Given: 
+// x, y, Cp, Cn, W (the instance weights)
+// eps is the stopping tolerance
+//
+// w holds the initial solution (zero or a warm start) and the solution
+// will be put in w
+//
+// See Yuan et al. (2011) and appendix of LIBLINEAR paper, Fan et al. (2008)
+
+#undef GETI
+#define GETI(i) (i)
+
+// rubylinear addition: what the coordinate descent steps of the inner QP of
+// solve_l1r_lr share, so that the sequential loop and the Shotgun threads run
+// the same code
+struct l1r_lr_qp_state
+{
+	const problem *prob_col;
+	double *w, *wpd, *Hdiag, *Grad, *D, *xTd;
+	double nu;
+	double QP_Gmax_old;
+	int l;
+
+	int update(int j, double &QP_Gmax_new, double &QP_Gnorm1_new);
+};
+
+int l1r_lr_qp_state::update(int j, double &QP_Gmax_new, double &QP_Gnorm1_new)
+{
+	double z, G, H;
+	feature_node *x;
+
+	H = Hdiag[j];
+
+	x = prob_col->x[j];
+	G = Grad[j] + (wpd[j]-w[j])*nu;
+	while(x->index != -1)
+	{
+		int ind = x->index-1;
+		G += x->value*D[ind]*xTd[ind];
+		x++;
+	}
+
+	double Gp = G+1;
+	double Gn = G-1;
+	double violation = 0;
+	if(wpd[j] == 0)
+	{
+		if(Gp < 0)
+			violation = -Gp;
+		else if(Gn > 0)
+			violation = Gn;
+		//inner-level shrinking
+		else if(Gp>QP_Gmax_old/l && Gn<-QP_Gmax_old/l)
+			return FEATURE_SHRUNK;
+	}
+	else if(wpd[j] > 0)
+		violation = fabs(Gp);
+	else
+		violation = fabs(Gn);
+
+	QP_Gmax_new = max(QP_Gmax_new, violation);
+	QP_Gnorm1_new += violation;
+
+	// obtain solution of one-variable problem
+	if(Gp <= H*wpd[j])
+		z = -Gp/H;
+	else if(Gn >= H*wpd[j])
+		z = -Gn/H;
+	else
+		z = -wpd[j];
+
+	if(fabs(z) < 1.0e-12)
+		return FEATURE_UPDATED;
+	z = min(max(z,-10.0),10.0);
+
+	wpd[j] += z;
+
+	x = prob_col->x[j];
+	while(x->index != -1)
+	{
+		int ind = x->index-1;
+		xTd[ind] += x->value*z;
+		x++;
+	}
+	return FEATURE_UPDATED;
+}
+
+static int solve_l1r_lr(
+	const problem *prob_col, double *w, double eps, 
+	double Cp, double Cn, solver_monitor *monitor)
+{
+	int l = prob_col->l;
+	int w_size = prob_col->n;
+	int j, s, newton_iter=0, iter=0;
+	int max_newton_iter = monitor->max_newton_iter(100);
+	int max_iter = monitor->max_iter(1000);
+	bool converged = false;
+	int max_num_linesearch = 20;
+	int nr_thread = monitor->nr_thread;
+	int active_size;
+	int QP_active_size;
+	// rubylinear addition: the same exp and log1p kernels for the whole solve
+	const math_kernels *kernels = math_kernels_in_use();
+
+	double nu = 1e-12;
+	double inner_eps = 1;
+	double sigma = 0.01;
+	double w_norm=0, w_norm_new;
+	double G;
+	double Gnorm1_init;
+	double Gmax_old = INF;
+	double Gmax_new, Gnorm1_new;
+	double QP_Gmax_old = INF;
+	double QP_Gmax_new, QP_Gnorm1_new;
+	double delta, negsum_xTd, cond;
+
+	int *index = new int[w_size];
+	schar *y = new schar[l];
+	double *Hdiag = new double[w_size];
+	double *Grad = new double[w_size];
+	double *wpd = new double[w_size];
+	double *xjneg_sum = new double[w_size];
+	double *xTd = new double[l];
+	double *exp_wTx = new double[l];
+	double *exp_wTx_new = new double[l];
+	double *tau = new double[l];
+	double *D = new double[l];
+	double *exp_xTd = new double[l];
+	feature_node *x;
+
+	double *C = new double[l];
+
+	l1r_lr_qp_state qp = {prob_col, w, wpd, Hdiag, Grad, D, xTd, nu, INF, l};
+
+	// rubylinear addition: with several threads, Shotgun over colored features
+	feature_colors colors;
+	shotgun_slice<l1r_lr_qp_state> *slices = NULL;
+	worker_pool *pool = NULL;
+	if(nr_thread > 1)
+	{
+		color_features(prob_col, &colors);
+		slices = new shotgun_slice<l1r_lr_qp_state>[nr_thread];
+		pool = new worker_pool(nr_thread);
+	}
+
+	// when warm starting, the stopping condition stays relative to the
+	// violation at w=0, which is computed along with xjneg_sum
+	bool warm_start = false;
+	for(j=0; j<w_size; j++)
+		if(w[j] != 0)
+			warm_start = true;
+	Gnorm1_init = 0;
+
+	for(j=0; j<l; j++)
+	{
+		if(prob_col->y[j] > 0)
+			y[j] = 1;
+		else
+			y[j] = -1;
+		C[j] = (y[j] > 0 ? Cp : Cn)*instance_weight(prob_col, j);
+
+		exp_wTx[j] = 0;
+	}
+	for(j=0; j<w_size; j++)
+	{
+		w_norm += fabs(w[j]);
+		wpd[j] = w[j];
+		index[j] = j;
+		xjneg_sum[j] = 0;
+		double tmp = 0;
+		x = prob_col->x[j];
+		while(x->index != -1)
+		{
+			int ind = x->index-1;
+			exp_wTx[ind] += w[j]*x->value;
+			if(y[ind] == -1)
+				xjneg_sum[j] += C[GETI(ind)]*x->value;
+			tmp += C[GETI(ind)]*0.5*x->value;
+			x++;
+		}
+		G = -tmp + xjneg_sum[j];
+		if(G+1 < 0)
+			Gnorm1_init += -(G+1);
+		else if(G-1 > 0)
+			Gnorm1_init += G-1;
+	}
+	kernels->exp(l, exp_wTx, exp_wTx);
+	for(j=0; j<l; j++)
+	{
+		double tau_tmp = 1/(1+exp_wTx[j]);
+		tau[j] = C[GETI(j)]*tau_tmp;
+		D[j] = C[GETI(j)]*exp_wTx[j]*tau_tmp*tau_tmp;
+	}
+
+	while(newton_iter < max_newton_iter)
+	{
+		Gmax_new = 0;
+		Gnorm1_new = 0;
+		active_size = w_size;
+
+		for(s=0; s<active_size; s++)
+		{
+			j = index[s];
+			Hdiag[j] = nu;
+			Grad[j] = 0;
+
+			double tmp = 0;
+			x = prob_col->x[j];
+			while(x->index != -1)
+			{
+				int ind = x->index-1;
+				Hdiag[j] += x->value*x->value*D[ind];
+				tmp += x->value*tau[ind];
+				x++;
+			}
+			Grad[j] = -tmp + xjneg_sum[j];
+
+			double Gp = Grad[j]+1;
+			double Gn = Grad[j]-1;
+			double violation = 0;
 			if(w[j] == 0)
 			{
 				if(Gp < 0)
@@ -1461,656 +3085,1688 @@ static void solve_l1r_lr(
 				//outer-level shrinking
 				else if(Gp>Gmax_old/l && Gn<-Gmax_old/l)
 				{
-					active_size--;
-					swap(index[s], index[active_size]);
-					s--;
-					continue;
+					active_size--;
+					swap(index[s], index[active_size]);
+					s--;
+					continue;
+				}
+			}
+			else if(w[j] > 0)
+				violation = fabs(Gp);
+			else
+				violation = fabs(Gn);
+
+			Gmax_new = max(Gmax_new, violation);
+			Gnorm1_new += violation;
+		}
+
+		if(newton_iter == 0 && !warm_start)
+			Gnorm1_init = Gnorm1_new;
+
+		if(Gnorm1_new <= eps*Gnorm1_init)
+		{
+			converged = true;
+			break;
+		}
+
+		iter = 0;
+		QP_Gmax_old = INF;
+		QP_active_size = active_size;
+
+		for(int i=0; i<l; i++)
+			xTd[i] = 0;
+		if(nr_thread > 1)
+			activate_features(&colors, index, active_size);
+
+		// optimize QP over wpd
+		while(iter < max_iter)
+		{
+			QP_Gmax_new = 0;
+			QP_Gnorm1_new = 0;
+			qp.QP_Gmax_old = QP_Gmax_old;
+
+			if(nr_thread > 1)
+				QP_active_size = shotgun_iteration(&qp, &colors, slices, pool, nr_thread, monitor, (void (l1r_lr_qp_state::*)())NULL, QP_Gmax_new, QP_Gnorm1_new);
+			else
+			{
+				for(j=0; j<QP_active_size; j++)
+				{
+					int i = j+monitor->random.uniform(QP_active_size-j);
+					swap(index[i], index[j]);
+				}
+
+				for(s=0; s<QP_active_size; s++)
+				{
+					if(qp.update(index[s], QP_Gmax_new, QP_Gnorm1_new) == FEATURE_SHRUNK)
+					{
+						QP_active_size--;
+						swap(index[s], index[QP_active_size]);
+						s--;
+					}
+				}
+			}
+
+			iter++;
+
+			if(QP_Gnorm1_new <= inner_eps*Gnorm1_init)
+			{
+				//inner stopping
+				if(QP_active_size == active_size)
+					break;
+				//active set reactivation
+				else
+				{
+					QP_active_size = active_size;
+					if(nr_thread > 1)
+						activate_features(&colors, index, active_size);
+					QP_Gmax_old = INF;
+					continue;
+				}
+			}
+
+			QP_Gmax_old = QP_Gmax_new;
+		}
+
+		if(iter >= max_iter)
+			monitor->info("WARNING: reaching max number of inner iterations\n");
+
+		delta = 0;
+		w_norm_new = 0;
+		for(j=0; j<w_size; j++)
+		{
+			delta += Grad[j]*(wpd[j]-w[j]);
+			if(wpd[j] != 0)
+				w_norm_new += fabs(wpd[j]);
+		}
+		delta += (w_norm_new-w_norm);
+
+		negsum_xTd = 0;
+		for(int i=0; i<l; i++)
+			if(y[i] == -1)
+				negsum_xTd += C[GETI(i)]*xTd[i];
+
+		int num_linesearch;
+		for(num_linesearch=0; num_linesearch < max_num_linesearch; num_linesearch++)
+		{
+			cond = w_norm_new - w_norm + negsum_xTd - sigma*delta;
+
+			// rubylinear addition: log((1+exp_wTx_new)/(exp_xTd+exp_wTx_new)) as the log1p of
+			// (1-exp_xTd)/(exp_xTd+exp_wTx_new), with the vectorized kernels
+			kernels->exp(l, xTd, exp_xTd);
+			for(int i=0; i<l; i++)
+			{
+				exp_wTx_new[i] = exp_wTx[i]*exp_xTd[i];
+				exp_xTd[i] = (1-exp_xTd[i])/(exp_xTd[i]+exp_wTx_new[i]);
+			}
+			kernels->log1p(l, exp_xTd, exp_xTd);
+			for(int i=0; i<l; i++)
+				cond += C[GETI(i)]*exp_xTd[i];
+
+			if(cond <= 0)
+			{
+				w_norm = w_norm_new;
+				for(j=0; j<w_size; j++)
+					w[j] = wpd[j];
+				for(int i=0; i<l; i++)
+				{
+					exp_wTx[i] = exp_wTx_new[i];
+					double tau_tmp = 1/(1+exp_wTx[i]);
+					tau[i] = C[GETI(i)]*tau_tmp;
+					D[i] = C[GETI(i)]*exp_wTx[i]*tau_tmp*tau_tmp;
+				}
+				break;
+			}
+			else
+			{
+				w_norm_new = 0;
+				for(j=0; j<w_size; j++)
+				{
+					wpd[j] = (w[j]+wpd[j])*0.5;
+					if(wpd[j] != 0)
+						w_norm_new += fabs(wpd[j]);
+				}
+				delta *= 0.5;
+				negsum_xTd *= 0.5;
+				for(int i=0; i<l; i++)
+					xTd[i] *= 0.5;
+			}
+		}
+
+		// Recompute some info due to too many line search steps
+		if(num_linesearch >= max_num_linesearch)
+		{
+			for(int i=0; i<l; i++)
+				exp_wTx[i] = 0;
+
+			for(int i=0; i<w_size; i++)
+			{
+				if(w[i]==0) continue;
+				x = prob_col->x[i];
+				while(x->index != -1)
+				{
+					exp_wTx[x->index-1] += w[i]*x->value;
+					x++;
 				}
 			}
-			else if(w[j] > 0)
-				violation = fabs(Gp);
+
+			kernels->exp(l, exp_wTx, exp_wTx);
+		}
+
+		if(iter == 1)
+			inner_eps *= 0.25;
+
+		newton_iter++;
+		Gmax_old = Gmax_new;
+
+		monitor->info("iter %3d  #CD cycles %d\n", newton_iter, iter);
+		if(monitor->stop(w))
+			break;
+	}
+
+	monitor->info("=========================\n");
+	monitor->info("optimization finished, #iter = %d\n", newton_iter);
+	if(nr_thread > 1)
+		monitor->info("%ld of %ld color passes on several threads\n", colors.nr_parallel_pass, colors.nr_pass);
+	if(newton_iter >= max_newton_iter && !converged)
+	{
+		monitor->info("WARNING: reaching max number of iterations\n");
+		monitor->reached_max_iter();
+	}
+
+	// calculate objective value
+	
+	double v = 0;
+	int nnz = 0;
+	for(j=0; j<w_size; j++)
+		if(w[j] != 0)
+		{
+			v += fabs(w[j]);
+			nnz++;
+		}
+	for(j=0; j<l; j++)
+		if(y[j] == 1)
+			v += C[GETI(j)]*log(1+1/exp_wTx[j]);
+		else
+			v += C[GETI(j)]*log(1+exp_wTx[j]);
+
+	monitor->info("Objective value = %lf\n", v);
+	monitor->info("#nonzeros/#features = %d/%d\n", nnz, w_size);
+
+	delete [] C;
+	delete [] index;
+	delete [] y;
+	delete [] Hdiag;
+	delete [] Grad;
+	delete [] wpd;
+	delete [] xjneg_sum;
+	delete [] xTd;
+	delete [] exp_wTx;
+	delete [] exp_wTx_new;
+	delete [] tau;
+	delete [] D;
+	delete [] exp_xTd;
+	if(nr_thread > 1)
+	{
+		free_colors(&colors);
+		delete [] slices;
+		delete pool;
+	}
+
+	return newton_iter;
+}
+
+// rubylinear addition: strong rule screening for the L1 solvers (Tibshirani
+// et al., JRSS B 2012). With lambda = 1/C, a feature with a zero weight at the
+// solution for lambda' is likely to keep it at lambda if |g_j| < 2 lambda -
+// lambda', where g is the gradient of the loss at that solution. In the
+// scaling of the solvers (the loss multiplied by C) this reads |G_j| < 2 -
+// C/C', and the KKT condition of a zero weight |G_j| <= 1. The C' of the
+// starting weights is not known, so C/C' is estimated as max_j |G_j|, which at
+// an optimum is exactly that ratio (or C/C_max when starting from zero).
+//
+// The test discards nothing once C/C' >= 2, so when the ratio is larger than
+// SCREENING_STEP the solution is reached through intermediate Cs growing by
+// that factor, each started from the previous one, like glmnet does. This
+// covers a single C (started from zero) as well as each C of a path.
+//
+// The rule is not safe: after solving the last stage on the features left,
+// the KKT conditions are checked on the screened ones, and those violating
+// them are added back before solving again from the current weights.
+//
+// The screening is static: each stage is screened once, before it is solved,
+// and there is no gap-safe test within a stage. Inside the solver, shrinking
+// already drops the features whose weight stays at zero from the active set
+// on every outer iteration. Stopping the solver every few iterations to
+// screen again would also restart its shrinking and its stopping condition.
+
+#define SCREENING_STEP 1.5
+#define SCREENING_STAGE_EPS 10
+
+// the gradient of the loss at w for the features feature[0..size), in G.
+// coef is a work array of l doubles
+static void l1r_loss_gradient(
+	const problem *prob_col, int solver_type, const double *w, double Cp, double Cn,
+	const int *feature, int size, double *G, double *coef)
+{
+	int l = prob_col->l;
+	int w_size = prob_col->n;
+	int i, j, k;
+	feature_node *x;
+
+	for(i=0; i<l; i++)
+		coef[i] = 0;
+	for(j=0; j<w_size; j++)
+	{
+		if(w[j] == 0)
+			continue;
+		for(x=prob_col->x[j]; x->index != -1; x++)
+			coef[x->index-1] += w[j]*x->value;
+	}
+	// the derivative of each instance's loss with respect to w^T x
+	for(i=0; i<l; i++)
+	{
+		double y = prob_col->y[i] > 0 ? 1 : -1;
+		double C = (y > 0 ? Cp : Cn)*instance_weight(prob_col, i);
+		if(solver_type == L1R_L2LOSS_SVC)
+		{
+			double b = 1-y*coef[i];
+			coef[i] = b > 0 ? -2*C*y*b : 0;
+		}
+		else
+			coef[i] = -C*y/(1+exp(y*coef[i]));
+	}
+	for(k=0; k<size; k++)
+	{
+		j = feature[k];
+		G[j] = 0;
+		for(x=prob_col->x[j]; x->index != -1; x++)
+			G[j] += x->value*coef[x->index-1];
+	}
+}
+
+static int solve_l1r_screened(
+	const problem *prob_col, double *w, double eps,
+	double Cp, double Cn, solver_monitor *monitor, const parameter *param)
+{
+	int l = prob_col->l;
+	int w_size = prob_col->n;
+	int j, k, iter = 0;
+	int *all = new int[w_size];
+	int *kept = new int[w_size];
+	int *screened = new int[w_size];
+	double *G = new double[w_size];
+	double *coef = new double[l];
+	double *w_kept = new double[w_size];
+	feature_node **x_kept = new feature_node*[w_size];
+
+	// the columns of the kept features, in place of the whole data
+	problem sub_prob = *prob_col;
+	sub_prob.x = x_kept;
+
+	for(j=0; j<w_size; j++)
+		all[j] = j;
+	// the reason left by the earlier trainings sharing the monitor, restored at
+	// the end unless this one stops for another reason
+	int reason = monitor->reason;
+	monitor->reason = STOP_CONVERGED;
+	l1r_loss_gradient(prob_col, param->solver_type, w, Cp, Cn, all, w_size, G, coef);
+	double ratio = 0;
+	for(j=0; j<w_size; j++)
+		ratio = max(ratio, fabs(G[j]));
+	int nr_stage = ratio > SCREENING_STEP ? (int)ceil(log(ratio)/log(SCREENING_STEP)) : 1;
+	// the Cs of the weights are those of the problem scaled by last_factor, which
+	// is known exactly after the first stage
+	double last_factor = 1/ratio;
+
+	for(int stage=1; stage<=nr_stage; stage++)
+	{
+		double factor = stage == nr_stage ? 1 : pow(SCREENING_STEP, stage)/ratio;
+		if(stage > 1)
+			l1r_loss_gradient(prob_col, param->solver_type, w, Cp*factor, Cn*factor, all, w_size, G, coef);
+		else
+			for(j=0; j<w_size; j++)
+				G[j] *= factor;
+		double threshold = 2-factor/last_factor;
+
+		int kept_size = 0, screened_size = 0;
+		for(j=0; j<w_size; j++)
+		{
+			if(w[j] != 0 || fabs(G[j]) >= threshold)
+				kept[kept_size++] = j;
+			else
+				screened[screened_size++] = j;
+		}
+		// when most features are kept the stages cost more than they save
+		if(stage < nr_stage && 2*kept_size > w_size)
+		{
+			stage = nr_stage-1;
+			continue;
+		}
+
+		while(true)
+		{
+			monitor->info("screening: %d of %d features kept\n", kept_size, w_size);
+			sub_prob.n = kept_size;
+			for(k=0; k<kept_size; k++)
+			{
+				x_kept[k] = prob_col->x[kept[k]];
+				w_kept[k] = w[kept[k]];
+			}
+			// the intermediate stages only give starting weights
+			double stage_eps = stage < nr_stage ? SCREENING_STAGE_EPS*eps : eps;
+			if(param->solver_type == L1R_L2LOSS_SVC)
+				iter += solve_l1r_l2_svc(&sub_prob, w_kept, stage_eps, Cp*factor, Cn*factor, monitor);
+			else
+				iter += solve_l1r_lr(&sub_prob, w_kept, stage_eps, Cp*factor, Cn*factor, monitor);
+			for(k=0; k<kept_size; k++)
+				w[kept[k]] = w_kept[k];
+
+			// a feature wrongly screened in an intermediate stage is kept by
+			// the next one, its gradient being above the next threshold
+			if(monitor->reason != STOP_CONVERGED || screened_size == 0 || stage < nr_stage)
+				break;
+
+			// KKT check of the screened features, up to the largest violation
+			// that the solver left on the kept ones
+			l1r_loss_gradient(prob_col, param->solver_type, w, Cp*factor, Cn*factor, all, w_size, G, coef);
+			double tolerance = 0;
+			for(k=0; k<kept_size; k++)
+			{
+				j = kept[k];
+				if(w[j] > 0)
+					tolerance = max(tolerance, fabs(G[j]+1));
+				else if(w[j] < 0)
+					tolerance = max(tolerance, fabs(G[j]-1));
+				else
+					tolerance = max(tolerance, fabs(G[j])-1);
+			}
+			int new_screened_size = 0;
+			for(k=0; k<screened_size; k++)
+			{
+				j = screened[k];
+				if(fabs(G[j]) > 1+tolerance)
+					kept[kept_size++] = j;
+				else
+					screened[new_screened_size++] = j;
+			}
+			if(new_screened_size == screened_size)
+				break;
+			monitor->info("screening: %d features violate the KKT conditions\n", screened_size-new_screened_size);
+			screened_size = new_screened_size;
+		}
+
+		// an intermediate stage cut short by max_iter still gives starting
+		// weights, and the last stage is solved at the Cs asked for anyway
+		if(monitor->reason == STOP_MAX_ITER && stage < nr_stage)
+			monitor->reason = STOP_CONVERGED;
+		if(monitor->reason != STOP_CONVERGED)
+			break;
+		last_factor = factor;
+	}
+	if(monitor->reason == STOP_CONVERGED)
+		monitor->reason = reason;
+
+	delete [] all;
+	delete [] kept;
+	delete [] screened;
+	delete [] G;
+	delete [] coef;
+	delete [] w_kept;
+	delete [] x_kept;
+
+	return iter;
+}
+
+// transpose matrix X from row format to column format
+// (the columns are always stored as doubles)
+template <class Rows>
+static void transpose(const problem *prob, feature_node **x_space_ret, problem *prob_col)
+{
+	int i;
+	int l = prob->l;
+	int n = prob->n;
+	int nnz = 0;
+	int *col_ptr = new int[n+1];
+	feature_node *x_space;
+	Rows x(prob);
+	prob_col->l = l;
+	prob_col->n = n;
+	prob_col->storage = STORAGE_DOUBLE;
+	prob_col->W = prob->W;
+	prob_col->y = new int[l];
+	prob_col->x = new feature_node*[n];
+
+	for(i=0; i<l; i++)
+		prob_col->y[i] = prob->y[i];
+
+	for(i=0; i<n+1; i++)
+		col_ptr[i] = 0;
+	for(i=0; i<l; i++)
+		for(typename Rows::row xi = x[i]; xi.more(); xi.next())
+		{
+			nnz++;
+			col_ptr[xi.index()]++;
+		}
+	for(i=1; i<n+1; i++)
+		col_ptr[i] += col_ptr[i-1] + 1;
+
+	x_space = new feature_node[nnz+n];
+	for(i=0; i<n; i++)
+		prob_col->x[i] = &x_space[col_ptr[i]];
+
+	for(i=0; i<l; i++)
+		for(typename Rows::row xi = x[i]; xi.more(); xi.next())
+		{
+			int ind = xi.index()-1;
+			x_space[col_ptr[ind]].index = i+1; // starts from 1
+			x_space[col_ptr[ind]].value = xi.value();
+			col_ptr[ind]++;
+		}
+	for(i=0; i<n; i++)
+		x_space[col_ptr[i]].index = -1;
+
+	*x_space_ret = x_space;
+
+	delete [] col_ptr;
+}
+
+// label: label name, start: begin of each class, count: #data of classes, perm: indices to the original data
+// perm, length l, must be allocated before calling this subroutine
+static void group_classes(const problem *prob, int *nr_class_ret, int **label_ret, int **start_ret, int **count_ret, int *perm)
+{
+	int l = prob->l;
+	int max_nr_class = 16;
+	int nr_class = 0;
+	int *label = Malloc(int,max_nr_class);
+	int *count = Malloc(int,max_nr_class);
+	int *data_label = Malloc(int,l);
+	int i;
+
+	for(i=0;i<l;i++)
+	{
+		int this_label = prob->y[i];
+		int j;
+		for(j=0;j<nr_class;j++)
+		{
+			if(this_label == label[j])
+			{
+				++count[j];
+				break;
+			}
+		}
+		data_label[i] = j;
+		if(j == nr_class)
+		{
+			if(nr_class == max_nr_class)
+			{
+				max_nr_class *= 2;
+				label = (int *)realloc(label,max_nr_class*sizeof(int));
+				count = (int *)realloc(count,max_nr_class*sizeof(int));
+			}
+			label[nr_class] = this_label;
+			count[nr_class] = 1;
+			++nr_class;
+		}
+	}
+
+	int *start = Malloc(int,nr_class);
+	start[0] = 0;
+	for(i=1;i<nr_class;i++)
+		start[i] = start[i-1]+count[i-1];
+	for(i=0;i<l;i++)
+	{
+		perm[start[data_label[i]]] = i;
+		++start[data_label[i]];
+	}
+	start[0] = 0;
+	for(i=1;i<nr_class;i++)
+		start[i] = start[i-1]+count[i-1];
+
+	*nr_class_ret = nr_class;
+	*label_ret = label;
+	*start_ret = start;
+	*count_ret = count;
+	free(data_label);
+}
+
+static bool tron_stop_check(double *w, void *monitor)
+{
+	return ((solver_monitor *)monitor)->stop(w);
+}
+
+static void tron_print_string(const char *s, void *monitor)
+{
+	((solver_monitor *)monitor)->info("%s", s);
+}
+
+// rubylinear addition: adds to the statistics of the context, which the
+// trainings of a grid search share between threads
+static void add_stats(training_context *context, long nr_iter, long nr_cg_iter, double time)
+{
+	if(context == NULL)
+		return;
+	__atomic_fetch_add(&context->stats.nr_iter, nr_iter, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&context->stats.nr_cg_iter, nr_cg_iter, __ATOMIC_RELAXED);
+	shared_add(&context->stats.time, time);
+}
+
+// w holds the initial solution for the primal solvers: zero, or the
+// solution for a smaller C when training a regularization path.
+// prob_col is prob in column format and is only used by the L1 solvers.
+// monitor holds the iteration and time limits and the context of the
+// training, and records why the solver stopped. Returns the number of solver
+// iterations.
+static int train_one(const problem *prob, const problem *prob_col, const parameter *param, double *w, double Cp, double Cn, solver_monitor *monitor)
+{
+	double eps=param->eps;
+	int pos = 0;
+	int neg = 0;
+	int iter = 0;
+	if(monitor->cancelled())
+		return 0;
+	for(int i=0;i<prob->l;i++)
+		if(prob->y[i]==+1)
+			pos++;
+	neg = prob->l - pos;
+
+	function *fun_obj=NULL;
+	switch(param->solver_type)
+	{
+		case L2R_LR:
+		{
+			fun_obj=new l2r_lr_fun(prob, Cp, Cn, param->hessian_sample, &monitor->random);
+			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l, monitor->max_iter(1000));
+			tron_obj.set_print_string(monitor->context != NULL ? tron_print_string : NULL, monitor);
+			tron_obj.set_stop_check(tron_stop_check, monitor);
+			tron_obj.set_preconditioning(param->preconditioning != 0);
+			iter = tron_obj.tron(w);
+			add_stats(monitor->context, 0, tron_obj.get_cg_iter(), 0);
+			if(tron_obj.reached_max_iter())
+				monitor->reached_max_iter();
+			delete fun_obj;
+			break;
+		}
+		case L2R_L2LOSS_SVC:
+		{
+			fun_obj=new l2r_l2_svc_fun(prob, Cp, Cn, param->hessian_sample, &monitor->random);
+			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l, monitor->max_iter(1000));
+			tron_obj.set_print_string(monitor->context != NULL ? tron_print_string : NULL, monitor);
+			tron_obj.set_stop_check(tron_stop_check, monitor);
+			tron_obj.set_preconditioning(param->preconditioning != 0);
+			iter = tron_obj.tron(w);
+			add_stats(monitor->context, 0, tron_obj.get_cg_iter(), 0);
+			if(tron_obj.reached_max_iter())
+				monitor->reached_max_iter();
+			delete fun_obj;
+			break;
+		}
+		case L2R_L2LOSS_SVC_DUAL:
+			DISPATCH_ROWS(prob, iter = solve_l2r_l1l2_svc<Rows>(prob, w, NULL, eps, Cp, Cn, L2R_L2LOSS_SVC_DUAL, monitor));
+			break;
+		case L2R_L1LOSS_SVC_DUAL:
+			DISPATCH_ROWS(prob, iter = solve_l2r_l1l2_svc<Rows>(prob, w, NULL, eps, Cp, Cn, L2R_L1LOSS_SVC_DUAL, monitor));
+			break;
+		case L1R_L2LOSS_SVC:
+			if(param->screening && param->validation == NULL)
+				iter = solve_l1r_screened(prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn, monitor, param);
 			else
-				violation = fabs(Gn);
+				iter = solve_l1r_l2_svc(prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn, monitor);
+			break;
+		case L1R_LR:
+			if(param->screening && param->validation == NULL)
+				iter = solve_l1r_screened(prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn, monitor, param);
+			else
+				iter = solve_l1r_lr(prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn, monitor);
+			break;
+		case L2R_LR_DUAL:
+			DISPATCH_ROWS(prob, iter = solve_l2r_lr_dual<Rows>(prob, w, NULL, eps, Cp, Cn, monitor));
+			break;
+		default:
+			fprintf(stderr, "Error: unknown solver_type\n");
+			break;
+	}
+	return iter;
+}
 
-			Gmax_new = max(Gmax_new, violation);
-			Gnorm1_new += violation;
-		}
+// Everything train() derives from the problem before calling the solvers:
+// the classes, the data grouped by class and, for the L1 solvers, its
+// column format. It is built once and shared by all the models of a path
+// or a grid search; training only reads it, so it can be shared by threads.
+struct train_data
+{
+	int nr_class;
+	int *label;
+	int *start;
+	int *count;
+	int *perm;
+	problem sub_prob;	/* y is not used: each training sets its own labels */
+	problem prob_col;
+	feature_node *col_space;	/* NULL unless the solver needs prob_col */
+};
 
-		if(newton_iter == 0)
-			Gnorm1_init = Gnorm1_new;
+static bool needs_col_format(int solver_type)
+{
+	return solver_type == L1R_L2LOSS_SVC || solver_type == L1R_LR;
+}
 
-		if(Gnorm1_new <= eps*Gnorm1_init)
-			break;
+// rubylinear addition: a problem of l instances taken from prob (with
+// set_sub_instance), sharing its feature nodes. Free it with free_sub_problem
+static void alloc_sub_problem(const problem *prob, int l, problem *sub_prob)
+{
+	sub_prob->l = l;
+	sub_prob->n = prob->n;
+	sub_prob->bias = prob->bias;
+	sub_prob->offset = 0;
+	sub_prob->base = NULL;
+	sub_prob->base_float = NULL;
+	sub_prob->base_binary = NULL;
+	sub_prob->storage = prob->storage;
+	sub_prob->x = prob->x != NULL ? Malloc(feature_node *,l) : NULL;
+	sub_prob->x_float = prob->x_float != NULL ? Malloc(feature_node_float *,l) : NULL;
+	sub_prob->x_binary = prob->x_binary != NULL ? Malloc(int *,l) : NULL;
+	sub_prob->row_start = prob->row_start != NULL ? Malloc(long,l) : NULL;
+	sub_prob->row_end = prob->row_end != NULL ? Malloc(long,l) : NULL;
+	sub_prob->csr_index = prob->csr_index;
+	sub_prob->csr_value = prob->csr_value;
+	sub_prob->index_start = prob->index_start != NULL ? Malloc(long,l) : NULL;
+	sub_prob->packed_index = prob->packed_index;
+	sub_prob->packed_value = prob->packed_value;
+	sub_prob->y = Malloc(int,l);
+	sub_prob->W = prob->W != NULL ? Malloc(double,l) : NULL;
+}
 
-		iter = 0;
-		QP_Gmax_old = INF;
-		QP_active_size = active_size;
+// instance k of sub_prob is instance i of prob
+static inline void set_sub_instance(problem *sub_prob, int k, const problem *prob, int i)
+{
+	if(sub_prob->x != NULL)
+		sub_prob->x[k] = prob->x[i];
+	if(sub_prob->x_float != NULL)
+		sub_prob->x_float[k] = prob->x_float[i];
+	if(sub_prob->x_binary != NULL)
+		sub_prob->x_binary[k] = prob->x_binary[i];
+	if(sub_prob->row_start != NULL)
+	{
+		sub_prob->row_start[k] = prob->row_start[i];
+		sub_prob->row_end[k] = prob->row_end[i];
+	}
+	if(sub_prob->index_start != NULL)
+		sub_prob->index_start[k] = prob->index_start[i];
+	sub_prob->y[k] = prob->y[i];
+	if(sub_prob->W != NULL)
+		sub_prob->W[k] = prob->W[i];
+}
 
-		for(int i=0; i<l; i++)
-			xTd[i] = 0;
+static void free_sub_problem(problem *sub_prob)
+{
+	free(sub_prob->x);
+	free(sub_prob->x_float);
+	free(sub_prob->x_binary);
+	free(sub_prob->row_start);
+	free(sub_prob->row_end);
+	free(sub_prob->index_start);
+	free(sub_prob->y);
+	free(sub_prob->W);
+}
 
-		// optimize QP over wpd
-		while(iter < max_iter)
-		{
-			QP_Gmax_new = 0;
-			QP_Gnorm1_new = 0;
+static void prepare_train_data(const problem *prob, bool col_format, train_data *data)
+{
+	int i;
+	int l = prob->l;
 
-			for(j=0; j<QP_active_size; j++)
-			{
-				int i = j+rand()%(QP_active_size-j);
-				swap(index[i], index[j]);
-			}
+	data->perm = Malloc(int,l);
 
-			for(s=0; s<QP_active_size; s++)
-			{
-				j = index[s];
-				H = Hdiag[j];
+	// group training data of the same class
+	group_classes(prob,&data->nr_class,&data->label,&data->start,&data->count,data->perm);
 
-				x = prob_col->x[j];
-				G = Grad[j] + (wpd[j]-w[j])*nu;
-				while(x->index != -1)
-				{
-					int ind = x->index-1;
-					G += x->value*D[ind]*xTd[ind];
-					x++;
-				}
+	// constructing the subproblem
+	problem *sub_prob = &data->sub_prob;
+	alloc_sub_problem(prob, l, sub_prob);
+	for(i=0;i<l;i++)
+		set_sub_instance(sub_prob, i, prob, data->perm[i]);
 
-				double Gp = G+1;
-				double Gn = G-1;
-				double violation = 0;
-				if(wpd[j] == 0)
-				{
-					if(Gp < 0)
-						violation = -Gp;
-					else if(Gn > 0)
-						violation = Gn;
-					//inner-level shrinking
-					else if(Gp>QP_Gmax_old/l && Gn<-QP_Gmax_old/l)
-					{
-						QP_active_size--;
-						swap(index[s], index[QP_active_size]);
-						s--;
-						continue;
-					}
-				}
-				else if(wpd[j] > 0)
-					violation = fabs(Gp);
-				else
-					violation = fabs(Gn);
+	data->col_space = NULL;
+	if(col_format)
+		DISPATCH_ROWS(sub_prob, transpose<Rows>(sub_prob, &data->col_space, &data->prob_col));
+}
 
-				QP_Gmax_new = max(QP_Gmax_new, violation);
-				QP_Gnorm1_new += violation;
+static void destroy_train_data(train_data *data)
+{
+	if(data->col_space != NULL)
+	{
+		delete [] data->prob_col.y;
+		delete [] data->prob_col.x;
+		delete [] data->col_space;
+	}
+	free(data->label);
+	free(data->start);
+	free(data->count);
+	free(data->perm);
+	free_sub_problem(&data->sub_prob);
+}
 
-				// obtain solution of one-variable problem
-				if(Gp <= H*wpd[j])
-					z = -Gp/H;
-				else if(Gn >= H*wpd[j])
-					z = -Gn/H;
-				else
-					z = -wpd[j];
+// calculate weighted C
+static double *calc_weighted_C(const parameter *param, int nr_class, const int *label)
+{
+	int i,j;
+	double *weighted_C = Malloc(double, nr_class);
+	for(i=0;i<nr_class;i++)
+		weighted_C[i] = param->C;
+	for(i=0;i<param->nr_weight;i++)
+	{
+		for(j=0;j<nr_class;j++)
+			if(param->weight_label[i] == label[j])
+				break;
+		if(j == nr_class)
+			fprintf(stderr,"WARNING: class label %d specified in weight is not found\n", param->weight_label[i]);
+		else
+			weighted_C[j] *= param->weight[i];
+	}
+	return weighted_C;
+}
 
-				if(fabs(z) < 1.0e-12)
-					continue;
-				z = min(max(z,-10.0),10.0);
+// init is a model trained on the same data whose weights are used as the
+// starting point of the primal solvers, or NULL to start from zero
+static model* train_prepared(const parameter *param, const train_data *data, const model *init)
+{
+	int i,j;
+	int l = data->sub_prob.l;
+	int n = data->sub_prob.n;
+	int w_size = n;
+	int nr_class = data->nr_class;
+	int *label = data->label;
+	int *start = data->start;
+	int *count = data->count;
+	model *model_ = Malloc(model,1);
 
-				wpd[j] += z;
+	// the labels of the binary subproblems are private to this training
+	problem sub_prob_ = data->sub_prob;
+	problem *sub_prob = &sub_prob_;
+	sub_prob->y = Malloc(int,l);
+	problem prob_col_ = data->prob_col;
+	problem *prob_col = NULL;
+	if(data->col_space != NULL)
+	{
+		prob_col = &prob_col_;
+		prob_col->y = sub_prob->y;
+	}
 
-				x = prob_col->x[j];
-				while(x->index != -1)
-				{
-					int ind = x->index-1;
-					xTd[ind] += x->value*z;
-					x++;
-				}
-			}
+	if(sub_prob->bias>=0)
+		model_->nr_feature=n-1;
+	else
+		model_->nr_feature=n;
+	model_->param = *param;
+	model_->param.validation = NULL;
+	model_->param.context = NULL;
+	model_->bias = sub_prob->bias;
+	model_->nr_iter = 0;
+	model_->stop_reason = STOP_CONVERGED;
 
-			iter++;
+	// the time budget covers the training of all the classes
+	double start_time = wall_time();
+	double deadline = param->time_budget > 0 ? start_time + param->time_budget : INF;
 
-			if(QP_Gnorm1_new <= inner_eps*Gnorm1_init)
-			{
-				//inner stopping
-				if(QP_active_size == active_size)
-					break;
-				//active set reactivation
-				else
-				{
-					QP_active_size = active_size;
-					QP_Gmax_old = INF;
-					continue;
-				}
-			}
+	model_->nr_class=nr_class;
+	model_->label = Malloc(int,nr_class);
+	for(i=0;i<nr_class;i++)
+		model_->label[i] = label[i];
 
-			QP_Gmax_old = QP_Gmax_new;
-		}
+	double *weighted_C = calc_weighted_C(param, nr_class, label);
 
-		if(iter >= max_iter)
-			info("WARNING: reaching max number of inner iterations\n");
+	int k;
 
-		delta = 0;
-		w_norm_new = 0;
-		for(j=0; j<w_size; j++)
+	// multi-class svm by Crammer and Singer
+	if(param->solver_type == MCSVM_CS)
+	{
+		model_->w=Malloc(double, n*nr_class);
+		for(i=0;i<nr_class;i++)
+			for(j=start[i];j<start[i]+count[i];j++)
+				sub_prob->y[j] = i;
+		solver_monitor monitor(param, deadline, w_size, sub_prob->bias, nr_class, label);
+		Solver_MCSVM_CS Solver(sub_prob, nr_class, weighted_C, param->eps, &monitor);
+		model_->nr_iter = Solver.Solve(model_->w);
+		model_->stop_reason = monitor.reason;
+	}
+	else
+	{
+		if(nr_class == 2)
 		{
-			delta += Grad[j]*(wpd[j]-w[j]);
-			if(wpd[j] != 0)
-				w_norm_new += fabs(wpd[j]);
-		}
-		delta += (w_norm_new-w_norm);
+			model_->w=Malloc(double, w_size);
+			for(j=0;j<w_size;j++)
+				model_->w[j] = init ? init->w[j] : 0;
 
-		negsum_xTd = 0;
-		for(int i=0; i<l; i++)
-			if(y[i] == -1)
-				negsum_xTd += C[GETI(i)]*xTd[i];
+			int e0 = start[0]+count[0];
+			k=0;
+			for(; k<e0; k++)
+				sub_prob->y[k] = +1;
+			for(; k<sub_prob->l; k++)
+				sub_prob->y[k] = -1;
 
-		int num_linesearch;
-		for(num_linesearch=0; num_linesearch < max_num_linesearch; num_linesearch++)
+			solver_monitor monitor(param, deadline, w_size, sub_prob->bias, 1, &label[0]);
+			model_->nr_iter = train_one(sub_prob, prob_col, param, &model_->w[0], weighted_C[0], weighted_C[1], &monitor);
+			model_->stop_reason = monitor.reason;
+		}
+		else
 		{
-			cond = w_norm_new - w_norm + negsum_xTd - sigma*delta;
-
-			for(int i=0; i<l; i++)
+			model_->w=Malloc(double, w_size*nr_class);
+			double *w=Malloc(double, w_size);
+			for(i=0;i<nr_class;i++)
 			{
-				double exp_xTd = exp(xTd[i]);
-				exp_wTx_new[i] = exp_wTx[i]*exp_xTd;
-				cond += C[GETI(i)]*log((1+exp_wTx_new[i])/(exp_xTd+exp_wTx_new[i]));
-			}
+				int si = start[i];
+				int ei = si+count[i];
 
-			if(cond <= 0)
-			{
-				w_norm = w_norm_new;
-				for(j=0; j<w_size; j++)
-					w[j] = wpd[j];
-				for(int i=0; i<l; i++)
-				{
-					exp_wTx[i] = exp_wTx_new[i];
-					double tau_tmp = 1/(1+exp_wTx[i]);
-					tau[i] = C[GETI(i)]*tau_tmp;
-					D[i] = C[GETI(i)]*exp_wTx[i]*tau_tmp*tau_tmp;
-				}
-				break;
-			}
-			else
-			{
-				w_norm_new = 0;
-				for(j=0; j<w_size; j++)
-				{
-					wpd[j] = (w[j]+wpd[j])*0.5;
-					if(wpd[j] != 0)
-						w_norm_new += fabs(wpd[j]);
-				}
-				delta *= 0.5;
-				negsum_xTd *= 0.5;
-				for(int i=0; i<l; i++)
-					xTd[i] *= 0.5;
+				k=0;
+				for(; k<si; k++)
+					sub_prob->y[k] = -1;
+				for(; k<ei; k++)
+					sub_prob->y[k] = +1;
+				for(; k<sub_prob->l; k++)
+					sub_prob->y[k] = -1;
+
+				for(j=0;j<w_size;j++)
+					w[j] = init ? init->w[j*nr_class+i] : 0;
+
+				solver_monitor monitor(param, deadline, w_size, sub_prob->bias, 1, &label[i]);
+				model_->nr_iter += train_one(sub_prob, prob_col, param, w, weighted_C[i], param->C, &monitor);
+				// the first class that did not converge gives the reason for the model
+				if(model_->stop_reason == STOP_CONVERGED)
+					model_->stop_reason = monitor.reason;
+
+				for(j=0;j<w_size;j++)
+					model_->w[j*nr_class+i] = w[j];
 			}
+			free(w);
 		}
 
-		// Recompute some info due to too many line search steps
-		if(num_linesearch >= max_num_linesearch)
-		{
-			for(int i=0; i<l; i++)
-				exp_wTx[i] = 0;
+	}
 
-			for(int i=0; i<w_size; i++)
-			{
-				if(w[i]==0) continue;
-				x = prob_col->x[i];
-				while(x->index != -1)
-				{
-					exp_wTx[x->index-1] += w[i]*x->value;
-					x++;
-				}
-			}
+	free(sub_prob->y);
+	free(weighted_C);
+	add_stats(param->context, model_->nr_iter, 0, wall_time()-start_time);
+	return model_;
+}
+
+//
+// Interface functions
+//
+model* train(const problem *prob, const parameter *param)
+{
+	train_data data;
+	prepare_train_data(prob, needs_col_format(param->solver_type), &data);
+	model *model_ = train_prepared(param, &data, NULL);
+	destroy_train_data(&data);
+	return model_;
+}
+
+static int compare_double_ascending(const void *a, const void *b)
+{
+	if(*(double *)a < *(double *)b)
+		return -1;
+	if(*(double *)a > *(double *)b)
+		return 1;
+	return 0;
+}
+
+// Trains one model per value of C, from the smallest to the largest. The
+// grouping of classes and the transpose are done once, and the primal
+// solvers start from the solution for the previous C. The returned array
+// (free it with free()) holds the models in increasing order of C.
+model** train_path(const problem *prob, const parameter *param, int nr_C, const double *C)
+{
+	int i;
+	double *C_sorted = Malloc(double, nr_C);
+	memcpy(C_sorted, C, sizeof(double)*nr_C);
+	qsort(C_sorted, nr_C, sizeof(double), compare_double_ascending);
+
+	model **models = Malloc(model *, nr_C);
+	train_data data;
+	prepare_train_data(prob, needs_col_format(param->solver_type), &data);
+
+	parameter path_param = *param;
+	for(i=0;i<nr_C;i++)
+	{
+		path_param.C = C_sorted[i];
+		models[i] = train_prepared(&path_param, &data, i > 0 ? models[i-1] : NULL);
+	}
+
+	destroy_train_data(&data);
+	free(C_sorted);
+	return models;
+}
+
+// rubylinear addition: predict_values for a row of any storage
+template <class Row>
+static int predict_values_row(const model *model_, Row x, double *dec_values)
+{
+	int idx;
+	int n;
+	if(model_->bias>=0)
+		n=model_->nr_feature+1;
+	else
+		n=model_->nr_feature;
+	double *w=model_->w;
+	int nr_class=model_->nr_class;
+	int i;
+	int nr_w;
+	if(nr_class==2 && model_->param.solver_type != MCSVM_CS)
+		nr_w = 1;
+	else
+		nr_w = nr_class;
 
-			for(int i=0; i<l; i++)
-				exp_wTx[i] = exp(exp_wTx[i]);
+	for(i=0;i<nr_w;i++)
+		dec_values[i] = 0;
+	for(; x.more(); x.next())
+	{
+		idx = x.index();
+		// the dimension of testing data may exceed that of training
+		if(idx<=n)
+		{
+			double value = x.value();
+			for(i=0;i<nr_w;i++)
+				dec_values[i] += w[(idx-1)*nr_w+i]*value;
 		}
-
-		if(iter == 1)
-			inner_eps *= 0.25;
-
-		newton_iter++;
-		Gmax_old = Gmax_new;
-
-		info("iter %3d  #CD cycles %d\n", newton_iter, iter);
 	}
 
-	info("=========================\n");
-	info("optimization finished, #iter = %d\n", newton_iter);
-	if(newton_iter >= max_newton_iter)
-		info("WARNING: reaching max number of iterations\n");
-
-	// calculate objective value
-	
-	double v = 0;
-	int nnz = 0;
-	for(j=0; j<w_size; j++)
-		if(w[j] != 0)
+	if(nr_class==2)
+		return (dec_values[0]>0)?model_->label[0]:model_->label[1];
+	else
+	{
+		int dec_max_idx = 0;
+		for(i=1;i<nr_class;i++)
 		{
-			v += fabs(w[j]);
-			nnz++;
+			if(dec_values[i] > dec_values[dec_max_idx])
+				dec_max_idx = i;
 		}
-	for(j=0; j<l; j++)
-		if(y[j] == 1)
-			v += C[GETI(j)]*log(1+1/exp_wTx[j]);
-		else
-			v += C[GETI(j)]*log(1+exp_wTx[j]);
-
-	info("Objective value = %lf\n", v);
-	info("#nonzeros/#features = %d/%d\n", nnz, w_size);
+		return model_->label[dec_max_idx];
+	}
+}
 
-	delete [] index;
-	delete [] y;
-	delete [] Hdiag;
-	delete [] Grad;
-	delete [] wpd;
-	delete [] xjneg_sum;
-	delete [] xTd;
-	delete [] exp_wTx;
-	delete [] exp_wTx_new;
-	delete [] tau;
-	delete [] D;
+// predict() for instance i of prob
+static int predict_instance(const model *model_, const problem *prob, int i)
+{
+	double *dec_values = Malloc(double, model_->nr_class);
+	int label = 0;
+	DISPATCH_ROWS(prob, label = predict_values_row(model_, Rows(prob)[i], dec_values));
+	free(dec_values);
+	return label;
 }
 
-// transpose matrix X from row format to column format
-static void transpose(const problem *prob, feature_node **x_space_ret, problem *prob_col)
+void cross_validation(const problem *prob, const parameter *param, int nr_fold, int *target)
 {
 	int i;
+	int *fold_start = Malloc(int,nr_fold+1);
 	int l = prob->l;
-	int n = prob->n;
-	int nnz = 0;
-	int *col_ptr = new int[n+1];
-	feature_node *x_space;
-	prob_col->l = l;
-	prob_col->n = n;
-	prob_col->y = new int[l];
-	prob_col->x = new feature_node*[n];
-
-	for(i=0; i<l; i++)
-		prob_col->y[i] = prob->y[i];
+	int *perm = Malloc(int,l);
+	random_generator random(param->seed);
 
-	for(i=0; i<n+1; i++)
-		col_ptr[i] = 0;
-	for(i=0; i<l; i++)
+	for(i=0;i<l;i++) perm[i]=i;
+	for(i=0;i<l;i++)
 	{
-		feature_node *x = prob->x[i];
-		while(x->index != -1)
-		{
-			nnz++;
-			col_ptr[x->index]++;
-			x++;
-		}
+		int j = i+random.uniform(l-i);
+		swap(perm[i],perm[j]);
 	}
-	for(i=1; i<n+1; i++)
-		col_ptr[i] += col_ptr[i-1] + 1;
-
-	x_space = new feature_node[nnz+n];
-	for(i=0; i<n; i++)
-		prob_col->x[i] = &x_space[col_ptr[i]];
+	for(i=0;i<=nr_fold;i++)
+		fold_start[i]=i*l/nr_fold;
 
-	for(i=0; i<l; i++)
+	for(i=0;i<nr_fold;i++)
 	{
-		feature_node *x = prob->x[i];
-		while(x->index != -1)
-		{
-			int ind = x->index-1;
-			x_space[col_ptr[ind]].index = i+1; // starts from 1
-			x_space[col_ptr[ind]].value = x->value;
-			col_ptr[ind]++;
-			x++;
-		}
+		int begin = fold_start[i];
+		int end = fold_start[i+1];
+		int j,k;
+		struct problem subprob;
+
+		alloc_sub_problem(prob, l-(end-begin), &subprob);
+
+		k=0;
+		for(j=0;j<begin;j++)
+			set_sub_instance(&subprob, k++, prob, perm[j]);
+		for(j=end;j<l;j++)
+			set_sub_instance(&subprob, k++, prob, perm[j]);
+		struct model *submodel = train(&subprob,param);
+		for(j=begin;j<end;j++)
+			target[perm[j]] = predict_instance(submodel,prob,perm[j]);
+		free_and_destroy_model(&submodel);
+		free_sub_problem(&subprob);
 	}
-	for(i=0; i<n; i++)
-		x_space[col_ptr[i]].index = -1;
+	free(fold_start);
+	free(perm);
+}
 
-	*x_space_ret = x_space;
+// rubylinear addition: cross validation of several parameter sets at once.
+// All the parameter sets use the same folds, and the training data of each
+// fold is grouped by class (and transposed, if any set uses an L1 solver)
+// only once. The nr_param*nr_fold trainings are then shared out between
+// nr_thread threads. The predictions for params[p] are put in target[p*l].
 
-	delete [] col_ptr;
+struct grid_search_state
+{
+	const problem *prob;
+	const parameter *params;
+	int nr_fold;
+	int *fold_start;
+	int *perm;
+	train_data *fold_data;
+	int *target;
+	int nr_task;
+	int next_task;
+	pthread_mutex_t lock;
+};
+
+static void *grid_search_worker(void *arg)
+{
+	grid_search_state *state = (grid_search_state *)arg;
+	const problem *prob = state->prob;
+	int l = prob->l;
+
+	while(1)
+	{
+		pthread_mutex_lock(&state->lock);
+		int task = state->next_task++;
+		pthread_mutex_unlock(&state->lock);
+		if(task >= state->nr_task)
+			break;
+
+		int p = task/state->nr_fold;
+		int f = task%state->nr_fold;
+		model *submodel = train_prepared(&state->params[p], &state->fold_data[f], NULL);
+		for(int j=state->fold_start[f];j<state->fold_start[f+1];j++)
+			state->target[(size_t)p*l+state->perm[j]] = predict_instance(submodel,prob,state->perm[j]);
+		free_and_destroy_model(&submodel);
+	}
+	return NULL;
 }
 
-// label: label name, start: begin of each class, count: #data of classes, perm: indices to the original data
-// perm, length l, must be allocated before calling this subroutine
-static void group_classes(const problem *prob, int *nr_class_ret, int **label_ret, int **start_ret, int **count_ret, int *perm)
+void cross_validation_grid(const problem *prob, int nr_param, const parameter *params, int nr_fold, int nr_thread, int *target)
 {
+	int i,j,k;
 	int l = prob->l;
-	int max_nr_class = 16;
-	int nr_class = 0;
-	int *label = Malloc(int,max_nr_class);
-	int *count = Malloc(int,max_nr_class);
-	int *data_label = Malloc(int,l);
-	int i;
+	int *fold_start = Malloc(int,nr_fold+1);
+	int *perm = Malloc(int,l);
+	bool col_format = false;
 
+	for(i=0;i<nr_param;i++)
+		if(needs_col_format(params[i].solver_type))
+			col_format = true;
+
+	// the folds are shuffled with the seed of the first parameter set
+	random_generator random(params[0].seed);
+	for(i=0;i<l;i++) perm[i]=i;
 	for(i=0;i<l;i++)
 	{
-		int this_label = prob->y[i];
-		int j;
-		for(j=0;j<nr_class;j++)
-		{
-			if(this_label == label[j])
-			{
-				++count[j];
-				break;
-			}
-		}
-		data_label[i] = j;
-		if(j == nr_class)
-		{
-			if(nr_class == max_nr_class)
-			{
-				max_nr_class *= 2;
-				label = (int *)realloc(label,max_nr_class*sizeof(int));
-				count = (int *)realloc(count,max_nr_class*sizeof(int));
-			}
-			label[nr_class] = this_label;
-			count[nr_class] = 1;
-			++nr_class;
-		}
+		int j = i+random.uniform(l-i);
+		swap(perm[i],perm[j]);
 	}
+	for(i=0;i<=nr_fold;i++)
+		fold_start[i]=i*l/nr_fold;
 
-	int *start = Malloc(int,nr_class);
-	start[0] = 0;
-	for(i=1;i<nr_class;i++)
-		start[i] = start[i-1]+count[i-1];
-	for(i=0;i<l;i++)
+	train_data *fold_data = Malloc(train_data,nr_fold);
+	for(i=0;i<nr_fold;i++)
 	{
-		perm[start[data_label[i]]] = i;
-		++start[data_label[i]];
+		int begin = fold_start[i];
+		int end = fold_start[i+1];
+		struct problem subprob;
+
+		alloc_sub_problem(prob, l-(end-begin), &subprob);
+
+		k=0;
+		for(j=0;j<begin;j++)
+			set_sub_instance(&subprob, k++, prob, perm[j]);
+		for(j=end;j<l;j++)
+			set_sub_instance(&subprob, k++, prob, perm[j]);
+		prepare_train_data(&subprob, col_format, &fold_data[i]);
+		free_sub_problem(&subprob);
 	}
-	start[0] = 0;
-	for(i=1;i<nr_class;i++)
-		start[i] = start[i-1]+count[i-1];
 
-	*nr_class_ret = nr_class;
-	*label_ret = label;
-	*start_ret = start;
-	*count_ret = count;
-	free(data_label);
+	grid_search_state state;
+	state.prob = prob;
+	state.params = params;
+	state.nr_fold = nr_fold;
+	state.fold_start = fold_start;
+	state.perm = perm;
+	state.fold_data = fold_data;
+	state.target = target;
+	state.nr_task = nr_param*nr_fold;
+	state.next_task = 0;
+	pthread_mutex_init(&state.lock, NULL);
+
+	nr_thread = max(1, min(nr_thread, state.nr_task));
+	pthread_t *threads = Malloc(pthread_t,nr_thread-1);
+	int nr_started = 0;
+	for(i=0;i<nr_thread-1;i++)
+		if(pthread_create(&threads[nr_started], NULL, grid_search_worker, &state) == 0)
+			nr_started++;
+	grid_search_worker(&state);
+	for(i=0;i<nr_started;i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&state.lock);
+
+	for(i=0;i<nr_fold;i++)
+		destroy_train_data(&fold_data[i]);
+	free(fold_data);
+	free(fold_start);
+	free(perm);
 }
 
-static void train_one(const problem *prob, const parameter *param, double *w, double Cp, double Cn)
+// rubylinear addition: out of core training by block minimization (Yu et
+// al., KDD 2010). The instances are split into blocks saved on disk by
+// save_block. Each outer iteration goes through the blocks in turn, loading
+// the next block on another thread while the dual coordinate descent solver
+// works on the dual variables of the current one. Only w, alpha and the
+// labels are kept in memory.
+//
+// A block file holds a block_header, the labels, the instance weights (if
+// any) and the feature_nodes of the instances (each terminated by index -1),
+// so only problems of STORAGE_DOUBLE can be saved as blocks.
+// When the problem has a bias the last node of each instance is the bias,
+// whose index is only known once all the blocks are written, so load_block
+// sets it. The files are compressed with zlib when it is available and are
+// not portable between architectures.
+
+#define BLOCK_MAGIC 0x4b4c4252
+#define BLOCK_INNER_ITER 5
+
+struct block_header
 {
-	double eps=param->eps;
-	int pos = 0;
-	int neg = 0;
-	for(int i=0;i<prob->l;i++)
-		if(prob->y[i]==+1)
-			pos++;
-	neg = prob->l - pos;
+	int magic;
+	int l;
+	int nr_node;
+	int max_index;
+	int has_W;
+	double bias;
+};
 
-	function *fun_obj=NULL;
-	switch(param->solver_type)
+#ifdef HAVE_ZLIB_H
+typedef gzFile block_file;
+
+static block_file open_block_file(const char *file_name, bool write)
+{
+	return gzopen(file_name, write ? "wb1" : "rb");
+}
+
+static int close_block_file(block_file fp)
+{
+	return gzclose(fp) == Z_OK ? 0 : -1;
+}
+
+static bool write_block_data(block_file fp, const void *data, size_t size)
+{
+	// gzwrite takes an unsigned int, so large blocks are written in chunks
+	const char *p = (const char *)data;
+	while(size > 0)
 	{
-		case L2R_LR:
-		{
-			fun_obj=new l2r_lr_fun(prob, Cp, Cn);
-			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l);
-			tron_obj.set_print_string(liblinear_print_string);
-			tron_obj.tron(w);
-			delete fun_obj;
-			break;
-		}
-		case L2R_L2LOSS_SVC:
-		{
-			fun_obj=new l2r_l2_svc_fun(prob, Cp, Cn);
-			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l);
-			tron_obj.set_print_string(liblinear_print_string);
-			tron_obj.tron(w);
-			delete fun_obj;
-			break;
-		}
-		case L2R_L2LOSS_SVC_DUAL:
-			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L2LOSS_SVC_DUAL);
-			break;
-		case L2R_L1LOSS_SVC_DUAL:
-			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L1LOSS_SVC_DUAL);
-			break;
-		case L1R_L2LOSS_SVC:
-		{
-			problem prob_col;
-			feature_node *x_space = NULL;
-			transpose(prob, &x_space ,&prob_col);
-			solve_l1r_l2_svc(&prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn);
-			delete [] prob_col.y;
-			delete [] prob_col.x;
-			delete [] x_space;
-			break;
-		}
-		case L1R_LR:
-		{
-			problem prob_col;
-			feature_node *x_space = NULL;
-			transpose(prob, &x_space ,&prob_col);
-			solve_l1r_lr(&prob_col, w, eps*min(pos,neg)/prob->l, Cp, Cn);
-			delete [] prob_col.y;
-			delete [] prob_col.x;
-			delete [] x_space;
-			break;
-		}
-		case L2R_LR_DUAL:
-			solve_l2r_lr_dual(prob, w, eps, Cp, Cn);
-			break;
-		default:
-			fprintf(stderr, "Error: unknown solver_type\n");
-			break;
+		unsigned chunk = (unsigned)min(size, (size_t)(1<<30));
+		if(gzwrite(fp, p, chunk) != (int)chunk)
+			return false;
+		p += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+static bool read_block_data(block_file fp, void *data, size_t size)
+{
+	char *p = (char *)data;
+	while(size > 0)
+	{
+		unsigned chunk = (unsigned)min(size, (size_t)(1<<30));
+		if(gzread(fp, p, chunk) != (int)chunk)
+			return false;
+		p += chunk;
+		size -= chunk;
 	}
+	return true;
 }
+#else
+typedef FILE *block_file;
 
-//
-// Interface functions
-//
-model* train(const problem *prob, const parameter *param)
+static block_file open_block_file(const char *file_name, bool write)
 {
-	int i,j;
-	int l = prob->l;
-	int n = prob->n;
-	int w_size = prob->n;
-	model *model_ = Malloc(model,1);
-
-	if(prob->bias>=0)
-		model_->nr_feature=n-1;
-	else
-		model_->nr_feature=n;
-	model_->param = *param;
-	model_->bias = prob->bias;
+	return fopen(file_name, write ? "wb" : "rb");
+}
 
-	int nr_class;
-	int *label = NULL;
-	int *start = NULL;
-	int *count = NULL;
-	int *perm = Malloc(int,l);
+static int close_block_file(block_file fp)
+{
+	return fclose(fp) == 0 ? 0 : -1;
+}
 
-	// group training data of the same class
-	group_classes(prob,&nr_class,&label,&start,&count,perm);
+static bool write_block_data(block_file fp, const void *data, size_t size)
+{
+	return size == 0 || fwrite(data, size, 1, fp) == 1;
+}
 
-	model_->nr_class=nr_class;
-	model_->label = Malloc(int,nr_class);
-	for(i=0;i<nr_class;i++)
-		model_->label[i] = label[i];
+static bool read_block_data(block_file fp, void *data, size_t size)
+{
+	return size == 0 || fread(data, size, 1, fp) == 1;
+}
+#endif
 
-	// calculate weighted C
-	double *weighted_C = Malloc(double, nr_class);
-	for(i=0;i<nr_class;i++)
-		weighted_C[i] = param->C;
-	for(i=0;i<param->nr_weight;i++)
+int save_block(const char *block_file_name, const problem *block)
+{
+	int i;
+	block_header header;
+	if(block->storage != STORAGE_DOUBLE)
+		return -1;
+	header.magic = BLOCK_MAGIC;
+	header.l = block->l;
+	header.nr_node = 0;
+	header.max_index = 0;
+	header.has_W = block->W != NULL;
+	header.bias = block->bias;
+	for(i=0;i<block->l;i++)
 	{
-		for(j=0;j<nr_class;j++)
-			if(param->weight_label[i] == label[j])
-				break;
-		if(j == nr_class)
-			fprintf(stderr,"WARNING: class label %d specified in weight is not found\n", param->weight_label[i]);
-		else
-			weighted_C[j] *= param->weight[i];
+		const feature_node *x = block->x[i];
+		for(; x->index != -1; x++)
+		{
+			header.nr_node++;
+			// the bias node does not count towards the number of features
+			if((x+1)->index != -1 || block->bias < 0)
+				header.max_index = max(header.max_index, x->index);
+		}
+		header.nr_node++;
 	}
 
-	// constructing the subproblem
-	feature_node **x = Malloc(feature_node *,l);
-	for(i=0;i<l;i++)
-		x[i] = prob->x[perm[i]];
+	block_file fp = open_block_file(block_file_name, true);
+	if(fp == NULL)
+		return -1;
+	bool ok = write_block_data(fp, &header, sizeof(header))
+		&& write_block_data(fp, block->y, sizeof(int)*block->l)
+		&& (block->W == NULL || write_block_data(fp, block->W, sizeof(double)*block->l));
+	for(i=0;ok && i<block->l;i++)
+	{
+		const feature_node *x = block->x[i];
+		int len = 1;
+		while(x[len-1].index != -1)
+			len++;
+		ok = write_block_data(fp, x, sizeof(feature_node)*len);
+	}
+	if(close_block_file(fp) != 0)
+		ok = false;
+	return ok ? 0 : -1;
+}
 
-	int k;
-	problem sub_prob;
-	sub_prob.l = l;
-	sub_prob.n = n;
-	sub_prob.x = Malloc(feature_node *,sub_prob.l);
-	sub_prob.y = Malloc(int,sub_prob.l);
+static bool read_block_header(block_file fp, block_header *header)
+{
+	return read_block_data(fp, header, sizeof(block_header))
+		&& header->magic == BLOCK_MAGIC && header->l >= 0 && header->nr_node >= header->l;
+}
 
-	for(k=0; k<sub_prob.l; k++)
-		sub_prob.x[k] = x[k];
+// n is the number of features of the whole problem (including the bias)
+problem *load_block(const char *block_file_name, int n)
+{
+	int i,j;
+	block_header header;
+	block_file fp = open_block_file(block_file_name, false);
+	if(fp == NULL)
+		return NULL;
+	if(!read_block_header(fp, &header))
+	{
+		close_block_file(fp);
+		return NULL;
+	}
 
-	// multi-class svm by Crammer and Singer
-	if(param->solver_type == MCSVM_CS)
+	problem *block = Malloc(problem,1);
+	block->l = header.l;
+	block->n = n;
+	block->bias = header.bias;
+	block->offset = 0;
+	block->storage = STORAGE_DOUBLE;
+	block->x_float = NULL;
+	block->base_float = NULL;
+	block->x_binary = NULL;
+	block->base_binary = NULL;
+	block->row_start = NULL;
+	block->row_end = NULL;
+	block->csr_index = NULL;
+	block->csr_value = NULL;
+	block->packed_index = NULL;
+	block->packed_value = NULL;
+	block->index_start = NULL;
+	block->y = Malloc(int,header.l);
+	block->W = header.has_W ? Malloc(double,header.l) : NULL;
+	block->x = Malloc(feature_node *,header.l);
+	block->base = Malloc(feature_node,header.nr_node);
+	bool ok = read_block_data(fp, block->y, sizeof(int)*header.l)
+		&& (!header.has_W || read_block_data(fp, block->W, sizeof(double)*header.l))
+		&& read_block_data(fp, block->base, sizeof(feature_node)*header.nr_node);
+	close_block_file(fp);
+
+	for(i=0,j=0;ok && i<header.l;i++)
 	{
-		model_->w=Malloc(double, n*nr_class);
-		for(i=0;i<nr_class;i++)
-			for(j=start[i];j<start[i]+count[i];j++)
-				sub_prob.y[j] = i;
-		Solver_MCSVM_CS Solver(&sub_prob, nr_class, weighted_C, param->eps);
-		Solver.Solve(model_->w);
+		block->x[i] = &block->base[j];
+		while(j < header.nr_node && block->base[j].index != -1)
+			j++;
+		if(j == header.nr_node || (block->bias >= 0 && &block->base[j] == block->x[i]))
+			ok = false;
+		else if(block->bias >= 0)
+			block->base[j-1].index = n;
+		j++;
 	}
-	else
+	if(!ok)
 	{
-		if(nr_class == 2)
-		{
-			model_->w=Malloc(double, w_size);
+		free_block(block);
+		return NULL;
+	}
+	return block;
+}
 
-			int e0 = start[0]+count[0];
-			k=0;
-			for(; k<e0; k++)
-				sub_prob.y[k] = +1;
-			for(; k<sub_prob.l; k++)
-				sub_prob.y[k] = -1;
+void free_block(problem *block)
+{
+	if(block == NULL)
+		return;
+	free(block->y);
+	free(block->W);
+	free(block->x);
+	free(block->base);
+	free(block);
+}
 
-			train_one(&sub_prob, param, &model_->w[0], weighted_C[0], weighted_C[1]);
+block_problem *open_block_problem(int nr_block, const char * const *block_file_name)
+{
+	int i;
+	if(nr_block < 1)
+		return NULL;
+	block_problem *prob = Malloc(block_problem,1);
+	prob->l = 0;
+	prob->n = 0;
+	prob->bias = -1;
+	prob->nr_block = nr_block;
+	prob->block_file = Malloc(char *,nr_block);
+	prob->block_start = Malloc(int,nr_block+1);
+	prob->y = NULL;
+
+	// only the headers and the labels are read
+	bool ok = true;
+	for(i=0;i<nr_block;i++)
+	{
+		prob->block_file[i] = strdup(block_file_name[i]);
+		prob->block_start[i] = prob->l;
+		block_header header;
+		block_file fp = ok ? open_block_file(block_file_name[i], false) : NULL;
+		if(fp == NULL)
+		{
+			ok = false;
+			continue;
 		}
-		else
+		if(read_block_header(fp, &header) && (i == 0 || header.bias == prob->bias))
 		{
-			model_->w=Malloc(double, w_size*nr_class);
-			double *w=Malloc(double, w_size);
-			for(i=0;i<nr_class;i++)
-			{
-				int si = start[i];
-				int ei = si+count[i];
+			prob->bias = header.bias;
+			prob->y = (int *)realloc(prob->y, sizeof(int)*(prob->l+header.l));
+			ok = read_block_data(fp, prob->y+prob->l, sizeof(int)*header.l);
+			prob->l += header.l;
+			prob->n = max(prob->n, header.max_index);
+		}
+		else
+			ok = false;
+		close_block_file(fp);
+	}
+	prob->block_start[nr_block] = prob->l;
+	if(prob->bias >= 0)
+		prob->n++;
 
-				k=0;
-				for(; k<si; k++)
-					sub_prob.y[k] = -1;
-				for(; k<ei; k++)
-					sub_prob.y[k] = +1;
-				for(; k<sub_prob.l; k++)
-					sub_prob.y[k] = -1;
+	if(!ok || prob->l == 0)
+	{
+		free_block_problem(prob);
+		return NULL;
+	}
+	return prob;
+}
 
-				train_one(&sub_prob, param, w, weighted_C[i], param->C);
+void free_block_problem(block_problem *prob)
+{
+	int i;
+	for(i=0;i<prob->nr_block;i++)
+		free(prob->block_file[i]);
+	free(prob->block_file);
+	free(prob->block_start);
+	free(prob->y);
+	free(prob);
+}
 
-				for(int j=0;j<w_size;j++)
-					model_->w[j*nr_class+i] = w[j];
-			}
-			free(w);
-		}
+struct block_prefetch
+{
+	const char *file_name;
+	int n;
+	problem *block;
+	pthread_t thread;
+	bool running;
+};
 
-	}
+static void *prefetch_block_worker(void *arg)
+{
+	block_prefetch *prefetch = (block_prefetch *)arg;
+	prefetch->block = load_block(prefetch->file_name, prefetch->n);
+	return NULL;
+}
 
-	free(x);
-	free(label);
-	free(start);
-	free(count);
-	free(perm);
-	free(sub_prob.x);
-	free(sub_prob.y);
-	free(weighted_C);
-	return model_;
+static void start_prefetch(block_prefetch *prefetch, const char *file_name, int n)
+{
+	prefetch->file_name = file_name;
+	prefetch->n = n;
+	prefetch->block = NULL;
+	prefetch->running = pthread_create(&prefetch->thread, NULL, prefetch_block_worker, prefetch) == 0;
+	if(!prefetch->running)
+		prefetch_block_worker(prefetch);
 }
 
-void cross_validation(const problem *prob, const parameter *param, int nr_fold, int *target)
+static problem *finish_prefetch(block_prefetch *prefetch)
 {
-	int i;
-	int *fold_start = Malloc(int,nr_fold+1);
+	if(prefetch->running)
+		pthread_join(prefetch->thread, NULL);
+	prefetch->running = false;
+	return prefetch->block;
+}
+
+// All the one-vs-rest problems are solved together so that each block is
+// read once per outer iteration. Each visit of a block runs at most
+// BLOCK_INNER_ITER passes of the solver over it; the training has converged
+// when every block already met the stopping condition on its first pass.
+// Returns NULL if a block cannot be read.
+model* train_blocks(const block_problem *prob, const parameter *param)
+{
+	int i,j,k,b;
 	int l = prob->l;
+	int w_size = prob->n;
+	int nr_block = prob->nr_block;
+	int nr_class;
+	int *label = NULL;
+	int *start = NULL;
+	int *count = NULL;
 	int *perm = Malloc(int,l);
 
-	for(i=0;i<l;i++) perm[i]=i;
-	for(i=0;i<l;i++)
-	{
-		int j = i+rand()%(l-i);
-		swap(perm[i],perm[j]);
-	}
-	for(i=0;i<=nr_fold;i++)
-		fold_start[i]=i*l/nr_fold;
+	problem labels;
+	labels.l = l;
+	labels.y = prob->y;
+	group_classes(&labels,&nr_class,&label,&start,&count,perm);
+	free(perm);
+	free(start);
+	free(count);
+	int nr_w = nr_class == 2 ? 1 : nr_class;
 
-	for(i=0;i<nr_fold;i++)
+	model *model_ = Malloc(model,1);
+	model_->nr_feature = prob->bias >= 0 ? w_size-1 : w_size;
+	model_->param = *param;
+	model_->param.validation = NULL;
+	model_->param.context = NULL;
+	model_->bias = prob->bias;
+	model_->nr_class = nr_class;
+	model_->label = label;
+	model_->nr_iter = 0;
+	model_->stop_reason = STOP_CONVERGED;
+
+	double *weighted_C = calc_weighted_C(param, nr_class, label);
+	double *w = Malloc(double, (size_t)w_size*nr_w);
+	for(j=0;j<w_size*nr_w;j++)
+		w[j] = 0;
+	// L2R_LR_DUAL stores alpha_i and upper_bound_i - alpha_i
+	int alpha_size = param->solver_type == L2R_LR_DUAL ? 2 : 1;
+	double *alpha = Malloc(double, (size_t)alpha_size*l*nr_w);
+	for(size_t a=0;a<(size_t)alpha_size*l*nr_w;a++)
+		alpha[a] = 0;
+
+	double start_time = wall_time();
+	double deadline = param->time_budget > 0 ? start_time + param->time_budget : INF;
+	solver_monitor monitor(param, deadline, w_size, prob->bias, nr_w, label);
+	int max_iter = monitor.max_iter(1000);
+	parameter block_param = *param;
+	block_param.max_iter = BLOCK_INNER_ITER;
+
+	block_prefetch prefetch;
+	start_prefetch(&prefetch, prob->block_file[0], w_size);
+	bool pending = true;
+	bool failed = false;
+	bool stopped = false;
+	problem *block = NULL;
+	int iter = 0;
+	bool converged = false;
+	while(iter < max_iter && !failed && !stopped)
 	{
-		int begin = fold_start[i];
-		int end = fold_start[i+1];
-		int j,k;
-		struct problem subprob;
+		bool optimal = true;
+		for(b=0;b<nr_block;b++)
+		{
+			if(pending)
+			{
+				block = finish_prefetch(&prefetch);
+				pending = false;
+				if(block == NULL)
+				{
+					failed = true;
+					break;
+				}
+			}
+			// a single block stays in memory
+			if(nr_block > 1)
+			{
+				start_prefetch(&prefetch, prob->block_file[(b+1)%nr_block], w_size);
+				pending = true;
+			}
 
-		subprob.bias = prob->bias;
-		subprob.n = prob->n;
-		subprob.l = l-(end-begin);
-		subprob.x = Malloc(struct feature_node*,subprob.l);
-		subprob.y = Malloc(int,subprob.l);
+			problem sub_prob = *block;
+			sub_prob.y = Malloc(int,block->l);
+			for(k=0;k<nr_w;k++)
+			{
+				double Cp = nr_class == 2 ? weighted_C[0] : weighted_C[k];
+				double Cn = nr_class == 2 ? weighted_C[1] : param->C;
+				double *w_k = &w[(size_t)k*w_size];
+				double *alpha_k = &alpha[((size_t)k*l + prob->block_start[b])*alpha_size];
+				for(i=0;i<block->l;i++)
+					sub_prob.y[i] = block->y[i] == label[k] ? +1 : -1;
+
+				// the block solvers carry on with the random numbers of the training, so the
+				// passes over a block are not all shuffled the same way
+				solver_monitor block_monitor(&block_param, deadline, w_size, prob->bias, 1, &label[k]);
+				block_monitor.random = monitor.random;
+				int block_iter;
+				if(param->solver_type == L2R_LR_DUAL)
+				{
+					// the starting point of solve_l2r_lr_dual, added to w on the first visit
+					if(iter == 0)
+						for(i=0;i<block->l;i++)
+						{
+							double C = (sub_prob.y[i] > 0 ? Cp : Cn)*instance_weight(block, i);
+							alpha_k[2*i] = min(0.001*C, 1e-8);
+							alpha_k[2*i+1] = C - alpha_k[2*i];
+							for(feature_node *xi = block->x[i]; xi->index != -1; xi++)
+								w_k[xi->index-1] += sub_prob.y[i]*alpha_k[2*i]*xi->value;
+						}
+					block_iter = solve_l2r_lr_dual<double_rows>(&sub_prob, w_k, alpha_k, param->eps, Cp, Cn, &block_monitor);
+				}
+				else
+					block_iter = solve_l2r_l1l2_svc<double_rows>(&sub_prob, w_k, alpha_k, param->eps, Cp, Cn, param->solver_type, &block_monitor);
+				monitor.random = block_monitor.random;
+				if(block_iter > 1)
+					optimal = false;
+			}
+			free(sub_prob.y);
 
-		k=0;
-		for(j=0;j<begin;j++)
-		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
+			if(nr_block > 1)
+			{
+				free_block(block);
+				block = NULL;
+			}
+			if(monitor.stop(NULL))
+			{
+				stopped = true;
+				break;
+			}
 		}
-		for(j=end;j<l;j++)
+		if(failed)
+			break;
+		iter++;
+		monitor.info("block iteration %d\n", iter);
+		if(optimal && !stopped)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
+			converged = true;
+			break;
 		}
-		struct model *submodel = train(&subprob,param);
-		for(j=begin;j<end;j++)
-			target[perm[j]] = predict(submodel,prob->x[perm[j]]);
-		free_and_destroy_model(&submodel);
-		free(subprob.x);
-		free(subprob.y);
 	}
-	free(fold_start);
-	free(perm);
+	if(iter >= max_iter && !converged)
+	{
+		monitor.info("\nWARNING: reaching max number of block iterations\n");
+		monitor.reached_max_iter();
+	}
+	if(pending)
+		free_block(finish_prefetch(&prefetch));
+	free_block(block);
+
+	if(failed)
+	{
+		free(w);
+		free(alpha);
+		free(weighted_C);
+		free(label);
+		free(model_);
+		return NULL;
+	}
+
+	model_->nr_iter = iter;
+	model_->stop_reason = monitor.reason;
+	add_stats(param->context, iter, 0, wall_time()-start_time);
+	model_->w = Malloc(double, (size_t)w_size*nr_w);
+	for(k=0;k<nr_w;k++)
+		for(j=0;j<w_size;j++)
+			model_->w[j*nr_w+k] = w[(size_t)k*w_size+j];
+
+	free(w);
+	free(alpha);
+	free(weighted_C);
+	return model_;
 }
 
-int predict_values(const struct model *model_, const struct feature_node *x, double *dec_values)
+template <class Rows>
+static int rows_instance_nnz(const problem *prob, int i)
 {
-	int idx;
-	int n;
-	if(model_->bias>=0)
-		n=model_->nr_feature+1;
-	else
-		n=model_->nr_feature;
-	double *w=model_->w;
-	int nr_class=model_->nr_class;
-	int i;
-	int nr_w;
-	if(nr_class==2 && model_->param.solver_type != MCSVM_CS)
-		nr_w = 1;
-	else
-		nr_w = nr_class;
+	int nnz = 0;
+	for(typename Rows::row xi = Rows(prob)[i]; xi.more(); xi.next())
+		nnz++;
+	return nnz;
+}
 
-	const feature_node *lx=x;
-	for(i=0;i<nr_w;i++)
-		dec_values[i] = 0;
-	for(; (idx=lx->index)!=-1; lx++)
+template <class Rows>
+static void rows_get_instance(const problem *prob, int i, feature_node *x)
+{
+	for(typename Rows::row xi = Rows(prob)[i]; xi.more(); xi.next(), x++)
 	{
-		// the dimension of testing data may exceed that of training
-		if(idx<=n)
-			for(i=0;i<nr_w;i++)
-				dec_values[i] += w[(idx-1)*nr_w+i]*lx->value;
+		x->index = xi.index();
+		x->value = xi.value();
 	}
+	x->index = -1;
+}
 
-	if(nr_class==2)
-		return (dec_values[0]>0)?model_->label[0]:model_->label[1];
-	else
-	{
-		int dec_max_idx = 0;
-		for(i=1;i<nr_class;i++)
-		{
-			if(dec_values[i] > dec_values[dec_max_idx])
-				dec_max_idx = i;
-		}
-		return model_->label[dec_max_idx];
-	}
+int instance_nnz(const problem *prob, int i)
+{
+	int nnz = 0;
+	DISPATCH_ROWS(prob, nnz = rows_instance_nnz<Rows>(prob, i));
+	return nnz;
+}
+
+void get_instance(const problem *prob, int i, feature_node *x)
+{
+	DISPATCH_ROWS(prob, rows_get_instance<Rows>(prob, i, x));
+}
+
+int predict_values(const struct model *model_, const struct feature_node *x, double *dec_values)
+{
+	return predict_values_row(model_, double_rows::row(x), dec_values);
 }
 
 int predict(const model *model_, const feature_node *x)
@@ -2220,6 +4876,10 @@ struct model *load_model(const char *model_file_name)
 	parameter& param = model_->param;
 
 	model_->label = NULL;
+	model_->nr_iter = 0;
+	model_->stop_reason = STOP_CONVERGED;
+	param.validation = NULL;
+	param.context = NULL;
 
 	char cmd[81];
 	while(1)
@@ -2347,6 +5007,23 @@ void destroy_param(parameter* param)
 		free(param->weight);
 }
 
+const char *check_block_parameter(const block_problem *prob, const parameter *param)
+{
+	if(param->solver_type != L2R_L2LOSS_SVC_DUAL
+		&& param->solver_type != L2R_L1LOSS_SVC_DUAL
+		&& param->solver_type != L2R_LR_DUAL)
+		return "out of core training needs a dual solver";
+
+	if(param->validation != NULL)
+		return "out of core training does not support a validation problem";
+
+	// the instance weights are checked when the blocks are written
+	problem empty;
+	empty.l = 0;
+	empty.W = NULL;
+	return check_parameter(&empty, param);
+}
+
 const char *check_parameter(const problem *prob, const parameter *param)
 {
 	if(param->eps <= 0)
@@ -2355,6 +5032,34 @@ const char *check_parameter(const problem *prob, const parameter *param)
 	if(param->C <= 0)
 		return "C <= 0";
 
+	if(param->max_iter < 0)
+		return "max_iter < 0";
+
+	if(param->max_newton_iter < 0)
+		return "max_newton_iter < 0";
+
+	if(param->time_budget < 0)
+		return "time_budget < 0";
+
+	if(param->nr_thread < 0)
+		return "nr_thread < 0";
+
+	if(param->hessian_sample < 0 || param->hessian_sample > 1)
+		return "hessian_sample < 0 or > 1";
+
+	if(prob->W != NULL)
+		for(int i=0; i<prob->l; i++)
+			if(prob->W[i] <= 0)
+				return "instance weight <= 0";
+
+	if(param->validation != NULL)
+	{
+		if(param->patience < 1)
+			return "patience < 1";
+		if(param->validation_interval < 1)
+			return "validation interval < 1";
+	}
+
 	if(param->solver_type != L2R_LR
 		&& param->solver_type != L2R_L2LOSS_SVC_DUAL
 		&& param->solver_type != L2R_L2LOSS_SVC
@@ -2375,11 +5080,3 @@ int check_probability_model(const struct model *model_)
 			model_->param.solver_type==L1R_LR);
 }
 
-void set_print_string_function(void (*print_func)(const char*))
-{
-	if (print_func == NULL) 
-		liblinear_print_string = &print_string_stdout;
-	else
-		liblinear_print_string = print_func;
-}
-
@@ -11,6 +11,15 @@ struct feature_node
 	double value;
 };
 
+/* rubylinear addition: a feature_node with a single precision value, 8 bytes per node instead of 16 */
+struct feature_node_float
+{
+	int index;
+	float value;
+};
+
+enum { STORAGE_DOUBLE, STORAGE_FLOAT, STORAGE_BINARY, STORAGE_CSR, STORAGE_COMPRESSED }; /* storage */
+
 struct problem
 {
 	int l, n;
@@ -21,10 +30,78 @@ struct problem
   /* rubylinear addition: the x[i] are pointers into this base (which is allocated in one go) */
   int offset;
   struct feature_node *base;
+
+  /* rubylinear addition: per instance weights multiplying C, NULL if they are all 1 */
+  double *W;
+
+  /* rubylinear addition: how the instances are stored. With STORAGE_FLOAT they are
+     the x_float[i] (pointers into base_float) and x is NULL. With STORAGE_BINARY every
+     value is 1 and only the indices are stored: x_binary[i] points into base_binary
+     and is terminated by -1. With STORAGE_CSR the instances are in compressed sparse
+     row format: instance i is made of the csr_index[j] and csr_value[j] for
+     row_start[i] <= j < row_end[i], without terminators. A problem owning its rows has
+     row_end = row_start+1, while the subproblems built when training reorder them.
+     STORAGE_COMPRESSED is laid out like STORAGE_CSR, but the values are the floats
+     packed_value[j] and the indices of instance i are delta encoded varints (7 bits per
+     byte, least significant first, the high bit set on all bytes but the last) starting
+     at packed_index + index_start[i] */
+  int storage;
+  struct feature_node_float **x_float;
+  struct feature_node_float *base_float;
+  int **x_binary;
+  int *base_binary;
+  long *row_start, *row_end;
+  int *csr_index;
+  double *csr_value;
+  float *packed_value;
+  unsigned char *packed_index;
+  long *index_start;
+  long packed_size, packed_capacity;  /* bytes of packed_index in use and allocated */
+  int packed_last_index;  /* the last index appended while loading */
+
+  /* rubylinear addition: the trainings running on (or validating against) this problem, which
+     cannot be destroyed until they are done */
+  int nr_training;
+};
+
+/* rubylinear addition: a problem stored on disk as blocks of instances (see save_block), for out of core training */
+struct block_problem
+{
+	int l, n;
+	double bias;
+	int nr_block;
+	char **block_file;
+	int *block_start;	/* index of the first instance of each block, nr_block+1 entries */
+	int *y;	/* the labels of all the instances */
 };
 
 enum { L2R_LR, L2R_L2LOSS_SVC_DUAL, L2R_L2LOSS_SVC, L2R_L1LOSS_SVC_DUAL, MCSVM_CS, L1R_L2LOSS_SVC, L1R_LR, L2R_LR_DUAL }; /* solver_type */
 
+enum { STOP_CONVERGED, STOP_MAX_ITER, STOP_TIME_BUDGET, STOP_VALIDATION, STOP_CANCELLED }; /* stop_reason */
+
+/* rubylinear addition: what a training counts about itself, summed over all its solver calls
+   (the classes of a model, the models of a path or of a grid search) */
+struct training_stats
+{
+	long nr_iter;	/* solver iterations, as in model.nr_iter */
+	long nr_cg_iter;	/* conjugate gradient steps of TRON (L2R_LR and L2R_L2LOSS_SVC) */
+	double time;	/* seconds spent in the solvers */
+};
+
+/* rubylinear addition: the state that trainings used to share through globals. A training whose
+   parameter points to a context logs to it, can be cancelled through it and adds its statistics
+   to it; trainings with different contexts share nothing, so they can run on several threads at
+   once. The random numbers and the threads of a training come from its parameter (seed and
+   nr_thread) */
+struct training_context
+{
+	void (*print_string)(const char *s, void *arg);	/* the log, NULL for none */
+	void *print_arg;
+	volatile int cancel;	/* set to 1 from any thread to stop at the end of the current outer
+				   iteration, with the best solution so far and STOP_CANCELLED */
+	struct training_stats stats;
+};
+
 struct parameter
 {
 	int solver_type;
@@ -35,6 +112,47 @@ struct parameter
 	int nr_weight;
 	int *weight_label;
 	double* weight;
+
+  /* rubylinear addition: early stopping. When validation is not NULL, w is scored on it every
+     validation_interval outer iterations and training stops once the accuracy has not improved
+     for patience scores in a row */
+  const struct problem *validation;
+  int patience;
+  int validation_interval;
+
+  /* rubylinear addition: limits (0 for the solver's defaults / no limit). max_newton_iter is the
+     number of outer Newton iterations of L1R_LR, time_budget is in seconds */
+  int max_iter;
+  int max_newton_iter;
+  double time_budget;
+
+  /* rubylinear addition: threads used by the coordinate descent solvers (L2R_L2LOSS_SVC_DUAL,
+     L2R_L1LOSS_SVC_DUAL, L2R_LR_DUAL, L1R_L2LOSS_SVC, L1R_LR). 0 or 1 trains on the calling
+     thread, deterministically */
+  int nr_thread;
+
+  /* rubylinear addition: with L1R_L2LOSS_SVC and L1R_LR, drop the features that the strong rules
+     predict to stay at zero before training, then check the KKT conditions on them. Not used
+     with a validation set, whose early stopping needs all the weights */
+  int screening;
+
+  /* rubylinear addition: with L2R_LR and L2R_L2LOSS_SVC, precondition the conjugate gradient
+     steps of TRON with the diagonal of the Hessian */
+  int preconditioning;
+
+  /* rubylinear addition: with L2R_LR and L2R_L2LOSS_SVC, compute the Hessian-vector products of
+     TRON on this fraction of the samples, drawn again at each Newton iteration. 0 or 1 uses all
+     of them. The function values and gradients always use all the samples */
+  double hessian_sample;
+
+  /* rubylinear addition: seeds the random numbers with which the solvers shuffle the samples or
+     features, and cross validation the folds. A training gets the same random numbers, and so
+     the same model, whatever else runs in the process */
+  long seed;
+
+  /* rubylinear addition: the log, cancellation flag and statistics of the training, NULL to
+     train silently without them (see training_context). Not saved with the model */
+  struct training_context *context;
 };
 
 struct model
@@ -45,10 +163,29 @@ struct model
 	double *w;
 	int *label;		/* label of each class */
 	double bias;
+
+  /* rubylinear addition: solver iterations used in training (summed over classes, 0 if loaded from a file) */
+  int nr_iter;
+  /* rubylinear addition: why the solver stopped (for multi-class models, the first class that did not converge) */
+  int stop_reason;
 };
 
 struct model* train(const struct problem *prob, const struct parameter *param);
+struct model** train_path(const struct problem *prob, const struct parameter *param, int nr_C, const double *C);
 void cross_validation(const struct problem *prob, const struct parameter *param, int nr_fold, int *target);
+void cross_validation_grid(const struct problem *prob, int nr_param, const struct parameter *params, int nr_fold, int nr_thread, int *target);
+
+int save_block(const char *block_file_name, const struct problem *block);
+struct problem *load_block(const char *block_file_name, int n);
+void free_block(struct problem *block);
+struct block_problem *open_block_problem(int nr_block, const char * const *block_file_name);
+void free_block_problem(struct block_problem *prob);
+struct model* train_blocks(const struct block_problem *prob, const struct parameter *param);
+
+/* rubylinear addition: instance i of prob, whatever its storage, as feature_nodes.
+   x needs room for instance_nnz(prob, i) nodes and the -1 terminator */
+int instance_nnz(const struct problem *prob, int i);
+void get_instance(const struct problem *prob, int i, struct feature_node *x);
 
 int predict_values(const struct model *model_, const struct feature_node *x, double* dec_values);
 int predict(const struct model *model_, const struct feature_node *x);
@@ -66,8 +203,8 @@ void free_and_destroy_model(struct model **model_ptr_ptr);
 void destroy_param(struct parameter *param);
 
 const char *check_parameter(const struct problem *prob, const struct parameter *param);
+const char *check_block_parameter(const struct block_problem *prob, const struct parameter *param);
 int check_probability_model(const struct model *model);
-void set_print_string_function(void (*print_func) (const char*));
 
 #ifdef __cplusplus
 }
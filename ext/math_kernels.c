@@ -0,0 +1,292 @@
+#include <math.h>
+#include <string.h>
+#include "math_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MATH_X86
+#include <immintrin.h>
+#endif
+
+/* the reference: the C library */
+
+static void exp_libm(long n, const double *x, double *y)
+{
+  long i;
+  for (i = 0; i < n; i++)
+    y[i] = exp(x[i]);
+}
+
+static void log1p_libm(long n, const double *x, double *y)
+{
+  long i;
+  for (i = 0; i < n; i++)
+    y[i] = log1p(x[i]);
+}
+
+static const struct math_kernels libm_kernels = { "libm", exp_libm, log1p_libm };
+
+#ifdef MATH_X86
+
+/* exp(x) = 2^n exp(r) with n the integer nearest to x/log(2) and |r| <= log(2)/2, exp(r) by its
+   Taylor series up to r^13 (the first term left out is below 1e-17 relative). 2^n is built in
+   the exponent bits as 2^(n-1) * 2 so that n reaches 1024. Results below 2^-1021 (x < EXP_MIN)
+   are flushed to zero instead of going subnormal.
+
+   log(1+x) = log(u) + c with u = 1+x rounded and c = ((1+x)-u)/u its rounding error, and
+   log(u) = k log(2) + log(m) with u = m 2^k, m in [sqrt(2)/2, sqrt(2)). With f = m-1 and
+   s = f/(2+f), log(m) = 2 atanh(s) = 2s (1 + s^2/3 + s^4/5 + ...), up to s^18/19 (|s| < 0.172,
+   so the first term left out is below 3e-17 relative). */
+
+#define LOG2E 1.4426950408889634074
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define EXP_MAX 709.782712893383973096
+#define EXP_MIN -707.7
+#define SHIFTER 6755399441055744.0 /* 1.5*2^52, adding it rounds to an integer in the low bits */
+#define TWO52 4503599627370496.0
+#define SQRT1_2_BITS 0x3fe6a09e667f3bcdLL
+#define ONE_BITS 0x3ff0000000000000LL
+#define MANTISSA_BITS 0x000fffffffffffffLL
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp4_avx2(__m256d x)
+{
+  const __m256d shifter = _mm256_set1_pd(SHIFTER);
+  __m256d xc = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(EXP_MIN)), _mm256_set1_pd(EXP_MAX));
+  __m256d t = _mm256_fmadd_pd(xc, _mm256_set1_pd(LOG2E), shifter);
+  __m256d n = _mm256_sub_pd(t, shifter);
+  __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), xc);
+  __m256d p;
+  __m256i e;
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+
+  p = _mm256_set1_pd(1.0/6227020800.0);
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/479001600.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/39916800.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/3628800.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/362880.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/40320.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/5040.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/720.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/120.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/24.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0/6.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.5));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+
+  /* the low bits of t hold n */
+  e = _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_castpd_si256(shifter));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1022)), 52);
+  p = _mm256_mul_pd(_mm256_mul_pd(p, _mm256_castsi256_pd(e)), _mm256_set1_pd(2.0));
+
+  p = _mm256_blendv_pd(p, _mm256_setzero_pd(), _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_LT_OQ));
+  p = _mm256_blendv_pd(p, _mm256_set1_pd(INFINITY), _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MAX), _CMP_GT_OQ));
+  return _mm256_blendv_pd(p, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d log1p4_avx2(__m256d x)
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d two52 = _mm256_set1_pd(TWO52);
+  __m256d u = _mm256_add_pd(one, x);
+  __m256d c, k, m, f, s, z, p, result;
+  __m256i ix;
+
+  c = _mm256_blendv_pd(_mm256_sub_pd(x, _mm256_sub_pd(u, one)), _mm256_sub_pd(one, _mm256_sub_pd(u, x)),
+                       _mm256_cmp_pd(x, one, _CMP_GE_OQ));
+  c = _mm256_div_pd(c, u);
+
+  /* moves the boundary between exponents from 1 to sqrt(2)/2 */
+  ix = _mm256_add_epi64(_mm256_castpd_si256(u), _mm256_set1_epi64x(ONE_BITS - SQRT1_2_BITS));
+  k = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(ix, 52), _mm256_castpd_si256(two52)));
+  k = _mm256_sub_pd(k, _mm256_set1_pd(TWO52 + 1023));
+  m = _mm256_castsi256_pd(_mm256_add_epi64(_mm256_and_si256(ix, _mm256_set1_epi64x(MANTISSA_BITS)),
+                                           _mm256_set1_epi64x(SQRT1_2_BITS)));
+
+  f = _mm256_sub_pd(m, one);
+  s = _mm256_div_pd(f, _mm256_add_pd(_mm256_set1_pd(2.0), f));
+  z = _mm256_mul_pd(s, s);
+  p = _mm256_set1_pd(1.0/19.0);
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/17.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/15.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/13.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/11.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/9.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/7.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/5.0));
+  p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0/3.0));
+  p = _mm256_fmadd_pd(p, z, one);
+
+  result = _mm256_fmadd_pd(_mm256_add_pd(s, s), p, _mm256_fmadd_pd(k, _mm256_set1_pd(LN2_LO), c));
+  result = _mm256_fmadd_pd(k, _mm256_set1_pd(LN2_HI), result);
+
+  result = _mm256_blendv_pd(result, _mm256_set1_pd(-INFINITY), _mm256_cmp_pd(u, _mm256_setzero_pd(), _CMP_EQ_OQ));
+  result = _mm256_blendv_pd(result, _mm256_set1_pd(NAN), _mm256_cmp_pd(x, _mm256_set1_pd(-1.0), _CMP_LT_OQ));
+  result = _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, _mm256_set1_pd(INFINITY), _CMP_EQ_OQ));
+  return _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+/* the remainder goes through the same code, padded, so that a value gives the same result
+   wherever it is in the array */
+#define MATH_AVX2_LOOP(name, f) \
+__attribute__((target("avx2,fma"))) \
+static void name(long n, const double *x, double *y) \
+{ \
+  double tail[4] = {0, 0, 0, 0}; \
+  long i = 0; \
+  for ( ; i + 4 <= n; i += 4) \
+    _mm256_storeu_pd(y+i, f(_mm256_loadu_pd(x+i))); \
+  if (i < n) \
+  { \
+    memcpy(tail, x+i, sizeof(double)*(n-i)); \
+    _mm256_storeu_pd(tail, f(_mm256_loadu_pd(tail))); \
+    memcpy(y+i, tail, sizeof(double)*(n-i)); \
+  } \
+}
+
+MATH_AVX2_LOOP(exp_avx2, exp4_avx2)
+MATH_AVX2_LOOP(log1p_avx2, log1p4_avx2)
+
+static const struct math_kernels avx2_kernels = { "avx2", exp_avx2, log1p_avx2 };
+
+/* the same with 8 doubles per register, blending with masks */
+
+__attribute__((target("avx512f")))
+static inline __m512d exp8_avx512(__m512d x)
+{
+  const __m512d shifter = _mm512_set1_pd(SHIFTER);
+  __m512d xc = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(EXP_MIN)), _mm512_set1_pd(EXP_MAX));
+  __m512d t = _mm512_fmadd_pd(xc, _mm512_set1_pd(LOG2E), shifter);
+  __m512d n = _mm512_sub_pd(t, shifter);
+  __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_HI), xc);
+  __m512d p;
+  __m512i e;
+  r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_LO), r);
+
+  p = _mm512_set1_pd(1.0/6227020800.0);
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/479001600.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/39916800.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/3628800.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/362880.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/40320.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/5040.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/720.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/120.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/24.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0/6.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(0.5));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+  p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+
+  e = _mm512_sub_epi64(_mm512_castpd_si512(t), _mm512_castpd_si512(shifter));
+  e = _mm512_slli_epi64(_mm512_add_epi64(e, _mm512_set1_epi64(1022)), 52);
+  p = _mm512_mul_pd(_mm512_mul_pd(p, _mm512_castsi512_pd(e)), _mm512_set1_pd(2.0));
+
+  p = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MIN), _CMP_LT_OQ), p, _mm512_setzero_pd());
+  p = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MAX), _CMP_GT_OQ), p, _mm512_set1_pd(INFINITY));
+  return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), p, x);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d log1p8_avx512(__m512d x)
+{
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d two52 = _mm512_set1_pd(TWO52);
+  __m512d u = _mm512_add_pd(one, x);
+  __m512d c, k, m, f, s, z, p, result;
+  __m512i ix;
+
+  c = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, one, _CMP_GE_OQ),
+                           _mm512_sub_pd(x, _mm512_sub_pd(u, one)), _mm512_sub_pd(one, _mm512_sub_pd(u, x)));
+  c = _mm512_div_pd(c, u);
+
+  ix = _mm512_add_epi64(_mm512_castpd_si512(u), _mm512_set1_epi64(ONE_BITS - SQRT1_2_BITS));
+  k = _mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(ix, 52), _mm512_castpd_si512(two52)));
+  k = _mm512_sub_pd(k, _mm512_set1_pd(TWO52 + 1023));
+  m = _mm512_castsi512_pd(_mm512_add_epi64(_mm512_and_si512(ix, _mm512_set1_epi64(MANTISSA_BITS)),
+                                           _mm512_set1_epi64(SQRT1_2_BITS)));
+
+  f = _mm512_sub_pd(m, one);
+  s = _mm512_div_pd(f, _mm512_add_pd(_mm512_set1_pd(2.0), f));
+  z = _mm512_mul_pd(s, s);
+  p = _mm512_set1_pd(1.0/19.0);
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/17.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/15.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/13.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/11.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/9.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/7.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/5.0));
+  p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(1.0/3.0));
+  p = _mm512_fmadd_pd(p, z, one);
+
+  result = _mm512_fmadd_pd(_mm512_add_pd(s, s), p, _mm512_fmadd_pd(k, _mm512_set1_pd(LN2_LO), c));
+  result = _mm512_fmadd_pd(k, _mm512_set1_pd(LN2_HI), result);
+
+  result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(u, _mm512_setzero_pd(), _CMP_EQ_OQ), result, _mm512_set1_pd(-INFINITY));
+  result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(-1.0), _CMP_LT_OQ), result, _mm512_set1_pd(NAN));
+  result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(INFINITY), _CMP_EQ_OQ), result, x);
+  return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), result, x);
+}
+
+#define MATH_AVX512_LOOP(name, f) \
+__attribute__((target("avx512f"))) \
+static void name(long n, const double *x, double *y) \
+{ \
+  long i = 0; \
+  for ( ; i + 8 <= n; i += 8) \
+    _mm512_storeu_pd(y+i, f(_mm512_loadu_pd(x+i))); \
+  if (i < n) \
+  { \
+    __mmask8 m = (__mmask8)((1u << (n - i)) - 1); \
+    _mm512_mask_storeu_pd(y+i, m, f(_mm512_maskz_loadu_pd(m, x+i))); \
+  } \
+}
+
+MATH_AVX512_LOOP(exp_avx512, exp8_avx512)
+MATH_AVX512_LOOP(log1p_avx512, log1p8_avx512)
+
+static const struct math_kernels avx512_kernels = { "avx512", exp_avx512, log1p_avx512 };
+
+#endif
+
+const struct math_kernels *math_current_kernels = &libm_kernels;
+
+int math_supported_kernels(const struct math_kernels **kernels, int max)
+{
+  int count = 0;
+  if (count < max)
+    kernels[count++] = &libm_kernels;
+#ifdef MATH_X86
+  __builtin_cpu_init();
+  if (count < max && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    kernels[count++] = &avx2_kernels;
+  if (count < max && __builtin_cpu_supports("avx512f"))
+    kernels[count++] = &avx512_kernels;
+#endif
+  return count;
+}
+
+void math_init_kernels(void)
+{
+  const struct math_kernels *kernels[3];
+  int count = math_supported_kernels(kernels, 3);
+  __atomic_store_n(&math_current_kernels, kernels[count-1], __ATOMIC_RELEASE);
+}
+
+int math_use_kernels(const char *name)
+{
+  const struct math_kernels *kernels[3];
+  int i, count = math_supported_kernels(kernels, 3);
+  for (i = 0; i < count; i++)
+  {
+    if (strcmp(kernels[i]->name, name) == 0)
+    {
+      __atomic_store_n(&math_current_kernels, kernels[i], __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+  return -1;
+}
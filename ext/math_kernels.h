@@ -0,0 +1,45 @@
+/* math_kernels.h  --  rubylinear addition: exp and log1p over arrays, for the loss loops of the
+   logistic regression solvers. Like the BLAS kernels they are chosen when the extension is
+   loaded according to what the CPU supports. The libm kernels call the C library, the others
+   are within a few units in the last place of it. */
+
+#ifndef MATH_KERNELS_INCLUDE
+#define MATH_KERNELS_INCLUDE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct math_kernels
+{
+  const char *name;
+  void (*exp)(long n, const double *x, double *y);   /* y = exp(x), y may be x */
+  void (*log1p)(long n, const double *x, double *y); /* y = log(1+x), y may be x */
+};
+
+extern const struct math_kernels *math_current_kernels;
+
+/* the kernels in use, to be read once per loop: VectorMath.use may switch them meanwhile from
+   another thread */
+static inline const struct math_kernels *math_kernels_in_use(void)
+{
+  return __atomic_load_n(&math_current_kernels, __ATOMIC_ACQUIRE);
+}
+
+/* uses the fastest kernels supported by the CPU */
+void math_init_kernels(void);
+
+/* stores up to max of the kernels supported by the CPU in kernels, the libm ones first and
+   the fastest last. Returns their count */
+int math_supported_kernels(const struct math_kernels **kernels, int max);
+
+/* uses the kernels called name. Returns -1 if the CPU does not support them. The choice is
+   process wide, for every thread and Ractor: the pointer is swapped atomically, so a kernel
+   call already running finishes with the table it started with */
+int math_use_kernels(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
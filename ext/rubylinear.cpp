@@ -1,6 +1,11 @@
 #include "linear.h"
 #include "tron.h"
+#include "blas_kernels.h"
+#include "math_kernels.h"
 #include "ruby.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
 #include <errno.h>
 #include <ctype.h>
 #ifdef __cplusplus
@@ -10,114 +15,572 @@ extern "C" {
   
 VALUE mRubyLinear;
 VALUE cProblem;
+VALUE cBlockProblem;
 VALUE cModel;
+VALUE mBlas;
+VALUE mVectorMath;
+
+/* the feature nodes are in base, base_float, base_binary, csr_index or packed_value depending on the problem's storage */
+static bool problem_disposed(struct problem *problem){
+  return problem->base == NULL && problem->base_float == NULL && problem->base_binary == NULL && problem->csr_index == NULL &&
+    problem->packed_value == NULL;
+}
 
 static void model_free(void *p){
   struct model * m = (struct model *)p;
   free_and_destroy_model(&m);
 }
 
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+/* rubylinear addition: models are typed data so that, once frozen, they can be shared between
+   Ractors (Ractor.make_shareable(model)). Nothing changes a trained model but destroy!, which
+   raises on a frozen one, so its weights are immutable and predicting only reads them */
+static const rb_data_type_t model_type = {
+  "RubyLinear::Model",
+  {0, model_free, 0,},
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+struct load_model_args {
+  const char *path;
+  struct model *model;
+  int error;  /* errno if the file could not be opened */
+};
+
+static void *load_model_without_gvl(void *p){
+  struct load_model_args *args = (struct load_model_args *)p;
+  /* load_model returns NULL for a missing file as for a malformed one */
+  FILE *fp = fopen(args->path, "r");
+  if(fp == NULL){
+    args->error = errno;
+    return NULL;
+  }
+  fclose(fp);
+  args->model = load_model(args->path);
+  return NULL;
+}
+
+/* Model.load_file(path), private: the file is read without the GVL. RubyLinear::Model.load_file
+   calls it, on a thread of its own when a Fiber scheduler runs the calling fiber */
 static VALUE model_load_file(VALUE klass, VALUE path){
-  path = rb_str_to_str(path);
-  struct model * model = load_model(rb_string_value_cstr(&path));
-  VALUE tdata = Data_Wrap_Struct(klass, 0, model_free, model);
+  struct load_model_args args;
+  path = rb_str_dup(rb_str_to_str(path));
+  args.path = rb_string_value_cstr(&path);
+  args.model = NULL;
+  args.error = 0;
+#ifdef HAVE_RUBY_THREAD_H
+  /* load_model cannot be stopped halfway, so interrupts are checked once the model is wrapped */
+  rb_thread_call_without_gvl2(load_model_without_gvl, &args, NULL, NULL);
+#else
+  load_model_without_gvl(&args);
+#endif
+  RB_GC_GUARD(path);
+  if(args.error){
+    rb_syserr_fail(args.error, args.path);
+  }
+  if(args.model == NULL){
+    rb_raise(rb_eArgError, "invalid model file %s", args.path);
+  }
+  VALUE tdata = TypedData_Wrap_Struct(klass, &model_type, args.model);
+  rb_thread_check_ints();
   return tdata;
 }
 
 static VALUE model_write_file(VALUE self,VALUE path){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   path = rb_str_to_str(path);
   save_model(rb_string_value_cstr(&path), model);
   return self;
 }
 
-static VALUE model_new(VALUE klass, VALUE r_problem, VALUE parameters){
-
-  struct model *model = NULL;
-  struct problem *problem;
-  Data_Get_Struct(r_problem, struct problem, problem);
-  struct parameter param;
-  
-  if(!problem->base){
-    rb_raise(rb_eArgError, "problem has been disposed");
-    return Qnil;
-  }
-  
+static void parameter_from_hash(VALUE parameters, struct parameter *param){
   rb_funcall(mRubyLinear, rb_intern("validate_options"), 1, parameters);
   VALUE v;
   
   if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("eps"))))){
-    param.eps = RFLOAT_VALUE(rb_to_float(v));
+    param->eps = RFLOAT_VALUE(rb_to_float(v));
   }else{
-    param.eps = 0.01;
+    param->eps = 0.01;
   }
 
   if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("c"))))){
-    param.C = RFLOAT_VALUE(rb_to_float(v));
+    param->C = RFLOAT_VALUE(rb_to_float(v));
   }else{
-    param.C = 1;
+    param->C = 1;
   }
 
   v = rb_hash_aref(parameters, ID2SYM(rb_intern("solver")));
-  param.solver_type = FIX2INT(v);
+  param->solver_type = FIX2INT(v);
+
+  param->validation = NULL;
+  param->patience = 5;
+  param->validation_interval = 1;
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("validation"))))){
+    if(!rb_obj_is_kind_of(v, cProblem)){
+      rb_raise(rb_eArgError, "validation must be a RubyLinear::Problem");
+    }
+    struct problem *validation;
+    Data_Get_Struct(v, struct problem, validation);
+    if(problem_disposed(validation)){
+      rb_raise(rb_eArgError, "validation problem has been disposed");
+    }
+    param->validation = validation;
+  }
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("patience"))))){
+    param->patience = NUM2INT(v);
+  }
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("validation_interval"))))){
+    param->validation_interval = NUM2INT(v);
+  }
+
+  param->max_iter = 0;
+  param->max_newton_iter = 0;
+  param->time_budget = 0;
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("max_iter"))))){
+    param->max_iter = NUM2INT(v);
+  }
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("max_newton_iter"))))){
+    param->max_newton_iter = NUM2INT(v);
+  }
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("time_budget"))))){
+    param->time_budget = RFLOAT_VALUE(rb_to_float(v));
+  }
+
+  param->nr_thread = 1;
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("threads"))))){
+    param->nr_thread = NUM2INT(v);
+  }
+
+  param->screening = RTEST(rb_hash_aref(parameters, ID2SYM(rb_intern("screening"))));
+  param->preconditioning = RTEST(rb_hash_aref(parameters, ID2SYM(rb_intern("preconditioning"))));
+
+  param->hessian_sample = 0;
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("hessian_sample"))))){
+    param->hessian_sample = RFLOAT_VALUE(rb_to_float(v));
+  }
+
+  param->seed = 0;
+  if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("seed"))))){
+    param->seed = NUM2LONG(v);
+  }
+
+  param->context = NULL;
 
+  /* the weights come last, converted before anything is allocated: nothing after them can
+     raise and leak them */
+  param->nr_weight = 0;
+  param->weight = NULL;
+  param->weight_label = NULL;
   if(!NIL_P(v = rb_hash_aref(parameters, ID2SYM(rb_intern("weights"))))){
     Check_Type(v, T_HASH);
-    param.nr_weight = RHASH_SIZE(v);
-    param.weight = (double*)calloc(param.nr_weight,sizeof(double));
-    param.weight_label = (int*)calloc(param.nr_weight,sizeof(int));
-
     VALUE weights_as_array = rb_funcall(v, rb_intern("to_a"),0);
-
-    for(long i=0; i < RARRAY_LEN(weights_as_array); i++){
+    long nr_weight = RARRAY_LEN(weights_as_array);
+    VALUE labels = rb_ary_new2(nr_weight);
+    VALUE weights = rb_ary_new2(nr_weight);
+    for(long i=0; i < nr_weight; i++){
       VALUE pair = RARRAY_PTR(weights_as_array)[i];
-      VALUE label = RARRAY_PTR(pair)[0];
-      VALUE weight = RARRAY_PTR(pair)[1];
+      rb_ary_push(labels, INT2NUM(NUM2INT(RARRAY_PTR(pair)[0])));
+      rb_ary_push(weights, rb_to_float(RARRAY_PTR(pair)[1]));
+    }
 
-      param.weight[i] = RFLOAT_VALUE(rb_to_float(weight));
-      param.weight_label[i] = FIX2INT(label);
+    param->nr_weight = nr_weight;
+    param->weight = (double*)calloc(param->nr_weight,sizeof(double));
+    param->weight_label = (int*)calloc(param->nr_weight,sizeof(int));
+    for(long i=0; i < nr_weight; i++){
+      param->weight[i] = RFLOAT_VALUE(RARRAY_PTR(weights)[i]);
+      param->weight_label[i] = FIX2INT(RARRAY_PTR(labels)[i]);
     }
-    
-  }else{
-    param.nr_weight = 0;
-    param.weight = NULL;
-    param.weight_label = NULL;
   }
+}
+
+/* rubylinear addition: a training started from Ruby, with its own training_context. It runs
+   without the GVL, and an interrupt of the calling thread (Thread#raise, Thread#kill, Timeout,
+   ^C) cancels it: the solver stops at the end of its current iteration and the interrupt is then
+   raised as usual. An interrupt that does not raise (a trap handler that returns) leaves the
+   model trained so far, with the stop reason :cancelled. The log goes to parameters[:log] with
+   <<, the GVL being taken back for each message; if << raises, training is cancelled and the
+   exception raised. */
+struct ruby_training {
+  struct training_context context;
+  VALUE log;
+  int log_state;        /* the tag of the exception raised by log, 0 if none */
+  const char *message;  /* the message being logged */
+  void *(*train)(void *);
+  void *args;
+  bool done;
+  VALUE problems;       /* the problems used by train, kept from being destroyed or collected */
+};
+
+static VALUE ruby_training_write_log(VALUE p){
+  struct ruby_training *training = (struct ruby_training *)p;
+  return rb_funcall(training->log, rb_intern("<<"), 1, rb_str_new_cstr(training->message));
+}
+
+static void *ruby_training_log_with_gvl(void *p){
+  struct ruby_training *training = (struct ruby_training *)p;
+  rb_protect(ruby_training_write_log, (VALUE)training, &training->log_state);
+  if(training->log_state){
+    training->context.cancel = 1;
+  }
+  return NULL;
+}
+
+static void ruby_training_print(const char *s, void *p){
+  struct ruby_training *training = (struct ruby_training *)p;
+  if(training->log_state){
+    return;
+  }
+  training->message = s;
+#ifdef HAVE_RUBY_THREAD_H
+  rb_thread_call_with_gvl(ruby_training_log_with_gvl, training);
+#else
+  ruby_training_log_with_gvl(training);
+#endif
+}
+
+static void ruby_training_cancel(void *p){
+  ((struct ruby_training *)p)->context.cancel = 1;
+}
+
+static void *ruby_training_call(void *p){
+  struct ruby_training *training = (struct ruby_training *)p;
+  training->train(training->args);
+  training->done = true;
+  return NULL;
+}
+
+static VALUE ruby_training_check_interrupts(VALUE unused){
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+/* points param (and the nr_param-1 parameters after it) to the context of training, logging
+   to parameters[:log] */
+static void ruby_training_init(struct ruby_training *training, VALUE parameters, struct parameter *param, int nr_param){
+  memset(training, 0, sizeof(*training));
+  training->log = NIL_P(parameters) ? Qnil : rb_hash_aref(parameters, ID2SYM(rb_intern("log")));
+  if(!NIL_P(training->log)){
+    training->context.print_string = ruby_training_print;
+    training->context.print_arg = training;
+  }
+  for(int i=0; i < nr_param; i++){
+    param[i].context = &training->context;
+  }
+  training->problems = rb_ary_new();
+}
+
+/* keeps r_problem (a Problem or a BlockProblem, nil is ignored) alive while the training runs
+   and, for a Problem, makes destroy! raise meanwhile */
+static void ruby_training_hold(struct ruby_training *training, VALUE r_problem){
+  if(!NIL_P(r_problem)){
+    rb_ary_push(training->problems, r_problem);
+  }
+}
+
+static void ruby_training_mark_problems(struct ruby_training *training, int delta){
+  for(long i=0; i < RARRAY_LEN(training->problems); i++){
+    VALUE r_problem = RARRAY_PTR(training->problems)[i];
+    if(RTEST(rb_obj_is_kind_of(r_problem, cProblem))){
+      struct problem *problem;
+      Data_Get_Struct(r_problem, struct problem, problem);
+      problem->nr_training += delta;
+    }
+  }
+}
+
+/* calls train(args) without the GVL. If it is interrupted by an exception, cleanup(args) frees
+   what train allocated and the arguments before the exception is raised */
+static void ruby_training_run(struct ruby_training *training, void *(*train)(void *), void (*cleanup)(void *), void *args){
+  training->train = train;
+  training->args = args;
+  /* other threads run meanwhile and may drop their references to the problems */
+  VALUE problems = training->problems;
+  ruby_training_mark_problems(training, 1);
+  while(1){
+#ifdef HAVE_RUBY_THREAD_H
+    /* unlike rb_thread_call_without_gvl, does not raise pending interrupts itself, so that
+       the results of train are not leaked */
+    rb_thread_call_without_gvl2(ruby_training_call, training, ruby_training_cancel, training);
+#else
+    ruby_training_call(training);
+#endif
+    if(training->log_state){
+      ruby_training_mark_problems(training, -1);
+      cleanup(args);
+      rb_jump_tag(training->log_state);
+    }
+    if(training->done && !training->context.cancel){
+      break;
+    }
+    int state = 0;
+    rb_protect(ruby_training_check_interrupts, Qnil, &state);
+    if(state){
+      ruby_training_mark_problems(training, -1);
+      cleanup(args);
+      rb_jump_tag(state);
+    }
+    if(training->done){
+      break;
+    }
+  }
+  ruby_training_mark_problems(training, -1);
+  RB_GC_GUARD(problems);
+}
+
+static void ruby_training_set_stats(struct ruby_training *training, VALUE r_model){
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("iterations")), LONG2NUM(training->context.stats.nr_iter));
+  rb_hash_aset(stats, ID2SYM(rb_intern("cg_iterations")), LONG2NUM(training->context.stats.nr_cg_iter));
+  rb_hash_aset(stats, ID2SYM(rb_intern("time")), rb_float_new(training->context.stats.time));
+  rb_ivar_set(r_model, rb_intern("@training_stats"), stats);
+}
+
+struct train_args {
+  struct problem *problem;
+  struct block_problem *block_problem;
+  struct parameter *param;
+  int nr_C;
+  double *C;
+  struct model *model;
+  struct model **models;
+};
+
+static void *train_without_gvl(void *p){
+  struct train_args *args = (struct train_args *)p;
+  args->model = train(args->problem, args->param);
+  return NULL;
+}
+
+static void *train_blocks_without_gvl(void *p){
+  struct train_args *args = (struct train_args *)p;
+  args->model = train_blocks(args->block_problem, args->param);
+  return NULL;
+}
+
+static void *train_path_without_gvl(void *p){
+  struct train_args *args = (struct train_args *)p;
+  args->models = train_path(args->problem, args->param, args->nr_C, args->C);
+  return NULL;
+}
+
+static void train_cleanup(void *p){
+  struct train_args *args = (struct train_args *)p;
+  if(args->model){
+    free_and_destroy_model(&args->model);
+  }
+  if(args->models){
+    for(int i=0; i < args->nr_C; i++){
+      free_and_destroy_model(&args->models[i]);
+    }
+    free(args->models);
+  }
+  free(args->C);
+  destroy_param(args->param);
+}
+
+/* out of core training on a BlockProblem */
+static VALUE model_new_from_blocks(VALUE klass, VALUE r_problem, VALUE parameters){
+  struct block_problem *problem;
+  Data_Get_Struct(r_problem, struct block_problem, problem);
+  struct parameter param;
+
+  parameter_from_hash(parameters, &param);
+
+  const char *error_string = check_block_parameter(problem, &param);
+  if(error_string){
+    destroy_param(&param);
+    rb_raise(rb_eArgError, "%s", error_string);
+    return Qnil;
+  }
+  struct ruby_training training;
+  ruby_training_init(&training, parameters, &param, 1);
+  ruby_training_hold(&training, r_problem);
+  struct train_args args = {NULL, problem, &param, 0, NULL, NULL, NULL};
+  ruby_training_run(&training, train_blocks_without_gvl, train_cleanup, &args);
+  destroy_param(&param);
+  if(!args.model){
+    rb_raise(rb_eIOError, "could not read the blocks");
+    return Qnil;
+  }
+  VALUE tdata = TypedData_Wrap_Struct(klass, &model_type, args.model);
+  ruby_training_set_stats(&training, tdata);
+  return tdata;
+}
 
+static VALUE model_new(VALUE klass, VALUE r_problem, VALUE parameters){
+  if(RTEST(rb_obj_is_kind_of(r_problem, cBlockProblem))){
+    return model_new_from_blocks(klass, r_problem, parameters);
+  }
+
+  struct model *model = NULL;
+  struct problem *problem;
+  Data_Get_Struct(r_problem, struct problem, problem);
+  struct parameter param;
+  
+  if(problem_disposed(problem)){
+    rb_raise(rb_eArgError, "problem has been disposed");
+    return Qnil;
+  }
+  
+  parameter_from_hash(parameters, &param);
   
   const char *error_string = check_parameter(problem, &param);
   if(error_string){
-    rb_raise(rb_eArgError, "%s", error_string);
     destroy_param(&param);
+    rb_raise(rb_eArgError, "%s", error_string);
     return Qnil;
   }
-  model = train(problem, &param);
-  VALUE tdata = Data_Wrap_Struct(klass, 0, model_free, model);  
+  struct ruby_training training;
+  ruby_training_init(&training, parameters, &param, 1);
+  ruby_training_hold(&training, r_problem);
+  ruby_training_hold(&training, rb_hash_aref(parameters, ID2SYM(rb_intern("validation"))));
+  struct train_args args = {problem, NULL, &param, 0, NULL, NULL, NULL};
+  ruby_training_run(&training, train_without_gvl, train_cleanup, &args);
+  model = args.model;
+  VALUE tdata = TypedData_Wrap_Struct(klass, &model_type, model);  
+  ruby_training_set_stats(&training, tdata);
   destroy_param(&param);
   return tdata;
 }
+
+/* trains a model for each value in :cs, warm starting each from the previous one.
+   Returns a hash of C => model, in increasing order of C. The values must be distinct */
+static VALUE model_path(VALUE klass, VALUE r_problem, VALUE parameters){
+  struct problem *problem;
+  Data_Get_Struct(r_problem, struct problem, problem);
+  struct parameter param;
+  
+  if(problem_disposed(problem)){
+    rb_raise(rb_eArgError, "problem has been disposed");
+    return Qnil;
+  }
+
+  Check_Type(parameters, T_HASH);
+  parameters = rb_hash_dup(parameters);
+  VALUE cs = rb_hash_delete(parameters, ID2SYM(rb_intern("cs")));
+  if(NIL_P(cs)){
+    rb_raise(rb_eArgError, "A list of C values (:cs) must be specified");
+    return Qnil;
+  }
+  cs = rb_check_array_type(cs);
+  if(NIL_P(cs) || RARRAY_LEN(cs) == 0){
+    rb_raise(rb_eArgError, ":cs must be a non empty array");
+    return Qnil;
+  }
+  
+  /* everything that can raise is done before C is allocated */
+  int nr_C = RARRAY_LEN(cs);
+  VALUE sorted_cs = rb_ary_new2(nr_C);
+  for(int i=0; i < nr_C; i++){
+    VALUE c = rb_to_float(RARRAY_PTR(cs)[i]);
+    if(RFLOAT_VALUE(c) <= 0){
+      rb_raise(rb_eArgError, "C <= 0");
+      return Qnil;
+    }
+    rb_ary_push(sorted_cs, c);
+  }
+  /* the models are returned keyed by C, so a value given twice would lose one of them */
+  sorted_cs = rb_ary_sort_bang(sorted_cs);
+  for(int i=1; i < nr_C; i++){
+    if(RFLOAT_VALUE(RARRAY_PTR(sorted_cs)[i]) == RFLOAT_VALUE(RARRAY_PTR(sorted_cs)[i-1])){
+      rb_raise(rb_eArgError, "C = %g is given more than once", RFLOAT_VALUE(RARRAY_PTR(sorted_cs)[i]));
+      return Qnil;
+    }
+  }
+
+  parameter_from_hash(parameters, &param);
+
+  const char *error_string = check_parameter(problem, &param);
+  if(error_string){
+    destroy_param(&param);
+    rb_raise(rb_eArgError, "%s", error_string);
+    return Qnil;
+  }
+
+  double *C = (double*)calloc(nr_C, sizeof(double));
+  for(int i=0; i < nr_C; i++){
+    C[i] = RFLOAT_VALUE(RARRAY_PTR(sorted_cs)[i]);
+  }
+  struct ruby_training training;
+  ruby_training_init(&training, parameters, &param, 1);
+  ruby_training_hold(&training, r_problem);
+  ruby_training_hold(&training, rb_hash_aref(parameters, ID2SYM(rb_intern("validation"))));
+  struct train_args args = {problem, NULL, &param, nr_C, C, NULL, NULL};
+  ruby_training_run(&training, train_path_without_gvl, train_cleanup, &args);
+  struct model **models = args.models;
+
+  /* the statistics are those of the whole path */
+  VALUE result = rb_hash_new();
+  for(int i=0; i < nr_C; i++){
+    VALUE tdata = TypedData_Wrap_Struct(klass, &model_type, models[i]);
+    ruby_training_set_stats(&training, tdata);
+    rb_hash_aset(result, rb_float_new(models[i]->param.C), tdata);
+  }
+  free(models);
+  free(C);
+  destroy_param(&param);
+  return result;
+}
+
+static VALUE model_iterations(VALUE self){
+  struct model *model;
+  TypedData_Get_Struct(self, struct model, &model_type, model);
+  return INT2FIX(model->nr_iter);
+}
+
+static VALUE model_stop_reason(VALUE self){
+  struct model *model;
+  TypedData_Get_Struct(self, struct model, &model_type, model);
+  switch(model->stop_reason){
+    case STOP_MAX_ITER:
+      return ID2SYM(rb_intern("max_iter"));
+    case STOP_TIME_BUDGET:
+      return ID2SYM(rb_intern("time_budget"));
+    case STOP_VALIDATION:
+      return ID2SYM(rb_intern("validation"));
+    case STOP_CANCELLED:
+      return ID2SYM(rb_intern("cancelled"));
+    default:
+      return ID2SYM(rb_intern("converged"));
+  }
+}
+
+static VALUE model_converged(VALUE self){
+  struct model *model;
+  TypedData_Get_Struct(self, struct model, &model_type, model);
+  return model->stop_reason == STOP_CONVERGED ? Qtrue : Qfalse;
+}
+
 static VALUE model_feature_count(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   return INT2FIX(model->nr_feature);
 }
 
 static VALUE model_class_count(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   return INT2FIX(model->nr_class);
 }
 
 static VALUE model_class_bias(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   return rb_float_new(model->bias);
 }
 
 static VALUE model_destroy(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  rb_check_frozen(self);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   free_model_content(model);
   model->w = NULL;
   model->label = NULL;
@@ -126,7 +589,7 @@ static VALUE model_destroy(VALUE self){
 
 static VALUE model_destroyed(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   return model->w ? Qfalse : Qtrue;
 }
 
@@ -159,7 +622,7 @@ struct feature_node * convert_ruby_sample_to_feature_node(struct model * model,
 
 static VALUE model_predict_values(VALUE self, VALUE data){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   
   if(!model->w){
     rb_raise(rb_eArgError, "model has been destroyed");
@@ -169,6 +632,7 @@ static VALUE model_predict_values(VALUE self, VALUE data){
 
   double *values = (double*)calloc(sizeof(double), model->nr_class);
   int label=predict_values(model, nodes, values);
+  free(nodes);
 
   VALUE label_to_value_hash = rb_hash_new();
   for(int i = 0; i < model->nr_class; i++){
@@ -186,7 +650,7 @@ static VALUE model_predict_values(VALUE self, VALUE data){
 
 static VALUE model_predict(VALUE self, VALUE data){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   
   if(!model->w){
     rb_raise(rb_eArgError, "model has been destroyed");
@@ -200,14 +664,14 @@ static VALUE model_predict(VALUE self, VALUE data){
 
 static VALUE model_inspect(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   
   return rb_sprintf("#<RubyLinear::Model:%p classes:%d features:%d bias:%f>",(void*)self,model->nr_class, model->nr_feature,model->bias);
 }
 
 static VALUE model_labels(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   VALUE result = rb_ary_new();
   for(int i=0; i < model->nr_class; i++){
     rb_ary_store(result, i, INT2FIX(model->label[i]));
@@ -218,14 +682,14 @@ static VALUE model_labels(VALUE self){
 
 static VALUE model_solver(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
   return INT2FIX(model->param.solver_type);
 }
 
 
 static VALUE model_weights(VALUE self){
   struct model *model;
-  Data_Get_Struct(self, struct model, model);
+  TypedData_Get_Struct(self, struct model, &model_type, model);
 
   int n;
   if(model->bias>=0){
@@ -258,157 +722,465 @@ static void problem_free(void *p) {
   struct problem * pr = (struct problem*)p;
 
   free(pr->y);
+  free(pr->W);
+  free(pr->x);
   free(pr->base);
+  free(pr->x_float);
+  free(pr->base_float);
+  free(pr->x_binary);
+  free(pr->base_binary);
+  free(pr->row_start);
+  free(pr->csr_index);
+  free(pr->csr_value);
+  free(pr->packed_value);
+  free(pr->packed_index);
+  free(pr->index_start);
   free(pr);
 }
 
+/* the storage option :auto: STORAGE_BINARY if every value is 1, STORAGE_DOUBLE otherwise */
+#define STORAGE_AUTO -1
+
+/* reads the options hash of Problem.new and Problem.load_file. Returns the storage */
+static int problem_options(VALUE options, VALUE *weights){
+  *weights = Qnil;
+  if(NIL_P(options)){
+    return STORAGE_DOUBLE;
+  }
+  Check_Type(options, T_HASH);
+  rb_funcall(mRubyLinear, rb_intern("validate_problem_options"), 1, options);
+  *weights = rb_hash_aref(options, ID2SYM(rb_intern("weights")));
+  VALUE storage = rb_hash_aref(options, ID2SYM(rb_intern("storage")));
+  if(storage == ID2SYM(rb_intern("float"))){
+    return STORAGE_FLOAT;
+  }
+  if(storage == ID2SYM(rb_intern("binary"))){
+    return STORAGE_BINARY;
+  }
+  if(storage == ID2SYM(rb_intern("csr"))){
+    return STORAGE_CSR;
+  }
+  if(storage == ID2SYM(rb_intern("compressed"))){
+    return STORAGE_COMPRESSED;
+  }
+  if(storage == ID2SYM(rb_intern("auto"))){
+    return STORAGE_AUTO;
+  }
+  return STORAGE_DOUBLE;
+}
+
+static void binary_storage_error(const char *where, int i){
+  rb_raise(rb_eArgError, "binary storage needs all the values to be 1 (%s %d)", where, i);
+}
+
+/* binary storage has no room for a bias node whose value is not 1 */
+static void check_binary_bias(bool bias_node, double bias){
+  if(bias_node && bias != 1){
+    rb_raise(rb_eArgError, "binary storage needs a bias of 1 or no bias");
+  }
+}
+
+static bool samples_are_binary(VALUE samples){
+  ID values = rb_intern("values");
+  for(long i=0; i<RARRAY_LEN(samples); i++){
+    VALUE sample_values = rb_funcall(RARRAY_PTR(samples)[i], values, 0);
+    for(long j=0; j<RARRAY_LEN(sample_values); j++){
+      if(RFLOAT_VALUE(rb_to_float(RARRAY_PTR(sample_values)[j])) != 1){
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* allocates the rows of problem->l instances with nnz feature nodes in all, plus their
+   terminators if the storage has them. Returns the number of nodes allocated */
+static long problem_alloc_nodes(struct problem *problem, long nnz){
+  long count = nnz + problem->l;
+  switch(problem->storage){
+    case STORAGE_FLOAT:
+      problem->x_float = (struct feature_node_float **)calloc(sizeof(struct feature_node_float *), problem->l);
+      problem->base_float = (struct feature_node_float *)calloc(sizeof(struct feature_node_float), count);
+      break;
+    case STORAGE_BINARY:
+      problem->x_binary = (int **)calloc(sizeof(int *), problem->l);
+      problem->base_binary = (int *)calloc(sizeof(int), count);
+      break;
+    case STORAGE_CSR:
+      count = nnz;
+      problem->row_start = (long *)calloc(sizeof(long), problem->l + 1);
+      problem->row_end = problem->row_start + 1;
+      problem->csr_index = (int *)calloc(sizeof(int), count);
+      problem->csr_value = (double *)calloc(sizeof(double), count);
+      break;
+    case STORAGE_COMPRESSED:
+      /* most index deltas fit in a byte, packed_index grows if they don't */
+      count = nnz;
+      problem->row_start = (long *)calloc(sizeof(long), problem->l + 1);
+      problem->row_end = problem->row_start + 1;
+      problem->index_start = (long *)calloc(sizeof(long), problem->l + 1);
+      problem->packed_value = (float *)calloc(sizeof(float), count);
+      problem->packed_capacity = count + 16;
+      problem->packed_index = (unsigned char *)malloc(problem->packed_capacity);
+      problem->packed_size = 0;
+      break;
+    default:
+      problem->x = (struct feature_node **)calloc(sizeof(struct feature_node *), problem->l);
+      problem->base = (struct feature_node *)calloc(sizeof(struct feature_node), count);
+  }
+  return count;
+}
+
+/* instance i starts at node j */
+static void problem_set_row(struct problem *problem, int i, long j){
+  switch(problem->storage){
+    case STORAGE_FLOAT:
+      problem->x_float[i] = problem->base_float + j;
+      break;
+    case STORAGE_BINARY:
+      problem->x_binary[i] = problem->base_binary + j;
+      break;
+    case STORAGE_CSR:
+      problem->row_start[i] = j;
+      break;
+    case STORAGE_COMPRESSED:
+      problem->row_start[i] = j;
+      problem->index_start[i] = problem->packed_size;
+      problem->packed_last_index = 0;
+      break;
+    default:
+      problem->x[i] = problem->base + j;
+  }
+}
+
+/* appends index to the indices of the current row of a compressed problem, as the varint
+   of its difference with the previous index */
+static void problem_pack_index(struct problem *problem, int index){
+  if(index <= problem->packed_last_index){
+    rb_raise(rb_eArgError, "compressed storage needs increasing feature indices (feature %d)", index);
+  }
+  unsigned int delta = (unsigned int)(index - problem->packed_last_index);
+  problem->packed_last_index = index;
+  if(problem->packed_size + 5 > problem->packed_capacity){
+    problem->packed_capacity = 2 * problem->packed_capacity + 5;
+    problem->packed_index = (unsigned char *)realloc(problem->packed_index, problem->packed_capacity);
+  }
+  while(delta >= 0x80){
+    problem->packed_index[problem->packed_size++] = (unsigned char)(delta & 0x7f) | 0x80;
+    delta >>= 7;
+  }
+  problem->packed_index[problem->packed_size++] = (unsigned char)delta;
+}
+
+/* the value of the nodes of binary problems is always 1. Compressed problems need the
+   nodes of each row in increasing index order */
+static void problem_set_node(struct problem *problem, long j, int index, double value){
+  switch(problem->storage){
+    case STORAGE_FLOAT:
+      problem->base_float[j].index = index;
+      problem->base_float[j].value = (float)value;
+      break;
+    case STORAGE_BINARY:
+      problem->base_binary[j] = index;
+      break;
+    case STORAGE_CSR:
+      problem->csr_index[j] = index;
+      problem->csr_value[j] = value;
+      break;
+    case STORAGE_COMPRESSED:
+      problem_pack_index(problem, index);
+      problem->packed_value[j] = (float)value;
+      break;
+    default:
+      problem->base[j].index = index;
+      problem->base[j].value = value;
+  }
+}
+
+static void problem_set_node_index(struct problem *problem, long j, int index){
+  switch(problem->storage){
+    case STORAGE_FLOAT:
+      problem->base_float[j].index = index;
+      break;
+    case STORAGE_BINARY:
+      problem->base_binary[j] = index;
+      break;
+    case STORAGE_CSR:
+      problem->csr_index[j] = index;
+      break;
+    default:
+      problem->base[j].index = index;
+  }
+}
+
+/* instance i ends before node j. Returns the position of the next instance */
+static long problem_end_row(struct problem *problem, int i, long j){
+  if(problem->storage == STORAGE_CSR || problem->storage == STORAGE_COMPRESSED){
+    problem->row_end[i] = j;
+    return j;
+  }
+  problem_set_node_index(problem, j, -1);
+  return j+1;
+}
+
+/* called once all the rows are set */
+static void problem_finish_nodes(struct problem *problem){
+  if(problem->storage == STORAGE_COMPRESSED){
+    problem->index_start[problem->l] = problem->packed_size;
+    problem->packed_capacity = problem->packed_size;
+    problem->packed_index = (unsigned char *)realloc(problem->packed_index, problem->packed_size > 0 ? problem->packed_size : 1);
+  }
+}
+
 void exit_input_error(int line_num)
 {
   rb_raise(rb_eArgError, "Wrong input format at line %d\n", line_num);
 }
 
-static char *line = NULL;
-static int max_line_len;
+/* rubylinear addition: reads the lines of a file into a buffer of its own, so that several
+   files can be read at once, on several threads and without the GVL */
+struct line_reader {
+  FILE *fp;
+  char *line;
+  int max_line_len;
+};
+
+/* returns false, with errno set, if the file cannot be opened */
+static bool line_reader_open(struct line_reader *reader, const char *path){
+  reader->fp = fopen(path, "r");
+  reader->line = NULL;
+  reader->max_line_len = 0;
+  return reader->fp != NULL;
+}
+
+static void line_reader_close(struct line_reader *reader){
+  fclose(reader->fp);
+  free(reader->line);
+  reader->fp = NULL;
+  reader->line = NULL;
+}
 
-static char* readline(FILE *input)
+static char* readline(struct line_reader *reader)
 {
+  if(reader->line == NULL){
+    reader->max_line_len = 1024;
+    reader->line = (char*)calloc(sizeof(char),reader->max_line_len);
+  }
   int len;
   
-  if(fgets(line,max_line_len,input) == NULL)
+  if(fgets(reader->line,reader->max_line_len,reader->fp) == NULL)
     return NULL;
 
-  while(strrchr(line,'\n') == NULL)
+  while(strrchr(reader->line,'\n') == NULL)
   {
-    max_line_len *= 2;
-    line = (char *) realloc(line,max_line_len);
-    len = (int) strlen(line);
-    if(fgets(line+len,max_line_len-len,input) == NULL)
+    reader->max_line_len *= 2;
+    reader->line = (char *) realloc(reader->line,reader->max_line_len);
+    len = (int) strlen(reader->line);
+    if(fgets(reader->line+len,reader->max_line_len-len,reader->fp) == NULL)
       break;
   }
-  return line;
+  return reader->line;
 }
 
-static VALUE problem_load_file(VALUE klass, VALUE path, VALUE bias){
-  path = rb_str_to_str(path);
+/* how loading a problem ended. The errors are raised once the GVL is held again */
+enum { LOAD_OK, LOAD_OPEN_FAILED, LOAD_INPUT_ERROR, LOAD_BINARY_VALUE, LOAD_BINARY_BIAS, LOAD_INTERRUPTED };
+
+struct load_problem_args {
+  const char *path;
+  struct problem *prob;  /* with its bias set */
+  int storage;
+  bool has_weights;
+  volatile int interrupted;  /* set by an interrupt of the loading thread */
+  int status;
+  int error;  /* the errno of LOAD_OPEN_FAILED, the line of the other errors */
+};
+
+/* the two passes over the file of problem_load_file: the first counts the samples and the
+   nodes, the second fills them in. Only touches args, so it runs without the GVL */
+static int parse_problem(struct line_reader *reader, struct load_problem_args *args){
   /* lifted from train.c*/
+  struct problem *prob = args->prob;
+  int storage = args->storage;
   int max_index, inst_max_index, i;
   long int elements, j;
-  FILE *fp = fopen(rb_string_value_cstr(&path),"r");
-  char *endptr;
-  char *idx, *val, *label;
-
-  if(fp == NULL)
-  {
-    rb_sys_fail("can't open input file");
-    return Qnil;
-  }
+  char *endptr, *saveptr;
+  char *idx, *val, *label, *weight;
 
-  struct problem *prob = (struct problem*) calloc(1, sizeof(struct problem));
-  VALUE tdata = Data_Wrap_Struct(klass, 0, problem_free, prob);
-  prob->bias = RFLOAT_VALUE(rb_to_float(bias));
   prob->l = 0;
   elements = 0;
-  max_line_len = 1024;
-  line = (char*)calloc(sizeof(char),max_line_len);
-  while(readline(fp)!=NULL)
+  max_index = 0;
+  bool all_binary = true;
+  while(readline(reader)!=NULL)
   {
-    char *p = strtok(line," \t"); // label
+    if(args->interrupted)
+      return LOAD_INTERRUPTED;
+    char *p = strtok_r(reader->line," \t",&saveptr); // label
 
     // features
     while(1)
     {
-      p = strtok(NULL," \t");
+      p = strtok_r(NULL," \t",&saveptr);
       if(p == NULL || *p == '\n') // check '\n' as ' ' may be after the last feature
         break;
       elements++;
+      char *colon = strchr(p, ':');
+      if(colon == NULL)
+        continue;
+      /* the index of the bias node must be known before the rows are written */
+      int index = (int) strtol(p, NULL, 10);
+      if(index > max_index)
+        max_index = index;
+      if(storage == STORAGE_AUTO && all_binary && strtod(colon+1, NULL) != 1)
+        all_binary = false;
     }
     elements++; // for bias term
     prob->l++;
   }
-  rewind(fp);
+  rewind(reader->fp);
 
+  if(storage == STORAGE_AUTO)
+    storage = all_binary && (prob->bias < 0 || prob->bias == 1) ? STORAGE_BINARY : STORAGE_DOUBLE;
+  prob->storage = storage;
+  if(storage == STORAGE_BINARY && prob->bias >= 0 && prob->bias != 1)
+    return LOAD_BINARY_BIAS;
 
   prob->y = (int*)calloc(sizeof(int),prob->l);
-  prob->x = (struct feature_node **)calloc(sizeof(struct feature_node *),prob->l);
-  prob->base = (struct feature_node *)calloc(sizeof(struct feature_node),elements + prob->l);
+  if(args->has_weights)
+    prob->W = (double*)calloc(sizeof(double),prob->l);
+  prob->n = prob->bias >= 0 ? max_index+1 : max_index;
+  problem_alloc_nodes(prob, elements);
 
-  max_index = 0;
   j=0;
   for(i=0;i<prob->l;i++)
   {
+    if(args->interrupted)
+      return LOAD_INTERRUPTED;
+    args->error = i+1;
     inst_max_index = 0; // strtol gives 0 if wrong format
-    readline(fp);
-    prob->x[i] = &prob->base[j];
-    label = strtok(line," \t\n");
-    if(label == NULL){ // empty line
-      exit_input_error(i+1);
-      fclose(fp);
-      return Qnil;
-    }
+    if(readline(reader) == NULL) // the file changed since the first pass
+      return LOAD_INPUT_ERROR;
+    problem_set_row(prob, i, j);
+    label = strtok_r(reader->line," \t\n",&saveptr);
+    if(label == NULL) // empty line
+      return LOAD_INPUT_ERROR;
     prob->y[i] = (int) strtol(label,&endptr,10);
-    if(endptr == label || *endptr != '\0'){
-      exit_input_error(i+1);
-      fclose(fp);
-      return Qnil;
+    if(endptr == label || *endptr != '\0')
+      return LOAD_INPUT_ERROR;
+    if(args->has_weights){
+      weight = strtok_r(NULL," \t\n",&saveptr);
+      if(weight == NULL)
+        return LOAD_INPUT_ERROR;
+      errno = 0;
+      prob->W[i] = strtod(weight,&endptr);
+      if(endptr == weight || errno != 0 || *endptr != '\0' || prob->W[i] <= 0)
+        return LOAD_INPUT_ERROR;
     }
     while(1)
     {
-      idx = strtok(NULL,":");
-      val = strtok(NULL," \t");
+      idx = strtok_r(NULL,":",&saveptr);
+      val = strtok_r(NULL," \t",&saveptr);
 
       if(val == NULL)
         break;
 
+      /* the indices are checked to increase, so problem_set_node never raises */
       errno = 0;
-      prob->base[j].index = (int) strtol(idx,&endptr,10);
-      if(endptr == idx || errno != 0 || *endptr != '\0' || prob->base[j].index <= inst_max_index){
-        exit_input_error(i+1);
-        fclose(fp);
-        return Qnil;
-      }
+      int index = (int) strtol(idx,&endptr,10);
+      if(endptr == idx || errno != 0 || *endptr != '\0' || index <= inst_max_index)
+        return LOAD_INPUT_ERROR;
       else
-        inst_max_index = prob->base[j].index;
+        inst_max_index = index;
 
       errno = 0;
-      prob->base[j].value = strtod(val,&endptr);
-      if(endptr == val || errno != 0 || (*endptr != '\0' && !isspace(*endptr))){
-        exit_input_error(i+1);
-        fclose(fp);
-        return Qnil;
-      }
+      double value = strtod(val,&endptr);
+      if(endptr == val || errno != 0 || (*endptr != '\0' && !isspace(*endptr)))
+        return LOAD_INPUT_ERROR;
+      if(storage == STORAGE_BINARY && value != 1)
+        return LOAD_BINARY_VALUE;
 
-      ++j;
+      problem_set_node(prob, j++, index, value);
     }
 
-    if(inst_max_index > max_index)
-      max_index = inst_max_index;
-
     if(prob->bias >= 0)
-      prob->base[j++].value = prob->bias;
+      problem_set_node(prob, j++, prob->n, prob->bias);
 
-    prob->base[j++].index = -1;
+    j = problem_end_row(prob, i, j);
   }
+  problem_finish_nodes(prob);
+  return LOAD_OK;
+}
 
-  if(prob->bias >= 0)
-  {
-    prob->n=max_index+1;
-    for(i=1;i<prob->l;i++)
-      (prob->x[i]-2)->index = prob->n; 
-    prob->base[j-2].index = prob->n;
+static void *load_problem_without_gvl(void *p){
+  struct load_problem_args *args = (struct load_problem_args *)p;
+  struct line_reader reader;
+  if(!line_reader_open(&reader, args->path)){
+    args->error = errno;
+    args->status = LOAD_OPEN_FAILED;
+    return NULL;
   }
-  else
-    prob->n=max_index;
+  args->status = parse_problem(&reader, args);
+  line_reader_close(&reader);
+  return NULL;
+}
 
-  fclose(fp);
+static void interrupt_load(void *p){
+  ((struct load_problem_args *)p)->interrupted = 1;
+}
+
+/* Problem.load_file(path, bias, options = {}), private: with options[:weights] each line is
+   label weight index:value ... and options[:storage] is :double (the default), :float,
+   :binary, :csr, :compressed or :auto. The file is read without the GVL, so that other
+   threads keep running and several files can be loaded at once. RubyLinear::Problem.load_file
+   calls it, on a thread of its own when a Fiber scheduler runs the calling fiber */
+static VALUE problem_load_file(int argc, VALUE *argv, VALUE klass){
+  VALUE path, bias, options, r_weights;
+  rb_scan_args(argc, argv, "21", &path, &bias, &options);
+  struct load_problem_args args;
+  args.storage = problem_options(options, &r_weights);
+  args.has_weights = RTEST(r_weights);
+  /* a copy that other threads cannot change while the file is read */
+  path = rb_str_dup(rb_str_to_str(path));
+  args.path = rb_string_value_cstr(&path);
+  double r_bias = RFLOAT_VALUE(rb_to_float(bias));
+
+  /* the problem is wrapped before loading, so that the garbage collector frees it if an
+     interrupt is raised. An interrupt that does not raise starts the loading over */
+  VALUE tdata;
+  do{
+    struct problem *prob = (struct problem*) calloc(1, sizeof(struct problem));
+    tdata = Data_Wrap_Struct(klass, 0, problem_free, prob);
+    prob->bias = r_bias;
+    args.prob = prob;
+    args.interrupted = 0;
+#ifdef HAVE_RUBY_THREAD_H
+    rb_thread_call_without_gvl(load_problem_without_gvl, &args, interrupt_load, &args);
+#else
+    load_problem_without_gvl(&args);
+#endif
+  }while(args.status == LOAD_INTERRUPTED);
+  RB_GC_GUARD(path);
+
+  switch(args.status){
+    case LOAD_OPEN_FAILED:
+      rb_syserr_fail(args.error, "can't open input file");
+      break;
+    case LOAD_INPUT_ERROR:
+      exit_input_error(args.error);
+      break;
+    case LOAD_BINARY_VALUE:
+      binary_storage_error("line", args.error);
+      break;
+    case LOAD_BINARY_BIAS:
+      check_binary_bias(true, r_bias);
+      break;
+  }
   return tdata;
 }
 
-static VALUE problem_new(VALUE klass, VALUE labels, VALUE samples, VALUE bias, VALUE attr_count){
-  VALUE argv[4] = {labels, samples,bias,attr_count};
-  
+static VALUE problem_new(int argc, VALUE *argv, VALUE klass){
   struct problem  *ptr = (struct problem *)calloc(sizeof(struct problem),1);
   VALUE tdata = Data_Wrap_Struct(klass, 0, problem_free, ptr);
-  rb_obj_call_init(tdata, 4, argv);
+  rb_obj_call_init(tdata, argc, argv);
   return tdata;
 }
 
@@ -430,6 +1202,36 @@ static VALUE problem_labels(VALUE self){
 
 }
 
+static VALUE problem_weights(VALUE self){
+  struct problem *problem;
+  Data_Get_Struct(self, struct problem, problem);
+  if(!problem->W){
+    return Qnil;
+  }
+  VALUE result = rb_ary_new2(problem->l);
+  for( int i=0; i< problem -> l; i++){
+    rb_ary_push(result, rb_float_new(problem->W[i]));
+  }
+  return result;
+}
+
+static VALUE problem_storage(VALUE self){
+  struct problem *problem;
+  Data_Get_Struct(self, struct problem, problem);
+  switch(problem->storage){
+    case STORAGE_FLOAT:
+      return ID2SYM(rb_intern("float"));
+    case STORAGE_BINARY:
+      return ID2SYM(rb_intern("binary"));
+    case STORAGE_CSR:
+      return ID2SYM(rb_intern("csr"));
+    case STORAGE_COMPRESSED:
+      return ID2SYM(rb_intern("compressed"));
+    default:
+      return ID2SYM(rb_intern("double"));
+  }
+}
+
 static VALUE problem_feature_vector(VALUE self, VALUE r_index){
   if(RTEST(rb_funcall(self, rb_intern("destroyed?"),0))){
     rb_raise(rb_eArgError, "problem has been destroyed");
@@ -446,12 +1248,16 @@ static VALUE problem_feature_vector(VALUE self, VALUE r_index){
   }
   VALUE result = rb_ary_new();
   
-  for( struct feature_node *current = problem->x[index];current->index != -1; current++){
+  int nnz = instance_nnz(problem, index);
+  struct feature_node *x = (struct feature_node *)malloc(sizeof(struct feature_node) * (nnz + 1));
+  get_instance(problem, index, x);
+  for( int j = 0; j < nnz; j++){
     VALUE pair = rb_ary_new();
-    rb_ary_push(pair, INT2FIX(current->index));
-    rb_ary_push(pair, rb_float_new(current->value));
+    rb_ary_push(pair, INT2FIX(x[j].index));
+    rb_ary_push(pair, rb_float_new(x[j].value));
     rb_ary_push(result, pair);
   }
+  free(x);
   return result;
 }
 
@@ -459,15 +1265,31 @@ static VALUE problem_feature_vector(VALUE self, VALUE r_index){
 static VALUE problem_destroy(VALUE self){  
   struct problem *problem;
   Data_Get_Struct(self, struct problem, problem);
+  if(problem->nr_training > 0){
+    rb_raise(rb_eRuntimeError, "problem is being used by a training");
+    return Qnil;
+  }
   free(problem->base);
   problem->base = NULL;
+  free(problem->base_float);
+  problem->base_float = NULL;
+  free(problem->base_binary);
+  problem->base_binary = NULL;
+  free(problem->csr_index);
+  problem->csr_index = NULL;
+  free(problem->csr_value);
+  problem->csr_value = NULL;
+  free(problem->packed_value);
+  problem->packed_value = NULL;
+  free(problem->packed_index);
+  problem->packed_index = NULL;
   return self;
 }
 
 static VALUE problem_destroyed(VALUE self){  
   struct problem *problem;
   Data_Get_Struct(self, struct problem, problem);
-  return problem->base ? Qfalse : Qtrue;
+  return problem_disposed(problem) ? Qtrue : Qfalse;
 }
 
 
@@ -501,8 +1323,7 @@ static void addSample(struct problem * problem, int label, double weight){
   if(label > problem->n){
     rb_raise(rb_eArgError, "tried to add sample %d, %f, inconsistent with max feature of %d", label, weight, problem->n);
   }
-  problem->base[problem->offset].index = label;
-  problem->base[problem->offset].value = weight;
+  problem_set_node(problem, problem->offset, label, weight);
   problem->offset++;
 }
 static VALUE addSampleIterator(VALUE yielded_object, VALUE context, int argc, VALUE argv[]){
@@ -513,14 +1334,23 @@ static VALUE addSampleIterator(VALUE yielded_object, VALUE context, int argc, VA
   
   int label = FIX2INT(key);
   double weight = RFLOAT_VALUE(rb_to_float(value));
+  if(problem->storage == STORAGE_BINARY && weight != 1){
+    binary_storage_error("feature", label);
+  }
   addSample(problem, label, weight);
   return Qnil;
 }
 
 
-static VALUE problem_init(VALUE self, VALUE labels, VALUE samples, VALUE bias, VALUE r_attr_count){
+/* Problem.new(labels, samples, bias, max_feature, options = {}): options[:weights] is an
+   array of instance weights and options[:storage] is :double (the default), :float, :binary,
+   :csr, :compressed or :auto */
+static VALUE problem_init(int argc, VALUE *argv, VALUE self){
+  VALUE labels, samples, bias, r_attr_count, options, weights;
+  rb_scan_args(argc, argv, "41", &labels, &samples, &bias, &r_attr_count, &options);
   struct problem *problem;
   Data_Get_Struct(self, struct problem, problem);
+  int storage = problem_options(options, &weights);
   
   labels = rb_check_array_type(labels);
   samples = rb_check_array_type(samples);
@@ -535,53 +1365,532 @@ static VALUE problem_init(VALUE self, VALUE labels, VALUE samples, VALUE bias, V
     rb_raise(rb_eArgError, "samples and labels were of different length (%lu, %lu)", RARRAY_LEN(labels), RARRAY_LEN(samples));
     return Qnil;
   }
+  if(!NIL_P(weights)){
+    weights = rb_check_array_type(weights);
+    if(RARRAY_LEN(weights) != RARRAY_LEN(samples)){
+      rb_raise(rb_eArgError, "samples and weights were of different length (%lu, %lu)", RARRAY_LEN(weights), RARRAY_LEN(samples));
+      return Qnil;
+    }
+    for(int i=0; i<RARRAY_LEN(weights); i++){
+      if(RFLOAT_VALUE(rb_to_float(RARRAY_PTR(weights)[i])) <= 0){
+        rb_raise(rb_eArgError, "weight of sample %d is not positive", i);
+        return Qnil;
+      }
+    }
+  }
   problem->l = RARRAY_LEN(samples);
   problem->y = (int*)calloc(sizeof(int), problem->l);
+  if(!NIL_P(weights)){
+    problem->W = (double*)calloc(sizeof(double), problem->l);
+    for(int i=0; i<problem->l; i++){
+      problem->W[i] = RFLOAT_VALUE(rb_to_float(RARRAY_PTR(weights)[i]));
+    }
+  }
 
   
   /* copy the y values  and calculate how many samples to allocate*/
   int required_feature_nodes = 0;
-  int extra_samples = problem->bias > 0 ? 2 : 1; /*always 1 (the sentinel element, and possibly +1 for bias)*/
+  int extra_samples = problem->bias > 0 ? 1 : 0; /*+1 for bias, the terminators are added by problem_alloc_nodes*/
   for(int i=0; i<problem->l; i++){
     VALUE hash = RARRAY_PTR(samples)[i];
     problem->y[i] = FIX2INT(RARRAY_PTR(labels)[i]);
     required_feature_nodes += RHASH_SIZE(hash) + extra_samples; 
   }
   
+  if(storage == STORAGE_AUTO){
+    storage = (problem->bias <= 0 || problem->bias == 1) && samples_are_binary(samples) ? STORAGE_BINARY : STORAGE_DOUBLE;
+  }
+  if(storage == STORAGE_BINARY){
+    check_binary_bias(problem->bias > 0, problem->bias);
+  }
+  problem->storage = storage;
+
   problem->offset = 0;
-  problem->base = (struct feature_node *)calloc(sizeof(struct feature_node), required_feature_nodes);
-  problem->x = (struct feature_node **)calloc(sizeof(struct feature_node*), problem->l);
+  long allocated_feature_nodes = problem_alloc_nodes(problem, required_feature_nodes);
   /* copy the samples */
 
   ID each = rb_intern("each");
+  ID sort = rb_intern("sort");
   for(int i=0; i< problem->l; i++){
     VALUE hash = RARRAY_PTR(samples)[i];
-    problem->x[i] = problem->base + problem->offset;
-    rb_block_call(hash, each,0,NULL, RUBY_METHOD_FUNC(addSampleIterator),self);
+    problem_set_row(problem, i, problem->offset);
+    /* the deltas between the indices of compressed rows must be positive */
+    VALUE features = storage == STORAGE_COMPRESSED ? rb_funcall(hash, sort, 0) : hash;
+    rb_block_call(features, each,0,NULL, RUBY_METHOD_FUNC(addSampleIterator),self);
     if(problem->bias>0){
       addSample(problem,problem->n,problem->bias);
     }
-    addSample(problem,-1,-1);
+    problem->offset = problem_end_row(problem, i, problem->offset);
   }
-  if(problem->offset != required_feature_nodes){
-    printf("allocated %d feature_nodes but used %d\n", required_feature_nodes, problem->offset);
+  problem_finish_nodes(problem);
+  if(problem->offset != allocated_feature_nodes){
+    printf("allocated %ld feature_nodes but used %d\n", allocated_feature_nodes, problem->offset);
     
   }
   return self;
 }
 
-extern int info_on;
+static void block_problem_free(void *p) {
+  free_block_problem((struct block_problem *)p);
+}
 
-static VALUE info_on_get(VALUE self) {
-  return info_on ? Qtrue:Qfalse;
+/* BlockProblem.open(paths): the problem made of the block files written by
+   BlockProblem.write, in that order. Only the labels are read */
+static VALUE block_problem_open(VALUE klass, VALUE paths){
+  Check_Type(paths, T_ARRAY);
+  paths = rb_ary_dup(paths);
+  int nr_block = RARRAY_LEN(paths);
+  const char **block_file = (const char **)calloc(sizeof(char *), nr_block);
+  for(int i=0; i<nr_block; i++){
+    VALUE path = rb_str_to_str(RARRAY_PTR(paths)[i]);
+    rb_ary_store(paths, i, path);
+    block_file[i] = rb_string_value_cstr(&path);
+  }
+  struct block_problem *prob = open_block_problem(nr_block, block_file);
+  free(block_file);
+  if(!prob){
+    rb_raise(rb_eArgError, "could not read the blocks");
+    return Qnil;
+  }
+  return Data_Wrap_Struct(klass, 0, block_problem_free, prob);
 }
 
-static VALUE info_on_set(VALUE self, VALUE new_value){
-  info_on = RTEST(new_value) ? 1 : 0;
-  return new_value;
+/* appends the next block file of directory to paths */
+/* returns the errno of the failure, 0 on success */
+static int write_block_file(VALUE directory, VALUE paths, struct problem *block){
+  VALUE path = rb_sprintf("%s/block_%05ld.bin", rb_string_value_cstr(&directory), RARRAY_LEN(paths));
+  if(save_block(rb_string_value_cstr(&path), block) != 0){
+    return errno ? errno : EIO;
+  }
+  rb_ary_push(paths, path);
+  return 0;
+}
+
+/* BlockProblem.write(path, directory, bias, block_size, weights): splits a libsvm format file
+   into files of block_size samples in directory, reading it one block at a time.
+   Returns the paths of the blocks */
+static VALUE block_problem_write(VALUE klass, VALUE path, VALUE directory, VALUE r_bias, VALUE r_block_size, VALUE r_weights){
+  path = rb_str_to_str(path);
+  directory = rb_str_to_str(directory);
+  int block_size = NUM2INT(r_block_size);
+  bool has_weights = RTEST(r_weights);
+  if(block_size < 1){
+    rb_raise(rb_eArgError, "block size must be positive");
+    return Qnil;
+  }
+  struct line_reader reader;
+  if(!line_reader_open(&reader, rb_string_value_cstr(&path)))
+  {
+    rb_sys_fail("can't open input file");
+    return Qnil;
+  }
+
+  struct problem block;
+  memset(&block, 0, sizeof(block));
+  block.bias = RFLOAT_VALUE(rb_to_float(r_bias));
+  block.y = (int*)calloc(sizeof(int), block_size);
+  block.W = has_weights ? (double*)calloc(sizeof(double), block_size) : NULL;
+  block.x = (struct feature_node **)calloc(sizeof(struct feature_node *), block_size);
+  long *start = (long *)calloc(sizeof(long), block_size);
+  long capacity = 1024, j = 0;
+  block.base = (struct feature_node *)calloc(sizeof(struct feature_node), capacity);
+
+  VALUE paths = rb_ary_new();
+  int line_num = 0, error_line = 0, write_error = 0;
+  char *endptr, *saveptr, *idx, *val, *label, *weight;
+  while(!error_line && !write_error && readline(&reader) != NULL)
+  {
+    line_num++;
+    int inst_max_index = 0;
+    start[block.l] = j;
+    label = strtok_r(reader.line," \t\n",&saveptr);
+    if(label == NULL){
+      error_line = line_num;
+      break;
+    }
+    block.y[block.l] = (int) strtol(label,&endptr,10);
+    if(endptr == label || *endptr != '\0'){
+      error_line = line_num;
+      break;
+    }
+    if(has_weights){
+      weight = strtok_r(NULL," \t\n",&saveptr);
+      if(weight == NULL){
+        error_line = line_num;
+        break;
+      }
+      errno = 0;
+      block.W[block.l] = strtod(weight,&endptr);
+      if(endptr == weight || errno != 0 || *endptr != '\0' || block.W[block.l] <= 0){
+        error_line = line_num;
+        break;
+      }
+    }
+    while(1)
+    {
+      idx = strtok_r(NULL,":",&saveptr);
+      val = strtok_r(NULL," \t",&saveptr);
+      if(val == NULL)
+        break;
+
+      if(j+2 >= capacity){
+        capacity *= 2;
+        block.base = (struct feature_node *)realloc(block.base, sizeof(struct feature_node)*capacity);
+      }
+      errno = 0;
+      block.base[j].index = (int) strtol(idx,&endptr,10);
+      if(endptr == idx || errno != 0 || *endptr != '\0' || block.base[j].index <= inst_max_index){
+        error_line = line_num;
+        break;
+      }
+      inst_max_index = block.base[j].index;
+
+      errno = 0;
+      block.base[j].value = strtod(val,&endptr);
+      if(endptr == val || errno != 0 || (*endptr != '\0' && !isspace(*endptr))){
+        error_line = line_num;
+        break;
+      }
+      ++j;
+    }
+    if(error_line)
+      break;
+
+    if(j+2 >= capacity){
+      capacity *= 2;
+      block.base = (struct feature_node *)realloc(block.base, sizeof(struct feature_node)*capacity);
+    }
+    if(block.bias >= 0){
+      /* the index of the bias is set when the block is loaded */
+      block.base[j].index = 0;
+      block.base[j++].value = block.bias;
+    }
+    block.base[j++].index = -1;
+    block.l++;
+
+    if(block.l == block_size){
+      for(int i=0; i<block.l; i++)
+        block.x[i] = block.base + start[i];
+      write_error = write_block_file(directory, paths, &block);
+      block.l = 0;
+      j = 0;
+    }
+  }
+  line_reader_close(&reader);
+  if(!error_line && !write_error && block.l > 0){
+    for(int i=0; i<block.l; i++)
+      block.x[i] = block.base + start[i];
+    write_error = write_block_file(directory, paths, &block);
+  }
+
+  free(block.y);
+  free(block.W);
+  free(block.x);
+  free(block.base);
+  free(start);
+  if(error_line){
+    exit_input_error(error_line);
+  }
+  if(write_error){
+    rb_syserr_fail(write_error, rb_string_value_cstr(&directory));
+  }
+  return paths;
+}
+
+static VALUE block_problem_l(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  return INT2FIX(problem->l);
+}
+
+static VALUE block_problem_n(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  return INT2FIX(problem->n);
+}
+
+static VALUE block_problem_bias(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  return rb_float_new(problem->bias);
+}
+
+static VALUE block_problem_block_count(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  return INT2FIX(problem->nr_block);
+}
+
+static VALUE block_problem_labels(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  VALUE result = rb_ary_new2(problem->l);
+  for( int i=0; i< problem -> l; i++){
+    rb_ary_push(result, INT2FIX(problem->y[i]));
+  }
+  return result;
+}
+
+static VALUE block_problem_inspect(VALUE self){
+  struct block_problem *problem;
+  Data_Get_Struct(self, struct block_problem, problem);
+  return rb_sprintf("#<RubyLinear::BlockProblem:%p samples:%d features:%d bias:%f blocks:%d>",(void*)self,problem->l, problem->n,problem->bias,problem->nr_block);
+}
+
+struct cross_validation_grid_args {
+  struct problem *problem;
+  int nr_param;
+  struct parameter *params;
+  int nr_fold;
+  int nr_thread;
+  int *target;
+};
+
+static void *cross_validation_grid_without_gvl(void *p){
+  struct cross_validation_grid_args *args = (struct cross_validation_grid_args *)p;
+  cross_validation_grid(args->problem, args->nr_param, args->params, args->nr_fold, args->nr_thread, args->target);
+  return NULL;
+}
+
+static void cross_validation_grid_cleanup(void *p){
+  struct cross_validation_grid_args *args = (struct cross_validation_grid_args *)p;
+  for(int i=0; i < args->nr_param; i++){
+    destroy_param(&args->params[i]);
+  }
+  free(args->params);
+  free(args->target);
+}
+
+struct grid_parameters {
+  struct problem *problem;
+  VALUE r_params;
+  struct parameter *params;
+  int nr_parsed;  /* the params holding arrays to destroy */
+};
+
+/* parses and checks the hashes of r_params, under rb_protect so that the parameters already
+   parsed can be destroyed if one of them raises */
+static VALUE grid_parameters_from_hashes(VALUE p){
+  struct grid_parameters *parsed = (struct grid_parameters *)p;
+  for(long i=0; i < RARRAY_LEN(parsed->r_params); i++){
+    parameter_from_hash(RARRAY_PTR(parsed->r_params)[i], &parsed->params[i]);
+    parsed->nr_parsed++;
+    const char *error_string = check_parameter(parsed->problem, &parsed->params[i]);
+    if(error_string){
+      rb_raise(rb_eArgError, "%s", error_string);
+    }
+  }
+  return Qnil;
+}
+
+/* cross validates each hash of parameters in r_params on the same folds, training on
+   nr_thread threads. Returns the array of predicted labels for each hash of parameters.
+   The trainings share one context, without a log since they do not run on Ruby threads,
+   so that an interrupt cancels them all */
+static VALUE cross_validation_grid_rb(VALUE self, VALUE r_problem, VALUE r_params, VALUE r_folds, VALUE r_threads){
+  struct problem *problem;
+  Data_Get_Struct(r_problem, struct problem, problem);
+  
+  if(problem_disposed(problem)){
+    rb_raise(rb_eArgError, "problem has been disposed");
+    return Qnil;
+  }
+  r_params = rb_check_array_type(r_params);
+  if(NIL_P(r_params)){
+    rb_raise(rb_eArgError, "parameters must be an array");
+    return Qnil;
+  }
+  if(RARRAY_LEN(r_params) == 0){
+    rb_raise(rb_eArgError, "parameters must not be empty");
+    return Qnil;
+  }
+  int nr_fold = FIX2INT(r_folds);
+  if(nr_fold < 2 || nr_fold > problem->l){
+    rb_raise(rb_eArgError, "number of folds must be between 2 and the number of samples");
+    return Qnil;
+  }
+
+  struct cross_validation_grid_args args;
+  args.problem = problem;
+  args.nr_param = RARRAY_LEN(r_params);
+  args.nr_fold = nr_fold;
+  args.nr_thread = FIX2INT(r_threads);
+  args.params = (struct parameter *)calloc(args.nr_param, sizeof(struct parameter));
+
+  struct grid_parameters parsed = {problem, r_params, args.params, 0};
+  int state = 0;
+  rb_protect(grid_parameters_from_hashes, (VALUE)&parsed, &state);
+  if(state){
+    for(int i=0; i < parsed.nr_parsed; i++){
+      destroy_param(&args.params[i]);
+    }
+    free(args.params);
+    rb_jump_tag(state);
+  }
+
+  args.target = (int *)calloc((size_t)args.nr_param*problem->l, sizeof(int));
+  struct ruby_training training;
+  ruby_training_init(&training, Qnil, args.params, args.nr_param);
+  ruby_training_hold(&training, r_problem);
+  for(int i=0; i < args.nr_param; i++){
+    ruby_training_hold(&training, rb_hash_aref(RARRAY_PTR(r_params)[i], ID2SYM(rb_intern("validation"))));
+  }
+  ruby_training_run(&training, cross_validation_grid_without_gvl, cross_validation_grid_cleanup, &args);
+
+  VALUE result = rb_ary_new();
+  for(int i=0; i < args.nr_param; i++){
+    VALUE predictions = rb_ary_new();
+    for(int j=0; j < problem->l; j++){
+      rb_ary_push(predictions, INT2FIX(args.target[(size_t)i*problem->l+j]));
+    }
+    rb_ary_push(result, predictions);
+    destroy_param(&args.params[i]);
+  }
+  free(args.target);
+  free(args.params);
+  return result;
+}
+
+/* rubylinear addition: RubyLinear::Blas, to check and pick the kernels used by the BLAS
+   routines, and call those routines on arrays of floats */
+extern double dnrm2_(int *, double *, int *);
+extern double ddot_(int *, double *, int *, double *, int *);
+extern int daxpy_(int *, double *, double *, int *, double *, int *);
+extern int dscal_(int *, double *, double *, int *);
+
+static VALUE blas_kernels_rb(VALUE self){
+  const struct blas_kernels *kernels[4];
+  int count = blas_supported_kernels(kernels, 4);
+  VALUE result = rb_ary_new2(count);
+  for(int i=0; i<count; i++){
+    rb_ary_push(result, ID2SYM(rb_intern(kernels[i]->name)));
+  }
+  return result;
+}
+
+static VALUE blas_current_rb(VALUE self){
+  return ID2SYM(rb_intern(blas_kernels_in_use()->name));
+}
+
+static VALUE blas_use_rb(VALUE self, VALUE name){
+  if(blas_use_kernels(rb_id2name(SYM2ID(rb_to_symbol(name)))) != 0){
+    rb_raise(rb_eArgError, "Unsupported BLAS kernels: %s", RSTRING_PTR(rb_inspect(name)));
+  }
+  return name;
+}
+
+/* copies a ruby array of numbers into a malloced array of doubles */
+static double *blas_vector(VALUE array, int *n){
+  array = rb_check_array_type(array);
+  if(NIL_P(array)){
+    rb_raise(rb_eTypeError, "expected an array");
+  }
+  *n = (int)RARRAY_LEN(array);
+  double *v = (double *)malloc(sizeof(double) * (*n > 0 ? *n : 1));
+  for(int i=0; i<*n; i++){
+    v[i] = RFLOAT_VALUE(rb_to_float(RARRAY_PTR(array)[i]));
+  }
+  return v;
+}
+
+static VALUE blas_array(double *v, int n){
+  VALUE result = rb_ary_new2(n);
+  for(int i=0; i<n; i++){
+    rb_ary_push(result, rb_float_new(v[i]));
+  }
+  free(v);
+  return result;
+}
+
+static VALUE blas_ddot_rb(VALUE self, VALUE r_x, VALUE r_y){
+  int n, ny, inc = 1;
+  double *x = blas_vector(r_x, &n);
+  double *y = blas_vector(r_y, &ny);
+  double result = n == ny ? ddot_(&n, x, &inc, y, &inc) : 0;
+  free(x);
+  free(y);
+  if(n != ny){
+    rb_raise(rb_eArgError, "vectors of different length (%d, %d)", n, ny);
+  }
+  return rb_float_new(result);
+}
+
+/* returns a*x + y */
+static VALUE blas_daxpy_rb(VALUE self, VALUE r_a, VALUE r_x, VALUE r_y){
+  int n, ny, inc = 1;
+  double a = RFLOAT_VALUE(rb_to_float(r_a));
+  double *x = blas_vector(r_x, &n);
+  double *y = blas_vector(r_y, &ny);
+  if(n == ny){
+    daxpy_(&n, &a, x, &inc, y, &inc);
+  }
+  free(x);
+  if(n != ny){
+    free(y);
+    rb_raise(rb_eArgError, "vectors of different length (%d, %d)", n, ny);
+  }
+  return blas_array(y, ny);
+}
+
+static VALUE blas_dnrm2_rb(VALUE self, VALUE r_x){
+  int n, inc = 1;
+  double *x = blas_vector(r_x, &n);
+  double result = dnrm2_(&n, x, &inc);
+  free(x);
+  return rb_float_new(result);
+}
+
+/* returns a*x */
+static VALUE blas_dscal_rb(VALUE self, VALUE r_a, VALUE r_x){
+  int n, inc = 1;
+  double a = RFLOAT_VALUE(rb_to_float(r_a));
+  double *x = blas_vector(r_x, &n);
+  dscal_(&n, &a, x, &inc);
+  return blas_array(x, n);
+}
+
+static VALUE vector_math_kernels_rb(VALUE self){
+  const struct math_kernels *kernels[3];
+  int count = math_supported_kernels(kernels, 3);
+  VALUE result = rb_ary_new2(count);
+  for(int i=0; i<count; i++){
+    rb_ary_push(result, ID2SYM(rb_intern(kernels[i]->name)));
+  }
+  return result;
+}
+
+static VALUE vector_math_current_rb(VALUE self){
+  return ID2SYM(rb_intern(math_kernels_in_use()->name));
+}
+
+static VALUE vector_math_use_rb(VALUE self, VALUE name){
+  if(math_use_kernels(rb_id2name(SYM2ID(rb_to_symbol(name)))) != 0){
+    rb_raise(rb_eArgError, "Unsupported math kernels: %s", RSTRING_PTR(rb_inspect(name)));
+  }
+  return name;
+}
+
+static VALUE vector_math_exp_rb(VALUE self, VALUE r_x){
+  int n;
+  double *x = blas_vector(r_x, &n);
+  math_kernels_in_use()->exp(n, x, x);
+  return blas_array(x, n);
+}
+
+static VALUE vector_math_log1p_rb(VALUE self, VALUE r_x){
+  int n;
+  double *x = blas_vector(r_x, &n);
+  math_kernels_in_use()->log1p(n, x, x);
+  return blas_array(x, n);
 }
 
 void Init_rubylinear_native() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* the extension keeps no state of its own between calls: the module and classes below are
+     shareable, trainings and loads use buffers of their own, and the kernels are switched
+     atomically (see Blas.use) */
+  rb_ext_ractor_safe(true);
+#endif
   mRubyLinear = rb_define_module("RubyLinear");
   
   rb_define_const(mRubyLinear, "L2R_LR", INT2FIX(L2R_LR));
@@ -594,26 +1903,59 @@ void Init_rubylinear_native() {
   rb_define_const(mRubyLinear, "L2R_LR_DUAL", INT2FIX(L2R_LR_DUAL));
 
 
-  rb_define_singleton_method(mRubyLinear, "info_on", RUBY_METHOD_FUNC(info_on_get), 0);
-  rb_define_singleton_method(mRubyLinear, "info_on=", RUBY_METHOD_FUNC(info_on_set), 1);
+  rb_define_singleton_method(mRubyLinear, "cross_validation_grid", RUBY_METHOD_FUNC(cross_validation_grid_rb), 4);
+
+  blas_init_kernels();
+  mBlas = rb_define_module_under(mRubyLinear, "Blas");
+  rb_define_singleton_method(mBlas, "kernels", RUBY_METHOD_FUNC(blas_kernels_rb), 0);
+  rb_define_singleton_method(mBlas, "current", RUBY_METHOD_FUNC(blas_current_rb), 0);
+  rb_define_singleton_method(mBlas, "use", RUBY_METHOD_FUNC(blas_use_rb), 1);
+  rb_define_singleton_method(mBlas, "ddot", RUBY_METHOD_FUNC(blas_ddot_rb), 2);
+  rb_define_singleton_method(mBlas, "daxpy", RUBY_METHOD_FUNC(blas_daxpy_rb), 3);
+  rb_define_singleton_method(mBlas, "dnrm2", RUBY_METHOD_FUNC(blas_dnrm2_rb), 1);
+  rb_define_singleton_method(mBlas, "dscal", RUBY_METHOD_FUNC(blas_dscal_rb), 2);
+
+  math_init_kernels();
+  mVectorMath = rb_define_module_under(mRubyLinear, "VectorMath");
+  rb_define_singleton_method(mVectorMath, "kernels", RUBY_METHOD_FUNC(vector_math_kernels_rb), 0);
+  rb_define_singleton_method(mVectorMath, "current", RUBY_METHOD_FUNC(vector_math_current_rb), 0);
+  rb_define_singleton_method(mVectorMath, "use", RUBY_METHOD_FUNC(vector_math_use_rb), 1);
+  rb_define_singleton_method(mVectorMath, "exp", RUBY_METHOD_FUNC(vector_math_exp_rb), 1);
+  rb_define_singleton_method(mVectorMath, "log1p", RUBY_METHOD_FUNC(vector_math_log1p_rb), 1);
 
   
   cProblem = rb_define_class_under(mRubyLinear, "Problem", rb_cObject);
-  rb_define_singleton_method(cProblem, "new", RUBY_METHOD_FUNC(problem_new), 4);
-  rb_define_singleton_method(cProblem, "load_file", RUBY_METHOD_FUNC(problem_load_file),2);
-  rb_define_method(cProblem, "initialize", RUBY_METHOD_FUNC(problem_init), 4);
+  rb_undef_alloc_func(cProblem);
+  rb_define_singleton_method(cProblem, "new", RUBY_METHOD_FUNC(problem_new), -1);
+  rb_define_private_method(rb_singleton_class(cProblem), "load_file_native", RUBY_METHOD_FUNC(problem_load_file), -1);
+  rb_define_method(cProblem, "initialize", RUBY_METHOD_FUNC(problem_init), -1);
   rb_define_method(cProblem, "l", RUBY_METHOD_FUNC(problem_l), 0);
   rb_define_method(cProblem, "n", RUBY_METHOD_FUNC(problem_n), 0);
   rb_define_method(cProblem, "bias", RUBY_METHOD_FUNC(problem_bias), 0);
   rb_define_method(cProblem, "feature_vector", RUBY_METHOD_FUNC(problem_feature_vector), 1);
   rb_define_method(cProblem, "labels", RUBY_METHOD_FUNC(problem_labels), 0);
+  rb_define_method(cProblem, "weights", RUBY_METHOD_FUNC(problem_weights), 0);
+  rb_define_method(cProblem, "storage", RUBY_METHOD_FUNC(problem_storage), 0);
   rb_define_method(cProblem, "destroy!", RUBY_METHOD_FUNC(problem_destroy), 0);
   rb_define_method(cProblem, "destroyed?", RUBY_METHOD_FUNC(problem_destroyed), 0);
   rb_define_method(cProblem, "inspect", RUBY_METHOD_FUNC(problem_inspect), 0);
 
+  cBlockProblem = rb_define_class_under(mRubyLinear, "BlockProblem", rb_cObject);
+  rb_undef_alloc_func(cBlockProblem);
+  rb_define_singleton_method(cBlockProblem, "open", RUBY_METHOD_FUNC(block_problem_open), 1);
+  rb_define_singleton_method(cBlockProblem, "write", RUBY_METHOD_FUNC(block_problem_write), 5);
+  rb_define_method(cBlockProblem, "l", RUBY_METHOD_FUNC(block_problem_l), 0);
+  rb_define_method(cBlockProblem, "n", RUBY_METHOD_FUNC(block_problem_n), 0);
+  rb_define_method(cBlockProblem, "bias", RUBY_METHOD_FUNC(block_problem_bias), 0);
+  rb_define_method(cBlockProblem, "block_count", RUBY_METHOD_FUNC(block_problem_block_count), 0);
+  rb_define_method(cBlockProblem, "labels", RUBY_METHOD_FUNC(block_problem_labels), 0);
+  rb_define_method(cBlockProblem, "inspect", RUBY_METHOD_FUNC(block_problem_inspect), 0);
+
   cModel = rb_define_class_under(mRubyLinear, "Model", rb_cObject);
-  rb_define_singleton_method(cModel, "load_file", RUBY_METHOD_FUNC(model_load_file), 1);
+  rb_undef_alloc_func(cModel);
+  rb_define_private_method(rb_singleton_class(cModel), "load_file_native", RUBY_METHOD_FUNC(model_load_file), 1);
   rb_define_singleton_method(cModel, "new", RUBY_METHOD_FUNC(model_new), 2);
+  rb_define_singleton_method(cModel, "path", RUBY_METHOD_FUNC(model_path), 2);
   rb_define_method(cModel, "save", RUBY_METHOD_FUNC(model_write_file), 1);
   rb_define_method(cModel, "predict", RUBY_METHOD_FUNC(model_predict), 1);
   rb_define_method(cModel, "predict_values", RUBY_METHOD_FUNC(model_predict_values), 1);
@@ -627,6 +1969,11 @@ void Init_rubylinear_native() {
   rb_define_method(cModel, "feature_count", RUBY_METHOD_FUNC(model_feature_count), 0);
   rb_define_method(cModel, "class_count", RUBY_METHOD_FUNC(model_class_count), 0);
   rb_define_method(cModel, "bias", RUBY_METHOD_FUNC(model_class_bias), 0);
+  rb_define_method(cModel, "iterations", RUBY_METHOD_FUNC(model_iterations), 0);
+  rb_define_method(cModel, "stop_reason", RUBY_METHOD_FUNC(model_stop_reason), 0);
+  rb_define_method(cModel, "converged?", RUBY_METHOD_FUNC(model_converged), 0);
+  /* the statistics of the training ({:iterations, :cg_iterations, :time}), nil for a loaded model */
+  rb_define_attr(cModel, "training_stats", 1, 0);
 
 
 }
@@ -25,7 +25,21 @@ extern int dscal_(int *, double *, double *, int *);
 }
 #endif
 
-static void default_print(const char *buf)
+// u^T M v with M diagonal
+static double uTMv(int n, double *u, double *M, double *v)
+{
+	const int m = n-4;
+	double res = 0;
+	int i;
+	for (i=0; i<m; i += 5)
+		res += u[i]*M[i]*v[i] + u[i+1]*M[i+1]*v[i+1] + u[i+2]*M[i+2]*v[i+2] +
+			u[i+3]*M[i+3]*v[i+3] + u[i+4]*M[i+4]*v[i+4];
+	for (; i<n; i++)
+		res += u[i]*M[i]*v[i];
+	return res;
+}
+
+static void default_print(const char *buf, void *arg)
 {
 	fputs(buf,stdout);
 	fflush(stdout);
@@ -33,12 +47,14 @@ static void default_print(const char *buf)
 
 void TRON::info(const char *fmt,...)
 {
+	if (tron_print_string == NULL)
+		return;
 	char buf[BUFSIZ];
 	va_list ap;
 	va_start(ap,fmt);
-	vsprintf(buf,fmt,ap);
+	vsnprintf(buf,sizeof(buf),fmt,ap);
 	va_end(ap);
-	(*tron_print_string)(buf);
+	(*tron_print_string)(buf, tron_print_string_arg);
 }
 
 TRON::TRON(const function *fun_obj, double eps, int max_iter)
@@ -47,13 +63,19 @@ TRON::TRON(const function *fun_obj, double eps, int max_iter)
 	this->eps=eps;
 	this->max_iter=max_iter;
 	tron_print_string = default_print;
+	tron_print_string_arg = NULL;
+	tron_stop_check = NULL;
+	tron_stop_check_arg = NULL;
+	preconditioning = false;
+	total_cg_iter = 0;
+	max_iter_reached = false;
 }
 
 TRON::~TRON()
 {
 }
 
-void TRON::tron(double *w)
+int TRON::tron(double *w)
 {
 	// Parameters for updating the iterates.
 	double eta0 = 1e-4, eta1 = 0.25, eta2 = 0.75;
@@ -70,24 +92,62 @@ void TRON::tron(double *w)
 	double *r = new double[n];
 	double *w_new = new double[n];
 	double *g = new double[n];
+	double *M = preconditioning ? new double[n] : NULL;
 
+	// w holds the starting point: zero, or a previous solution when warm
+	// starting. The stopping condition is always relative to |g| at w=0.
+	double gnorm1;
+	bool warm_start = false;
 	for (i=0; i<n; i++)
-		w[i] = 0;
+		if (w[i] != 0)
+		{
+			warm_start = true;
+			break;
+		}
+	if (warm_start)
+	{
+		double *w0 = new double[n];
+		for (i=0; i<n; i++)
+			w0[i] = 0;
+		fun_obj->fun(w0);
+		fun_obj->grad(w0, g);
+		gnorm1 = dnrm2_(&n, g, &inc);
+		delete[] w0;
+	}
 
         f = fun_obj->fun(w);
 	fun_obj->grad(w, g);
-	delta = dnrm2_(&n, g, &inc);
-	double gnorm1 = delta;
-	double gnorm = gnorm1;
+	double gnorm = dnrm2_(&n, g, &inc);
+	if (!warm_start)
+		gnorm1 = gnorm;
+	delta = gnorm;
+	if (M != NULL)
+	{
+		get_preconditioner(M);
+		delta = sqrt(uTMv(n, g, M, g));
+	}
 
 	if (gnorm <= eps*gnorm1)
 		search = 0;
 
 	iter = 1;
+	total_cg_iter = 0;
+	max_iter_reached = false;
 
-	while (iter <= max_iter && search)
+	while (search)
 	{
-		cg_iter = trcg(delta, g, s, r);
+		// checked here rather than in the condition of the loop, so that a step that converges
+		// on the last iteration is not taken for running out of iterations
+		if (iter > max_iter)
+		{
+			max_iter_reached = true;
+			break;
+		}
+		if (M != NULL)
+			cg_iter = trpcg(delta, g, M, s, r);
+		else
+			cg_iter = trcg(delta, g, s, r);
+		total_cg_iter += cg_iter;
 
 		memcpy(w_new, w, sizeof(double)*n);
 		daxpy_(&n, &one, s, &inc, w_new, &inc);
@@ -100,7 +160,11 @@ void TRON::tron(double *w)
 	        actred = f - fnew;
 
 		// On the first iteration, adjust the initial step bound.
-		snorm = dnrm2_(&n, s, &inc);
+		// With the preconditioner, the trust region is in the norm of M
+		if (M != NULL)
+			snorm = sqrt(uTMv(n, s, M, s));
+		else
+			snorm = dnrm2_(&n, s, &inc);
 		if (iter == 1)
 			delta = min(delta, snorm);
 
@@ -128,10 +192,14 @@ void TRON::tron(double *w)
 			memcpy(w, w_new, sizeof(double)*n);
 			f = fnew;
 		        fun_obj->grad(w, g);
+			if (M != NULL)
+				get_preconditioner(M);
 
 			gnorm = dnrm2_(&n, g, &inc);
 			if (gnorm <= eps*gnorm1)
 				break;
+			if (tron_stop_check != NULL && (*tron_stop_check)(w, tron_stop_check_arg))
+				break;
 		}
 		if (f < -1.0e+32)
 		{
@@ -155,6 +223,18 @@ void TRON::tron(double *w)
 	delete[] r;
 	delete[] w_new;
 	delete[] s;
+	delete[] M;
+
+	return iter-1;
+}
+
+void TRON::get_preconditioner(double *M)
+{
+	const double alpha_pcg = 0.01;
+	int n = fun_obj->get_nr_variable();
+	fun_obj->get_diag_preconditioner(M);
+	for (int i=0; i<n; i++)
+		M[i] = (1-alpha_pcg) + alpha_pcg*M[i];
 }
 
 int TRON::trcg(double delta, double *g, double *s, double *r)
@@ -220,6 +300,76 @@ int TRON::trcg(double delta, double *g, double *s, double *r)
 	return(cg_iter);
 }
 
+// trcg for the problem scaled by the diagonal preconditioner M: the residual
+// is scaled by M^-1 and the trust region is ||s||_M <= delta
+int TRON::trpcg(double delta, double *g, double *M, double *s, double *r)
+{
+	int i, inc = 1;
+	int n = fun_obj->get_nr_variable();
+	double one = 1;
+	double *d = new double[n];
+	double *Hd = new double[n];
+	double *z = new double[n];
+	double zTr, znewTrnew, alpha, beta, cgtol;
+
+	for (i=0; i<n; i++)
+	{
+		s[i] = 0;
+		r[i] = -g[i];
+		z[i] = r[i]/M[i];
+		d[i] = z[i];
+	}
+
+	zTr = ddot_(&n, z, &inc, r, &inc);
+	cgtol = 0.1*sqrt(zTr);
+	int cg_iter = 0;
+	while (1)
+	{
+		if (sqrt(zTr) <= cgtol)
+			break;
+		cg_iter++;
+		fun_obj->Hv(d, Hd);
+
+		alpha = zTr/ddot_(&n, d, &inc, Hd, &inc);
+		daxpy_(&n, &alpha, d, &inc, s, &inc);
+		if (sqrt(uTMv(n, s, M, s)) > delta)
+		{
+			info("cg reaches trust region boundary\n");
+			alpha = -alpha;
+			daxpy_(&n, &alpha, d, &inc, s, &inc);
+
+			double sTMd = uTMv(n, s, M, d);
+			double sTMs = uTMv(n, s, M, s);
+			double dTMd = uTMv(n, d, M, d);
+			double dsq = delta*delta;
+			double rad = sqrt(sTMd*sTMd + dTMd*(dsq-sTMs));
+			if (sTMd >= 0)
+				alpha = (dsq - sTMs)/(sTMd + rad);
+			else
+				alpha = (rad - sTMd)/dTMd;
+			daxpy_(&n, &alpha, d, &inc, s, &inc);
+			alpha = -alpha;
+			daxpy_(&n, &alpha, Hd, &inc, r, &inc);
+			break;
+		}
+		alpha = -alpha;
+		daxpy_(&n, &alpha, Hd, &inc, r, &inc);
+		for (i=0; i<n; i++)
+			z[i] = r[i]/M[i];
+		znewTrnew = ddot_(&n, z, &inc, r, &inc);
+		beta = znewTrnew/zTr;
+		dscal_(&n, &beta, d, &inc);
+		daxpy_(&n, &one, z, &inc, d, &inc);
+		zTr = znewTrnew;
+	}
+
+	delete[] d;
+	delete[] Hd;
+	delete[] z;
+
+	return(cg_iter);
+}
+
 double TRON::norm_inf(int n, double *x)
 {
 	double dmax = fabs(x[0]);
@@ -229,7 +379,29 @@ double TRON::norm_inf(int n, double *x)
 	return(dmax);
 }
 
-void TRON::set_print_string(void (*print_string) (const char *buf))
+void TRON::set_print_string(void (*print_string) (const char *buf, void *arg), void *arg)
 {
 	tron_print_string = print_string;
+	tron_print_string_arg = arg;
+}
+
+void TRON::set_stop_check(bool (*stop_check) (double *w, void *arg), void *arg)
+{
+	tron_stop_check = stop_check;
+	tron_stop_check_arg = arg;
+}
+
+void TRON::set_preconditioning(bool preconditioning)
+{
+	this->preconditioning = preconditioning;
+}
+
+int TRON::get_cg_iter() const
+{
+	return total_cg_iter;
+}
+
+bool TRON::reached_max_iter() const
+{
+	return max_iter_reached;
 }
@@ -7,6 +7,8 @@ public:
 	virtual double fun(double *w) = 0 ;
 	virtual void grad(double *w, double *g) = 0 ;
 	virtual void Hv(double *s, double *Hs) = 0 ;
+	// rubylinear addition: the diagonal of the Hessian at the w of the last grad call
+	virtual void get_diag_preconditioner(double *M) = 0 ;
 
 	virtual int get_nr_variable(void) = 0 ;
 	virtual ~function(void){}
@@ -18,17 +20,37 @@ public:
 	TRON(const function *fun_obj, double eps = 0.1, int max_iter = 1000);
 	~TRON();
 
-	void tron(double *w);
-	void set_print_string(void (*i_print) (const char *buf));
+	int tron(double *w);
+	// rubylinear addition: print_string is called with arg, so that each optimization can log
+	// to its own place; NULL prints nothing
+	void set_print_string(void (*i_print) (const char *buf, void *arg), void *arg);
+	// stop_check is called with w after each accepted step; returning true ends the optimization
+	void set_stop_check(bool (*stop_check) (double *w, void *arg), void *arg);
+	// rubylinear addition: solve the subproblems with conjugate gradient preconditioned by
+	// (1-alpha) I + alpha diag(H), and a trust region in the norm it defines (liblinear 2.20)
+	void set_preconditioning(bool preconditioning);
+	// rubylinear addition: the conjugate gradient steps taken by the last call to tron
+	int get_cg_iter() const;
+	// rubylinear addition: whether the last call to tron stopped because it ran out of iterations
+	// rather than because it converged or was stopped
+	bool reached_max_iter() const;
 
 private:
 	int trcg(double delta, double *g, double *s, double *r);
+	int trpcg(double delta, double *g, double *M, double *s, double *r);
+	void get_preconditioner(double *M);
 	double norm_inf(int n, double *x);
 
 	double eps;
 	int max_iter;
 	function *fun_obj;
 	void info(const char *fmt,...);
-	void (*tron_print_string)(const char *buf);
+	void (*tron_print_string)(const char *buf, void *arg);
+	void *tron_print_string_arg;
+	bool (*tron_stop_check)(double *w, void *arg);
+	void *tron_stop_check_arg;
+	bool preconditioning;
+	int total_cg_iter;
+	bool max_iter_reached;
 };
 #endif
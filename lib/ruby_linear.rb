@@ -3,9 +3,125 @@ require 'rubylinear_native'
 module RubyLinear
   def self.validate_options(options)
     raise ArgumentError, "A solver must be specified" unless options[:solver]
-    unknown_keys = options.keys - [:c, :solver, :eps, :weights]
+    unknown_keys = options.keys - [:c, :solver, :eps, :weights, :validation, :patience, :validation_interval,
+                                   :max_iter, :max_newton_iter, :time_budget, :threads, :screening,
+                                   :preconditioning, :hessian_sample, :seed, :log]
     if unknown_keys.any?
       raise ArgumentError, "Unknown options: #{unknown_keys.inspect}"
     end
   end
-end
\ No newline at end of file
+
+  # Constants are made shareable so that models can be built and used in any Ractor
+  def self.shareable(value)
+    defined?(Ractor) ? Ractor.make_shareable(value) : value.freeze
+  end
+  private_class_method :shareable
+
+  STORAGES = shareable([:double, :float, :binary, :csr, :compressed, :auto])
+
+  def self.validate_problem_options(options)
+    unknown_keys = options.keys - [:weights, :storage]
+    if unknown_keys.any?
+      raise ArgumentError, "Unknown options: #{unknown_keys.inspect}"
+    end
+    if options[:storage] && !STORAGES.include?(options[:storage])
+      raise ArgumentError, "Unknown storage: #{options[:storage].inspect}"
+    end
+  end
+
+  # Yields on a thread of its own when the current fiber is run by a Fiber scheduler, which
+  # waits for that thread like for any other I/O: the native loaders release the GVL, so the
+  # other fibers keep running meanwhile. Elsewhere it just yields
+  def self.off_event_loop
+    return yield unless Fiber.respond_to?(:scheduler) && Fiber.scheduler && !Fiber.blocking?
+    thread = Thread.new do
+      Thread.current.report_on_exception = false
+      yield
+    end
+    thread.value
+  ensure
+    # the waiting fiber was interrupted (e.g. by a timeout): stop loading
+    thread.kill if thread && thread.alive?
+  end
+
+  class Problem
+    # Loads a problem in the libsvm format, without blocking the other fibers when called
+    # from a Fiber scheduler (see the README for the options)
+    def self.load_file(path, bias, options = {})
+      RubyLinear.off_event_loop { load_file_native(path, bias, options) }
+    end
+  end
+
+  class Model
+    # Loads a model saved by write_file or liblinear, without blocking the other fibers when
+    # called from a Fiber scheduler
+    def self.load_file(path)
+      RubyLinear.off_event_loop { load_file_native(path) }
+    end
+  end
+
+  class BlockProblem
+    # Splits the libsvm format file at path into blocks of options[:block_size] samples
+    # (100000 by default) saved in directory, for out of core training. With
+    # options[:weights] each line has the sample's weight after its label.
+    def self.create(path, directory, bias, options = {})
+      open(write(path, directory, bias, options.fetch(:block_size, 100_000), options.fetch(:weights, false)))
+    end
+
+    # The blocks previously written to directory
+    def self.load(directory)
+      open(Dir[File.join(directory, 'block_*.bin')].sort)
+    end
+  end
+
+  METRICS = shareable({
+    :accuracy => lambda do |labels, predictions|
+      correct = labels.zip(predictions).count {|label, prediction| label == prediction}
+      correct.to_f / labels.length
+    end,
+    :macro_f1 => lambda do |labels, predictions|
+      scores = labels.uniq.map do |label|
+        true_positives = labels.zip(predictions).count {|l, p| l == label && p == label}
+        predicted = predictions.count(label)
+        actual = labels.count(label)
+        precision = predicted > 0 ? true_positives.to_f / predicted : 0.0
+        recall = true_positives.to_f / actual
+        precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0.0
+      end
+      scores.inject(0.0) {|sum, score| sum + score} / scores.length
+    end
+  })
+
+  # Cross validates every combination of the parameter values in grid, for example
+  #   {:solver => [L2R_LR, L1R_LR], :c => [0.1, 1, 10], :weights => [nil, {2 => 0.5}]}
+  # Returns an array of {:parameters => ..., :score => ...} hashes, best first.
+  # metric is :accuracy, :macro_f1 or a callable taking the labels and the predictions.
+  # options[:seed] seeds the folds and every training, unless the grid sets :seed itself.
+  # The trainings run on native threads, which cannot write to a :log.
+  def self.grid_search(problem, grid, options = {})
+    raise ArgumentError, "grid_search does not support :log" if grid.key?(:log)
+    raise ArgumentError, "grid_search needs a non empty grid" if grid.empty?
+    folds = options.fetch(:folds, 5)
+    threads = options.fetch(:threads, 1)
+    metric = options.fetch(:metric, :accuracy)
+    grid = {:seed => options[:seed]}.merge(grid) if options[:seed]
+    metric = METRICS.fetch(metric) {raise ArgumentError, "Unknown metric: #{metric.inspect}"} unless metric.respond_to?(:call)
+
+    keys = grid.keys
+    values = keys.map {|key| grid[key].is_a?(Array) ? grid[key] : [grid[key]]}
+    raise ArgumentError, "grid_search needs a value for every key" if values.any?(&:empty?)
+    parameter_sets = values.first.product(*values[1..-1]).map do |combination|
+      parameters = {}
+      keys.zip(combination) {|key, value| parameters[key] = value unless value.nil?}
+      validate_options(parameters)
+      parameters
+    end
+
+    labels = problem.labels
+    predictions = cross_validation_grid(problem, parameter_sets, folds, threads)
+    leaderboard = parameter_sets.zip(predictions).map do |parameters, predicted|
+      {:parameters => parameters, :score => metric.call(labels, predicted)}
+    end
+    leaderboard.each_with_index.sort_by {|entry, index| [-entry[:score], index]}.map(&:first)
+  end
+end
@@ -0,0 +1,59 @@
+require 'spec_helper'
+
+describe(RubyLinear::Blas) do
+  around(:each) do |example|
+    current = RubyLinear::Blas.current
+    begin
+      example.run
+    ensure
+      RubyLinear::Blas.use(current)
+    end
+  end
+
+  let(:lengths) {[0, 1, 3, 7, 8, 15, 16, 33, 1001]}
+
+  def vector(n)
+    Array.new(n) {rand * 2 - 1}
+  end
+
+  def scalar
+    RubyLinear::Blas.use(:scalar)
+    result = yield
+    RubyLinear::Blas.use(@kernels)
+    result
+  end
+
+  it 'should use the fastest kernels the cpu supports' do
+    RubyLinear::Blas.kernels.first.should == :scalar
+    RubyLinear::Blas.current.should == RubyLinear::Blas.kernels.last
+  end
+
+  it 'should raise argument error for unsupported kernels' do
+    expect {RubyLinear::Blas.use(:sse1)}.to raise_error(ArgumentError)
+  end
+
+  RubyLinear::Blas.kernels.each do |kernels|
+    context "with the #{kernels} kernels" do
+      before(:each) do
+        @kernels = kernels
+        RubyLinear::Blas.use(kernels)
+      end
+
+      it 'should compute the same results as the scalar kernels' do
+        lengths.each do |n|
+          x, y, a = vector(n), vector(n), rand
+          RubyLinear::Blas.ddot(x, y).should be_within(1e-12).of(scalar {RubyLinear::Blas.ddot(x, y)})
+          RubyLinear::Blas.dnrm2(x).should be_within(1e-12).of(scalar {RubyLinear::Blas.dnrm2(x)})
+          RubyLinear::Blas.daxpy(a, x, y).zip(scalar {RubyLinear::Blas.daxpy(a, x, y)}).each {|u, v| u.should be_within(1e-15).of(v)}
+          RubyLinear::Blas.dscal(a, x).should == scalar {RubyLinear::Blas.dscal(a, x)}
+        end
+      end
+
+      it 'should not overflow or underflow when computing norms' do
+        RubyLinear::Blas.dnrm2([3e300, 4e300] * 10).should be_within(1e288).of(5e300 * Math.sqrt(10))
+        RubyLinear::Blas.dnrm2([3e-300, 4e-300] * 10).should be_within(1e-312).of(5e-300 * Math.sqrt(10))
+        RubyLinear::Blas.dnrm2([0.0] * 20).should == 0
+      end
+    end
+  end
+end
@@ -0,0 +1,57 @@
+require 'spec_helper'
+require 'tmpdir'
+
+describe(RubyLinear::BlockProblem) do
+  let(:path) {File.dirname(__FILE__) + '/fixtures/dna.scale.txt'}
+  let :test_vector do#first line from dna.scale.t
+    {6 => 1, 7 => 1, 11 => 1, 18 => 1, 20 => 1, 24 => 1, 27 => 1, 30 => 1, 33 => 1, 34 => 1, 38 => 1, 42 => 1, 45 => 1, 47 => 1, 53 => 1, 60 => 1, 61 => 1, 65 => 1, 69 => 1, 70 => 1, 75 => 1, 78 => 1, 79 => 1, 84 => 1, 87 => 1, 88 => 1, 92 => 1, 99 => 1, 101 => 1, 103 => 1, 108 => 1, 110 => 1, 112 => 1, 119 => 1, 123 => 1, 124 => 1, 128 => 1, 131 => 1, 134 => 1, 137 => 1, 139 => 1, 142 => 1, 147 => 1, 149 => 1, 156 => 1, 157 => 1, 161 => 1, 164 => 1, 166 => 1, 171 => 1, 173 => 1, 180 => 1}
+  end
+
+  around(:each) do |example|
+    Dir.mktmpdir do |dir|
+      @dir = dir
+      example.run
+    end
+  end
+
+  describe 'create' do
+    it 'should split the file into blocks' do
+      blocks = RubyLinear::BlockProblem.create(path, @dir, 1.0, :block_size => 600)
+      blocks.block_count.should == 4
+      blocks.l.should == 2000
+      blocks.n.should == 181
+      blocks.labels.should == RubyLinear::Problem.load_file(path, 1.0).labels
+
+      RubyLinear::BlockProblem.load(@dir).l.should == 2000
+    end
+
+    it 'should raise argument error if the blocks cannot be read' do
+      expect {RubyLinear::BlockProblem.open([File.join(@dir, 'missing.bin')])}.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'training' do
+    it 'should train a model with the dual solvers' do
+      blocks = RubyLinear::BlockProblem.create(path, @dir, 1.0, :block_size => 1000)
+      [RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L2R_L1LOSS_SVC_DUAL, RubyLinear::L2R_LR_DUAL].each do |solver|
+        model = RubyLinear::Model.new(blocks, :solver => solver, :max_iter => 20)
+        model.iterations.should == 20
+        model.feature_count.should == 180
+        model.predict(test_vector).should == 3
+      end
+    end
+
+    it 'should converge like in memory training when there is a single block' do
+      blocks = RubyLinear::BlockProblem.create(path, @dir, 1.0)
+      model = RubyLinear::Model.new(blocks, :solver => RubyLinear::L2R_LR_DUAL)
+      model.should be_converged
+      in_memory = RubyLinear::Model.new(RubyLinear::Problem.load_file(path, 1.0), :solver => RubyLinear::L2R_LR_DUAL)
+      model.weights.zip(in_memory.weights).each {|a, b| a.should be_within(0.05).of(b)}
+    end
+
+    it 'should raise argument error for the other solvers' do
+      blocks = RubyLinear::BlockProblem.create(path, @dir, 1.0)
+      expect {RubyLinear::Model.new(blocks, :solver => RubyLinear::L2R_LR)}.to raise_error(ArgumentError, /dual solver/)
+    end
+  end
+end
@@ -26,6 +26,49 @@ describe(RubyLinear) do
     @model.should predict_values('spec/fixtures/dna.out').for_input('spec/fixtures/dna.scale.t')
   end
   
+  describe 'grid_search' do
+    let(:problem) {RubyLinear::Problem.load_file("spec/fixtures/dna.scale.txt",1)}
+
+    it 'should score every combination of parameters, best first' do
+      grid = {:solver => [RubyLinear::L2R_LR, RubyLinear::L1R_L2LOSS_SVC], :c => [0.01, 1], :weights => [nil, {2 => 0.5}]}
+      leaderboard = RubyLinear.grid_search(problem, grid, :folds => 3, :threads => 4)
+      leaderboard.length.should == 8
+      leaderboard.map {|entry| entry[:parameters]}.should =~ [
+        {:solver => RubyLinear::L2R_LR, :c => 0.01}, {:solver => RubyLinear::L2R_LR, :c => 0.01, :weights => {2 => 0.5}},
+        {:solver => RubyLinear::L2R_LR, :c => 1}, {:solver => RubyLinear::L2R_LR, :c => 1, :weights => {2 => 0.5}},
+        {:solver => RubyLinear::L1R_L2LOSS_SVC, :c => 0.01}, {:solver => RubyLinear::L1R_L2LOSS_SVC, :c => 0.01, :weights => {2 => 0.5}},
+        {:solver => RubyLinear::L1R_L2LOSS_SVC, :c => 1}, {:solver => RubyLinear::L1R_L2LOSS_SVC, :c => 1, :weights => {2 => 0.5}}]
+      scores = leaderboard.map {|entry| entry[:score]}
+      scores.should == scores.sort.reverse
+      scores.first.should > 0.9
+    end
+
+    it 'should give the same scores with the same seed' do
+      grid = {:solver => [RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L1R_LR]}
+      first = RubyLinear.grid_search(problem, grid, :folds => 3, :threads => 2, :seed => 7)
+      second = RubyLinear.grid_search(problem, grid, :folds => 3, :threads => 2, :seed => 7)
+      second.should == first
+      first.first[:parameters][:seed].should == 7
+    end
+
+    it 'should reject unknown metrics' do
+      expect { RubyLinear.grid_search(problem, {:solver => RubyLinear::L2R_LR}, :metric => :bogus) }.to raise_error(ArgumentError)
+    end
+
+    it 'should reject invalid parameters anywhere in the grid' do
+      grid = {:solver => RubyLinear::L2R_LR, :weights => {2 => 0.5}, :c => [1, -1]}
+      expect { RubyLinear.grid_search(problem, grid, :folds => 3) }.to raise_error(ArgumentError)
+      grid = {:solver => RubyLinear::L2R_LR, :weights => {2 => 0.5}, :max_iter => [10, 2**40]}
+      expect { RubyLinear.grid_search(problem, grid, :folds => 3) }.to raise_error(RangeError)
+    end
+
+    it 'should reject an empty grid' do
+      expect { RubyLinear.grid_search(problem, {}) }.to raise_error(ArgumentError)
+      expect { RubyLinear.grid_search(problem, {:solver => RubyLinear::L2R_LR, :c => []}) }.to raise_error(ArgumentError)
+      expect { RubyLinear.cross_validation_grid(problem, [], 5, 1) }.to raise_error(ArgumentError)
+    end
+  end
+
   RSpec::Matchers.define :predict_values do |output_file|
     match do |model|
       input_lines = File.readlines(@input)
@@ -22,6 +22,27 @@ describe(RubyLinear::Model) do
     it 'should be able to predict' do
       @model.predict(test_vector).should == 3
     end
+
+    it 'should raise if the file is missing or is not a model' do
+      expect { RubyLinear::Model.load_file(File.dirname(__FILE__) + '/fixtures/missing.dat') }.to raise_error(Errno::ENOENT)
+      expect { RubyLinear::Model.load_file(File.dirname(__FILE__) + '/fixtures/dna.out') }.to raise_error(ArgumentError)
+    end
+
+    if Fiber.respond_to?(:set_scheduler)
+      it 'should let the other fibers run while loading under a Fiber scheduler' do
+        events = []
+        model = nil
+        TestScheduler.run do
+          Fiber.schedule do
+            model = RubyLinear::Model.load_file(File.dirname(__FILE__) + '/fixtures/dna.dat')
+            events << :loaded
+          end
+          Fiber.schedule { events << :other }
+        end
+        events.should == [:other, :loaded]
+        model.predict(test_vector).should == 3
+      end
+    end
   end
   
   describe('predict_values') do
@@ -39,6 +60,36 @@ describe(RubyLinear::Model) do
       values[1].should be_within(0.001).of(-3.568)
     end
   end
+
+  if defined?(Ractor)
+    describe('in Ractors') do
+      before(:each) do
+        Warning[:experimental] = false
+        @model = Ractor.make_shareable(RubyLinear::Model.load_file(File.dirname(__FILE__) + '/fixtures/dna.dat'))
+      end
+
+      it 'should be shareable once frozen' do
+        Ractor.shareable?(@model).should be_true
+        expect { @model.destroy! }.to raise_error(FrozenError)
+      end
+
+      it 'should predict in several Ractors at once' do
+        ractors = 3.times.map do
+          Ractor.new(@model, test_vector) {|model, sample| model.predict_values(sample)}
+        end
+        ractors.map(&:take).each {|result| result.should == @model.predict_values(test_vector)}
+      end
+
+      it 'should train in a Ractor' do
+        ractor = Ractor.new(File.dirname(__FILE__) + '/fixtures/dna.scale.txt') do |path|
+          problem = RubyLinear::Problem.load_file(path, 1.0)
+          RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR).labels
+        end
+        ractor.take.should =~ [1,2,3]
+      end
+    end
+  end
+
   describe('new') do
     let(:problem) {RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1.0)}
     it 'should train the model from the parameters and the problem' do
@@ -46,12 +97,326 @@ describe(RubyLinear::Model) do
       m.predict(test_vector).should == 3
     end
     
+    context 'when a validation problem is given' do
+      let(:validation) {RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.t', 1.0)}
+
+      it 'should stop once the validation accuracy stops improving' do
+        full = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :eps => 0.0001)
+        early = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :eps => 0.0001, :validation => validation, :patience => 2)
+        early.iterations.should < full.iterations
+        early.predict(test_vector).should == 3
+      end
+
+      it 'should raise argument error if the validation is not a problem' do
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :validation => {}) }.to raise_error(ArgumentError)
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :validation => validation, :patience => 0) }.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'when limits are given' do
+      it 'should report convergence' do
+        m = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR)
+        m.should be_converged
+        m.stop_reason.should == :converged
+      end
+
+      it 'should stop at max_iter' do
+        m = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :eps => 0.0001, :max_iter => 5)
+        m.iterations.should == 15 #3 classes
+        m.should_not be_converged
+        m.stop_reason.should == :max_iter
+        m.predict(test_vector).should == 3
+      end
+
+      it 'should report convergence on the last iteration allowed' do
+        [RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L1R_L2LOSS_SVC, RubyLinear::L2R_LR].each do |solver|
+          log = ''
+          RubyLinear::Model.new(problem, :solver => solver, :log => log)
+          iterations = log.scan(/#iter = (\d+)/).flatten + log.scan(/^iter +(\d+) act/).flatten
+          m = RubyLinear::Model.new(problem, :solver => solver, :max_iter => iterations.map(&:to_i).max)
+          m.stop_reason.should == :converged
+        end
+      end
+
+      it 'should stop at max_newton_iter for L1R_LR' do
+        m = RubyLinear::Model.new(problem, :solver => RubyLinear::L1R_LR, :max_newton_iter => 2)
+        m.iterations.should == 6
+        m.stop_reason.should == :max_iter
+      end
+
+      it 'should stop when the time budget is exhausted' do
+        m = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L1LOSS_SVC_DUAL, :eps => 0.00001, :time_budget => 0.000001)
+        m.stop_reason.should == :time_budget
+        m.iterations.should == 3
+      end
+    end
+
+    context 'when the problem has instance weights' do
+      it 'should be equivalent to scaling C' do
+        samples = (0...problem.l).map {|i| Hash[problem.feature_vector(i).reject {|index, value| index == problem.n}]}
+        weighted = RubyLinear::Problem.new(problem.labels, samples, 1.0, problem.n - 1, :weights => [2.0]*problem.l)
+        plain = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :c => 1)
+        scaled = RubyLinear::Model.new(weighted, :solver => RubyLinear::L2R_LR, :c => 0.5)
+        plain.weights.zip(scaled.weights).each {|a, b| b.should be_within(1e-6).of(a)}
+      end
+
+      it 'should be supported by all the solvers' do
+        samples = (0...problem.l).map {|i| Hash[problem.feature_vector(i).reject {|index, value| index == problem.n}]}
+        weighted = RubyLinear::Problem.new(problem.labels, samples, 1.0, problem.n - 1, :weights => (0...problem.l).map {|i| 0.5 + i % 2})
+        [RubyLinear::L2R_LR, RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L2R_L2LOSS_SVC, RubyLinear::L2R_L1LOSS_SVC_DUAL,
+         RubyLinear::MCSVM_CS, RubyLinear::L1R_L2LOSS_SVC, RubyLinear::L1R_LR, RubyLinear::L2R_LR_DUAL].each do |solver|
+          RubyLinear::Model.new(weighted, :solver => solver).predict(test_vector).should == 3
+        end
+      end
+    end
+
+    [:float, :binary, :csr, :compressed].each do |storage|
+      context "when the problem has #{storage} storage" do
+        let(:stored_problem) {RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1.0, :storage => storage)}
+
+        it 'should train the same model as with doubles' do
+          plain = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR)
+          stored = RubyLinear::Model.new(stored_problem, :solver => RubyLinear::L2R_LR)
+          plain.weights.zip(stored.weights).each {|a, b| b.should be_within(1e-9).of(a)}
+        end
+
+        it 'should be supported by all the solvers' do
+          [RubyLinear::L2R_LR, RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L2R_L2LOSS_SVC, RubyLinear::L2R_L1LOSS_SVC_DUAL,
+           RubyLinear::MCSVM_CS, RubyLinear::L1R_L2LOSS_SVC, RubyLinear::L1R_LR, RubyLinear::L2R_LR_DUAL].each do |solver|
+            RubyLinear::Model.new(stored_problem, :solver => solver, :validation => stored_problem).predict(test_vector).should == 3
+          end
+        end
+      end
+    end
+
+    context 'when threads are given' do
+      it 'should train the dual solvers in parallel' do
+        [RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L2R_L1LOSS_SVC_DUAL, RubyLinear::L2R_LR_DUAL].each do |solver|
+          sequential = RubyLinear::Model.new(problem, :solver => solver, :threads => 1)
+          parallel = RubyLinear::Model.new(problem, :solver => solver, :threads => 4)
+          parallel.predict(test_vector).should == 3
+          parallel.weights.zip(sequential.weights).each {|a, b| a.should be_within(0.05).of(b)}
+        end
+      end
+
+      it 'should train the L1 solvers in parallel' do
+        # two sequential runs already end up with somewhat different sparse weights,
+        # so compare how well the models fit instead
+        correct = lambda do |model|
+          (0...problem.l).count {|i| model.predict(Hash[problem.feature_vector(i)]) == problem.labels[i]}
+        end
+        [RubyLinear::L1R_L2LOSS_SVC, RubyLinear::L1R_LR].each do |solver|
+          sequential = RubyLinear::Model.new(problem, :solver => solver, :threads => 1)
+          parallel = RubyLinear::Model.new(problem, :solver => solver, :threads => 4)
+          parallel.predict(test_vector).should == 3
+          correct[parallel].should be_within(problem.l*3/100).of(correct[sequential])
+        end
+      end
+
+      context 'and the features are many and sparse' do
+        # colors with enough active features to be split across the threads
+        let :wide_problem do
+          random = Random.new(1)
+          labels = (0...2000).map {|i| i % 2 + 1}
+          samples = labels.map do |label|
+            sample = {}
+            3.times { sample[(label - 1) * 1000 + random.rand(1000) + 1] = 0.5 + random.rand }
+            3.times { sample[2000 + random.rand(8000) + 1] = 0.5 + random.rand }
+            sample
+          end
+          RubyLinear::Problem.new(labels, samples, 1.0, 10000)
+        end
+
+        def train_wide(solver, threads)
+          log = ''
+          model = RubyLinear::Model.new(wide_problem, :solver => solver, :eps => 0.0001, :threads => threads, :log => log)
+          [model, log]
+        end
+
+        it 'should run colors on several threads and find the same L1R_LR weights' do
+          sequential, = train_wide(RubyLinear::L1R_LR, 1)
+          parallel, log = train_wide(RubyLinear::L1R_LR, 4)
+          log[/(\d+) of \d+ color passes on several threads/, 1].to_i.should > 0
+          parallel.weights.zip(sequential.weights).each {|a, b| a.should be_within(0.001).of(b)}
+        end
+
+        it 'should run colors on several threads and fit like the sequential L1R_L2LOSS_SVC' do
+          # the L2 loss leaves the sparse weights less determined: two sequential runs with
+          # different seeds differ as much, so compare the predictions instead
+          sequential, = train_wide(RubyLinear::L1R_L2LOSS_SVC, 1)
+          parallel, log = train_wide(RubyLinear::L1R_L2LOSS_SVC, 4)
+          log[/(\d+) of \d+ color passes on several threads/, 1].to_i.should > 0
+          differing = (0...wide_problem.l).count do |i|
+            sample = Hash[wide_problem.feature_vector(i)]
+            parallel.predict(sample) != sequential.predict(sample)
+          end
+          differing.should <= wide_problem.l / 100
+        end
+      end
+    end
+
+    context 'when screening is enabled' do
+      it 'should find about the same sparse weights' do
+        [RubyLinear::L1R_L2LOSS_SVC, RubyLinear::L1R_LR].each do |solver|
+          plain = RubyLinear::Model.new(problem, :solver => solver, :c => 0.1, :eps => 0.001)
+          screened = RubyLinear::Model.new(problem, :solver => solver, :c => 0.1, :eps => 0.001, :screening => true)
+          screened.should be_converged
+          screened.predict(test_vector).should == 3
+          nonzero = lambda {|model| model.weights.count {|w| w != 0}}
+          nonzero[screened].should be_within(nonzero[plain]/10).of(nonzero[plain])
+        end
+      end
+
+      it 'should still train at the given C when max_iter cuts the stages short' do
+        correct = lambda do |model|
+          (0...problem.l).count {|i| model.predict(Hash[problem.feature_vector(i)]) == problem.labels[i]}
+        end
+        nonzero = lambda {|model| model.weights.count {|w| w != 0}}
+        plain = RubyLinear::Model.new(problem, :solver => RubyLinear::L1R_L2LOSS_SVC, :c => 1, :max_iter => 2)
+        screened = RubyLinear::Model.new(problem, :solver => RubyLinear::L1R_L2LOSS_SVC, :c => 1, :max_iter => 2, :screening => true)
+        screened.stop_reason.should == :max_iter
+        nonzero[screened].should be_within(nonzero[plain]/10).of(nonzero[plain])
+        correct[screened].should be_within(problem.l*3/100).of(correct[plain])
+      end
+    end
+
+    context 'when preconditioning is enabled' do
+      it 'should find about the same weights' do
+        [RubyLinear::L2R_LR, RubyLinear::L2R_L2LOSS_SVC].each do |solver|
+          plain = RubyLinear::Model.new(problem, :solver => solver, :eps => 0.0001)
+          preconditioned = RubyLinear::Model.new(problem, :solver => solver, :eps => 0.0001, :preconditioning => true)
+          preconditioned.should be_converged
+          preconditioned.predict(test_vector).should == 3
+          preconditioned.weights.zip(plain.weights).each {|a, b| a.should be_within(0.05).of(b)}
+        end
+      end
+    end
+
+    context 'when the Hessian is subsampled' do
+      it 'should find about the same weights' do
+        [RubyLinear::L2R_LR, RubyLinear::L2R_L2LOSS_SVC].each do |solver|
+          plain = RubyLinear::Model.new(problem, :solver => solver, :eps => 0.0001)
+          sampled = RubyLinear::Model.new(problem, :solver => solver, :eps => 0.0001, :hessian_sample => 0.2)
+          sampled.should be_converged
+          sampled.predict(test_vector).should == 3
+          sampled.weights.zip(plain.weights).each {|a, b| a.should be_within(0.05).of(b)}
+          RubyLinear::Model.new(problem, :solver => solver, :eps => 0.0001, :hessian_sample => 0.2).weights.should == sampled.weights
+        end
+      end
+
+      it 'should raise argument error if the fraction is not between 0 and 1' do
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :hessian_sample => 1.5) }.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'when a seed is given' do
+      it 'should train the same model with the same seed' do
+        [RubyLinear::L2R_L2LOSS_SVC_DUAL, RubyLinear::L2R_LR_DUAL, RubyLinear::MCSVM_CS, RubyLinear::L1R_LR].each do |solver|
+          first = RubyLinear::Model.new(problem, :solver => solver, :seed => 42)
+          RubyLinear::Model.new(problem, :solver => solver, :seed => 1)
+          RubyLinear::Model.new(problem, :solver => solver, :seed => 42).weights.should == first.weights
+        end
+      end
+
+      it 'should shuffle differently with another seed' do
+        first = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :seed => 1)
+        second = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :seed => 2)
+        second.weights.should_not eq(first.weights)
+        second.predict(test_vector).should == 3
+      end
+    end
+
+    context 'when a log is given' do
+      it 'should log each training to its own log' do
+        tron_log, dual_log = [], []
+        threads = [Thread.new { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :log => tron_log) },
+                   Thread.new { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L2LOSS_SVC_DUAL, :log => dual_log) }]
+        threads.each(&:join)
+        tron_log.join.should include('CG')
+        tron_log.join.should_not include('nSV')
+        dual_log.join.should include('nSV')
+        dual_log.join.should_not include('CG')
+      end
+
+      it 'should raise the errors of the log' do
+        log = Object.new
+        def log.<<(message)
+          raise IOError, 'log is full'
+        end
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :log => log) }.to raise_error(IOError)
+      end
+    end
+
+    it 'should collect statistics about the training' do
+      m = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR)
+      m.training_stats[:iterations].should == m.iterations
+      m.training_stats[:cg_iterations].should > m.iterations
+      m.training_stats[:time].should > 0
+    end
+
+    it 'should cancel the training when its thread is interrupted' do
+      training = Thread.new do
+        RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_L1LOSS_SVC_DUAL, :c => 100, :eps => 1e-12, :max_iter => 1_000_000)
+      end
+      training.report_on_exception = false
+      sleep 0.2
+      interrupted_at = Time.now
+      training.raise(RuntimeError, 'cancelled')
+      expect { training.join }.to raise_error(RuntimeError)
+      (Time.now - interrupted_at).should < 1
+    end
+
     context 'when unknwon options are presented' do
       it 'should raise argument error' do
         expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L1R_L2LOSS_SVC, :bogus_option => true) }.to raise_error(ArgumentError)
         
       end
+
+      it 'should raise range error for values out of range' do
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :weights => {1 => 2.0}, :max_iter => 2**40) }.to raise_error(RangeError)
+        expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :weights => {2**40 => 2.0}) }.to raise_error(RangeError)
+      end
       
     end
   end
+
+  describe('path') do
+    let(:problem) {RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1.0)}
+
+    it 'should train a model for each C in increasing order' do
+      models = RubyLinear::Model.path(problem, :solver => RubyLinear::L2R_LR, :cs => [1, 0.01, 0.1])
+      models.keys.should == [0.01, 0.1, 1]
+      models.values.each do |model|
+        model.class_count.should == 3
+        model.iterations.should > 0
+      end
+      models[1.0].predict(test_vector).should == 3
+    end
+
+    it 'should warm start from the previous C' do
+      cold = RubyLinear::Model.new(problem, :solver => RubyLinear::L1R_LR, :c => 1)
+      warm = RubyLinear::Model.path(problem, :solver => RubyLinear::L1R_LR, :cs => [0.5, 1])[1.0]
+      warm.iterations.should < cold.iterations
+      warm.predict(test_vector).should == cold.predict(test_vector)
+    end
+
+    it 'should screen the features of each C' do
+      cs = [0.05, 0.1, 0.2]
+      plain = RubyLinear::Model.path(problem, :solver => RubyLinear::L1R_LR, :cs => cs, :eps => 0.0001)
+      screened = RubyLinear::Model.path(problem, :solver => RubyLinear::L1R_LR, :cs => cs, :eps => 0.0001, :screening => true)
+      cs.each do |c|
+        screened[c].weights.zip(plain[c].weights).each {|a, b| a.should be_within(0.05).of(b)}
+      end
+    end
+
+    it 'should require a list of C values' do
+      expect { RubyLinear::Model.path(problem, :solver => RubyLinear::L2R_LR) }.to raise_error(ArgumentError)
+      expect { RubyLinear::Model.path(problem, :solver => RubyLinear::L2R_LR, :cs => []) }.to raise_error(ArgumentError)
+    end
+
+    it 'should reject a C value given twice' do
+      expect { RubyLinear::Model.path(problem, :solver => RubyLinear::L2R_LR, :cs => [0.1, 1, 0.1]) }.to raise_error(ArgumentError, /more than once/)
+      expect { RubyLinear::Model.path(problem, :solver => RubyLinear::L2R_LR, :cs => [1, 1.0]) }.to raise_error(ArgumentError)
+    end
+  end
 end
\ No newline at end of file
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'tmpdir'
 
 
 describe(RubyLinear::Problem) do
@@ -26,6 +27,86 @@ describe(RubyLinear::Problem) do
       problem.feature_vector(0).should == [[2,1], [7,1], [12,1], [15,1], [17,1], [23,1], [26,1], [28,1], [33,1], [34,1], [40,1], [45,1], [47,1], [50,1], [52,1], [58,1], [63,1], [64,1], [67,1], [72,1], [73,1], [76,1], [80,1], [83,1], [85,1], [88,1], [91,1], [95,1], [97,1], [101,1], [113,1], [120,1], [122,1], [126,1], [132,1], [138,1], [144,1], [145,1], [150,1], [151,1], [154,1], [160,1], [163,1], [170,1], [172,1], [177,1], [178,1],[181,1]] 
 
     end
+
+    it 'should read a weight column after the label when asked to' do
+      path = File.join(Dir.tmpdir, "rubylinear_weights_#{Process.pid}.txt")
+      File.open(path, 'w') {|f| f.write("1 0.5 1:1 3:0.5\n2 2 2:1\n")}
+      begin
+        problem = RubyLinear::Problem.load_file(path, -1, :weights => true)
+        problem.labels.should == [1, 2]
+        problem.weights.should == [0.5, 2.0]
+        problem.feature_vector(1).should == [[2, 1]]
+      ensure
+        File.delete(path)
+      end
+    end
+
+    it 'should store the values as floats when asked to' do
+      path = File.dirname(__FILE__) + '/fixtures/dna.scale.txt'
+      problem = RubyLinear::Problem.load_file(path, 1, :storage => :float)
+      problem.storage.should == :float
+      problem.n.should == 181
+      problem.feature_vector(0).should == RubyLinear::Problem.load_file(path, 1).feature_vector(0)
+    end
+
+    it 'should store only the indices of binary data' do
+      path = File.dirname(__FILE__) + '/fixtures/dna.scale.txt'
+      problem = RubyLinear::Problem.load_file(path, 1, :storage => :binary)
+      problem.storage.should == :binary
+      problem.feature_vector(0).should == RubyLinear::Problem.load_file(path, 1).feature_vector(0)
+      RubyLinear::Problem.load_file(path, -1, :storage => :auto).storage.should == :binary
+      expect {RubyLinear::Problem.load_file(path, 0.5, :storage => :binary)}.to raise_error(ArgumentError, /bias/)
+    end
+
+    it 'should load several files at once on different threads' do
+      paths = ['/fixtures/dna.scale.txt', '/fixtures/dna.scale.t'].map {|name| File.dirname(__FILE__) + name}
+      expected = paths.map {|path| RubyLinear::Problem.load_file(path, 1)}
+      threads = (0...4).map {|i| Thread.new { RubyLinear::Problem.load_file(paths[i % 2], 1) }}
+      threads.each_with_index do |thread, i|
+        problem = thread.value
+        problem.labels.should == expected[i % 2].labels
+        problem.feature_vector(problem.l - 1).should == expected[i % 2].feature_vector(problem.l - 1)
+      end
+    end
+
+    it 'should report the line of a wrong input and close the file' do
+      path = File.join(Dir.tmpdir, "rubylinear_wrong_#{Process.pid}.txt")
+      File.open(path, 'w') {|f| f.write("1 1:1 3:0.5\n2 3:1 2:1\n")}
+      begin
+        open_files = Dir['/proc/self/fd/*'].length
+        3.times do
+          expect {RubyLinear::Problem.load_file(path, -1)}.to raise_error(ArgumentError, /line 2/)
+        end
+        Dir['/proc/self/fd/*'].length.should == open_files
+      ensure
+        File.delete(path)
+      end
+      expect {RubyLinear::Problem.load_file(path, -1)}.to raise_error(Errno::ENOENT)
+    end
+
+    if Fiber.respond_to?(:set_scheduler)
+      it 'should let the other fibers run while loading under a Fiber scheduler' do
+        path = File.dirname(__FILE__) + '/fixtures/dna.scale.txt'
+        events = []
+        problem = error = nil
+        TestScheduler.run do
+          Fiber.schedule do
+            events << :loading
+            problem = RubyLinear::Problem.load_file(path, 1)
+            events << :loaded
+            begin
+              RubyLinear::Problem.load_file(path + '.missing', 1)
+            rescue SystemCallError => e
+              error = e
+            end
+          end
+          Fiber.schedule { events << :other }
+        end
+        events.should == [:loading, :other, :loaded]
+        problem.labels.should == RubyLinear::Problem.load_file(path, 1).labels
+        error.should be_a(Errno::ENOENT)
+      end
+    end
   end
   
   describe 'destroy' do
@@ -36,6 +117,42 @@ describe(RubyLinear::Problem) do
       problem.destroy!
       problem.destroyed?.should be_true
     end
+
+    it 'should raise while a training on another thread uses the problem' do
+      problem = RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1)
+      validation = RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.t', 1)
+      started, resume = Queue.new, Queue.new
+      # holds the training in its first log line
+      first = true
+      log = Object.new
+      log.define_singleton_method(:<<) do |message|
+        if first
+          first = false
+          started << true
+          resume.pop
+        end
+        self
+      end
+      training = Thread.new { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :validation => validation, :log => log) }
+      started.pop
+      expect { problem.destroy! }.to raise_error(RuntimeError)
+      expect { validation.destroy! }.to raise_error(RuntimeError)
+      problem.destroyed?.should be_false
+      resume << true
+      training.value.labels.sort.should == [1, 2, 3]
+      problem.destroy!
+      validation.destroy!
+      problem.destroyed?.should be_true
+    end
+
+    it 'should be possible once a training has been interrupted' do
+      problem = RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1)
+      log = Object.new
+      log.define_singleton_method(:<<) {|message| raise IOError, 'log closed'}
+      expect { RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR, :log => log) }.to raise_error(IOError)
+      problem.destroy!
+      problem.destroyed?.should be_true
+    end
       
   end
   
@@ -69,6 +186,55 @@ describe(RubyLinear::Problem) do
       end
     end
     
+    context 'when instance weights are given' do
+      it 'should store them' do
+        problem = RubyLinear::Problem.new(@labels, @samples, -1, @max_feature, :weights => [1, 0.5, 2, 1])
+        problem.weights.should == [1.0, 0.5, 2.0, 1.0]
+        RubyLinear::Problem.new(@labels, @samples, -1, @max_feature).weights.should == nil
+      end
+
+      it 'should raise argument error if they are not positive or of the wrong length' do
+        expect {RubyLinear::Problem.new(@labels, @samples, -1, @max_feature, :weights => [1, 0, 2, 1])}.to raise_error(ArgumentError, /not positive/)
+        expect {RubyLinear::Problem.new(@labels, @samples, -1, @max_feature, :weights => [1, 2])}.to raise_error(ArgumentError, /different length/)
+      end
+    end
+
+    context 'when a storage is asked for' do
+      it 'should store the values with single precision' do
+        problem = RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature, :storage => :float)
+        problem.storage.should == :float
+        problem.feature_vector(0).map(&:first).should == [2, 3, 4, 6]
+        problem.feature_vector(0).map(&:last).zip([0.1, 0.3, -1.2, 1]).each {|a, b| a.should be_within(1e-7).of(b)}
+        RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature).storage.should == :double
+      end
+
+      it 'should only use binary storage when all the values are 1' do
+        binary = [{1 => 1, 3 => 1}, {2 => 1}]
+        RubyLinear::Problem.new([1, 2], binary, 1.0, 3, :storage => :auto).storage.should == :binary
+        RubyLinear::Problem.new([1, 2], binary, 1.0, 3, :storage => :binary).feature_vector(0).should == [[1, 1], [3, 1], [4, 1]]
+        RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature, :storage => :auto).storage.should == :double
+        expect {RubyLinear::Problem.new(@labels, @samples, -1, @max_feature, :storage => :binary)}.to raise_error(ArgumentError, /binary/)
+      end
+
+      it 'should store the samples in compressed sparse row format' do
+        problem = RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature, :storage => :csr)
+        problem.storage.should == :csr
+        (0...4).map {|i| problem.feature_vector(i)}.should == (0...4).map {|i| RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature).feature_vector(i)}
+      end
+
+      it 'should compress the indices of the samples' do
+        samples = [{100_000 => 0.5, 3 => 1, 200 => 2}, {1 => -1}]
+        problem = RubyLinear::Problem.new([1, 2], samples, 1.0, 100_000, :storage => :compressed)
+        problem.storage.should == :compressed
+        problem.feature_vector(0).should == [[3, 1], [200, 2], [100_000, 0.5], [100_001, 1]]
+        problem.feature_vector(1).should == [[1, -1], [100_001, 1]]
+      end
+
+      it 'should raise argument error for an unknown storage' do
+        expect {RubyLinear::Problem.new(@labels, @samples, -1, @max_feature, :storage => :half)}.to raise_error(ArgumentError, /storage/)
+      end
+    end
+
     context 'when the bias is > 0' do
       it 'should add a  bias term to each vextor' do
         problem = RubyLinear::Problem.new(@labels, @samples, 1.0, @max_feature)
@@ -7,4 +7,68 @@ require 'ruby_linear'
 
 RSpec.configure do |config|
   
-end
\ No newline at end of file
+end
+
+# A minimal Fiber scheduler, enough to check that loading does not block the other fibers:
+# runs the fibers scheduled on it, waits for threads and sleeps, but does no I/O of its own
+class TestScheduler
+  def initialize
+    @blocked = {}
+    @sleeping = {}
+    @unblocked = Queue.new
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(:blocking => false, &block)
+    fiber.resume
+    fiber
+  end
+
+  # the blocked fibers are kept here until they are unblocked, or the garbage collector
+  # would free them
+  def block(blocker, timeout = nil)
+    @blocked[Fiber.current] = blocker
+    Fiber.yield
+  ensure
+    @blocked.delete(Fiber.current)
+  end
+
+  def unblock(blocker, fiber)
+    @unblocked << fiber
+  end
+
+  def kernel_sleep(duration = nil)
+    @sleeping[Fiber.current] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+    Fiber.yield
+  end
+
+  def io_wait(io, events, timeout)
+    raise NotImplementedError
+  end
+
+  def run
+    until @blocked.empty? && @sleeping.empty? && @unblocked.empty?
+      @unblocked.pop.resume until @unblocked.empty?
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      @sleeping.select {|fiber, time| time <= now}.each_key do |fiber|
+        @sleeping.delete(fiber)
+        fiber.resume
+      end
+      sleep 0.001
+    end
+  end
+
+  def close
+    run
+  end
+
+  # runs the block with a TestScheduler on the current thread, until all its fibers are done
+  def self.run
+    Thread.new do
+      scheduler = new
+      Fiber.set_scheduler(scheduler)
+      yield
+      scheduler.run
+    end.join
+  end
+end
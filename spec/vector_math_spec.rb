@@ -0,0 +1,58 @@
+require 'spec_helper'
+
+describe(RubyLinear::VectorMath) do
+  around(:each) do |example|
+    current = RubyLinear::VectorMath.current
+    begin
+      example.run
+    ensure
+      RubyLinear::VectorMath.use(current)
+    end
+  end
+
+  let(:lengths) {[0, 1, 3, 7, 8, 15, 16, 33, 1001]}
+
+  def vector(n, scale)
+    Array.new(n) {(rand * 2 - 1) * scale}
+  end
+
+  it 'should use the fastest kernels the cpu supports' do
+    RubyLinear::VectorMath.kernels.first.should == :libm
+    RubyLinear::VectorMath.current.should == RubyLinear::VectorMath.kernels.last
+  end
+
+  it 'should raise argument error for unsupported kernels' do
+    expect {RubyLinear::VectorMath.use(:sse1)}.to raise_error(ArgumentError)
+  end
+
+  RubyLinear::VectorMath.kernels.each do |kernels|
+    context "with the #{kernels} kernels" do
+      before(:each) do
+        RubyLinear::VectorMath.use(kernels)
+      end
+
+      it 'should compute exp and log1p within a few units in the last place' do
+        lengths.each do |n|
+          x = vector(n, 700)
+          RubyLinear::VectorMath.exp(x).zip(x).each {|y, v| y.should be_within(Math.exp(v) * 1e-15).of(Math.exp(v))}
+          x = vector(n, 1).map {|v| v.abs * 1e6 - 0.999}
+          RubyLinear::VectorMath.log1p(x).zip(x).each {|y, v| y.should be_within(Math.log(1 + v).abs * 1e-15).of(Math.log(1 + v))}
+        end
+      end
+
+      it 'should handle the limits of the functions' do
+        RubyLinear::VectorMath.exp([-1000.0, 0.0, 1000.0]).should == [0.0, 1.0, Float::INFINITY]
+        RubyLinear::VectorMath.log1p([-1.0, 0.0, 1e-20, Float::INFINITY]).should == [-Float::INFINITY, 0.0, 1e-20, Float::INFINITY]
+        RubyLinear::VectorMath.log1p([-2.0]).first.should be_nan
+      end
+
+      it 'should train about the same model' do
+        problem = RubyLinear::Problem.load_file(File.dirname(__FILE__) + '/fixtures/dna.scale.txt', 1.0)
+        model = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR)
+        RubyLinear::VectorMath.use(:libm)
+        reference = RubyLinear::Model.new(problem, :solver => RubyLinear::L2R_LR)
+        model.weights.zip(reference.weights).each {|a, b| a.should be_within(1e-6).of(b)}
+      end
+    end
+  end
+end